@@ -0,0 +1,167 @@
+#include "admission.h"
+#include "clock.h"
+#include "metrics.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define ADMISSION_GROUPS (ADMISSION_TABLE_SIZE / ADMISSION_GROUP_SIZE)
+
+static Metric shed_author_total =
+    METRIC_COUNTER_INIT("muse_admission_shed_author_total",
+                        "Link messages shed by the per-author rate limit");
+static Metric shed_channel_total =
+    METRIC_COUNTER_INIT("muse_admission_shed_channel_total",
+                        "Link messages shed by the per-channel rate limit");
+static Metric shed_pending_total =
+    METRIC_COUNTER_INIT("muse_admission_shed_pending_total",
+                        "Link lookups shed by the pending lookup limit");
+
+static void bucket_map_init(AdmissionBucketMap *map, int32_t burst,
+                            int32_t per_minute) {
+    for (int32_t i = 0; i < ADMISSION_LOCK_STRIPES; i++) {
+        pthread_mutex_init(&map->locks[i], NULL);
+    }
+    memset(map->buckets, 0, sizeof(map->buckets));
+    map->burst = burst;
+    map->per_minute = per_minute;
+}
+
+static void bucket_map_destroy(AdmissionBucketMap *map) {
+    for (int32_t i = 0; i < ADMISSION_LOCK_STRIPES; i++) {
+        pthread_mutex_destroy(&map->locks[i]);
+    }
+}
+
+static int32_t bucket_refill(const AdmissionBucketMap *map,
+                             const AdmissionBucket *bucket, uint64_t now) {
+    int64_t max_milli = (int64_t)map->burst * 1000;
+    int64_t elapsed = (int64_t)(now - bucket->updated_ms);
+    // per_minute tokens per 60000 ms is per_minute / 60 millitokens per ms
+    int64_t tokens = bucket->tokens_milli + elapsed * map->per_minute / 60;
+    return (int32_t)(tokens < max_milli ? tokens : max_milli);
+}
+
+static bool bucket_map_take(AdmissionBucketMap *map, uint64_t key,
+                            uint64_t now) {
+    // Snowflakes grow with time, mix them before picking a group
+    size_t group = (size_t)((key * 0x9E3779B97F4A7C15ULL) >> 32) %
+                   ADMISSION_GROUPS;
+    AdmissionBucket *slots = &map->buckets[group * ADMISSION_GROUP_SIZE];
+    AdmissionBucket *bucket = NULL;
+    AdmissionBucket *victim = &slots[0];
+    int32_t full_milli = map->burst * 1000;
+    bool taken = false;
+
+    pthread_mutex_t *lock = &map->locks[group % ADMISSION_LOCK_STRIPES];
+    pthread_mutex_lock(lock);
+
+    for (int32_t i = 0; i < ADMISSION_GROUP_SIZE; i++) {
+        if (slots[i].key == key) {
+            bucket = &slots[i];
+            break;
+        }
+        // Prefer empty slots, then expired ones, then the least recent
+        if (victim->key == 0)
+            continue;
+        if (slots[i].key == 0 ||
+            slots[i].updated_ms < victim->updated_ms ||
+            bucket_refill(map, &slots[i], now) == full_milli)
+            victim = &slots[i];
+    }
+
+    if (!bucket) {
+        bucket = victim;
+        bucket->key = key;
+        bucket->tokens_milli = full_milli;
+    } else {
+        bucket->tokens_milli = bucket_refill(map, bucket, now);
+    }
+    bucket->updated_ms = now;
+
+    if (bucket->tokens_milli >= 1000) {
+        bucket->tokens_milli -= 1000;
+        taken = true;
+    }
+
+    pthread_mutex_unlock(lock);
+    return taken;
+}
+
+void admission_init(AdmissionControl *ac) {
+    bucket_map_init(&ac->authors, ADMISSION_AUTHOR_BURST,
+                    ADMISSION_AUTHOR_PER_MINUTE);
+    bucket_map_init(&ac->channels, ADMISSION_CHANNEL_BURST,
+                    ADMISSION_CHANNEL_PER_MINUTE);
+    atomic_init(&ac->pending_lookups, 0);
+    ac->max_pending_lookups = ADMISSION_MAX_PENDING_LOOKUPS;
+
+    metrics_register(&shed_author_total);
+    metrics_register(&shed_channel_total);
+    metrics_register(&shed_pending_total);
+}
+
+static void bucket_map_set_rate(AdmissionBucketMap *map, int32_t burst,
+                                int32_t per_minute, int32_t default_rate) {
+    if (per_minute < 1)
+        return;
+    int64_t scaled = (int64_t)burst * per_minute / default_rate;
+    map->burst = scaled > burst ? (int32_t)scaled : burst;
+    map->per_minute = per_minute;
+}
+
+void admission_set_limits(AdmissionControl *ac, int32_t channel_per_minute,
+                          int32_t author_per_minute,
+                          int32_t max_pending_lookups) {
+    bucket_map_set_rate(&ac->channels, ADMISSION_CHANNEL_BURST,
+                        channel_per_minute, ADMISSION_CHANNEL_PER_MINUTE);
+    bucket_map_set_rate(&ac->authors, ADMISSION_AUTHOR_BURST,
+                        author_per_minute, ADMISSION_AUTHOR_PER_MINUTE);
+    if (max_pending_lookups > 0)
+        ac->max_pending_lookups = max_pending_lookups;
+}
+
+AdmissionResult admission_check_message(AdmissionControl *ac,
+                                        const char *channel_id,
+                                        const char *author_id) {
+    uint64_t now = clock_now_ms();
+    uint64_t author = strtoull(author_id, NULL, 10);
+    uint64_t channel = strtoull(channel_id, NULL, 10);
+
+    // Authors first, so a spammer spends their own budget before the
+    // channel's
+    if (author && !bucket_map_take(&ac->authors, author, now)) {
+        metric_add(&shed_author_total, 1);
+        return ADMISSION_SHED_AUTHOR;
+    }
+    if (channel && !bucket_map_take(&ac->channels, channel, now)) {
+        metric_add(&shed_channel_total, 1);
+        return ADMISSION_SHED_CHANNEL;
+    }
+
+    return ADMISSION_ACCEPT;
+}
+
+AdmissionResult admission_acquire_lookup(AdmissionControl *ac) {
+    int pending = atomic_load_explicit(&ac->pending_lookups,
+                                       memory_order_relaxed);
+    do {
+        if (pending >= ac->max_pending_lookups) {
+            metric_add(&shed_pending_total, 1);
+            return ADMISSION_SHED_PENDING;
+        }
+    } while (!atomic_compare_exchange_weak_explicit(
+        &ac->pending_lookups, &pending, pending + 1, memory_order_relaxed,
+        memory_order_relaxed));
+
+    return ADMISSION_ACCEPT;
+}
+
+void admission_release_lookup(AdmissionControl *ac) {
+    atomic_fetch_sub_explicit(&ac->pending_lookups, 1, memory_order_relaxed);
+}
+
+void admission_destroy(AdmissionControl *ac) {
+    bucket_map_destroy(&ac->authors);
+    bucket_map_destroy(&ac->channels);
+}
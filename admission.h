@@ -0,0 +1,72 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Token buckets per channel and per author, in fixed tables. Keys hash to a
+// group of ADMISSION_GROUP_SIZE slots guarded by one lock stripe. A slot
+// whose bucket would have refilled completely is free again, and a full
+// group evicts its least recently used bucket.
+#define ADMISSION_TABLE_SIZE (4096)
+#define ADMISSION_GROUP_SIZE (8)
+#define ADMISSION_LOCK_STRIPES (16)
+
+#define ADMISSION_CHANNEL_BURST (5)
+#define ADMISSION_CHANNEL_PER_MINUTE (30)
+#define ADMISSION_AUTHOR_BURST (3)
+#define ADMISSION_AUTHOR_PER_MINUTE (12)
+// Songlink lookups and their replies in flight across all workers
+#define ADMISSION_MAX_PENDING_LOOKUPS (256)
+
+typedef enum {
+    ADMISSION_ACCEPT,
+    ADMISSION_SHED_AUTHOR,
+    ADMISSION_SHED_CHANNEL,
+    ADMISSION_SHED_PENDING,
+    ADMISSION_RESULT_COUNT,
+} AdmissionResult;
+
+typedef struct {
+    // Snowflake, 0 marks an empty slot
+    uint64_t key;
+    uint64_t updated_ms;
+    // Thousandths of a token
+    int32_t tokens_milli;
+} AdmissionBucket;
+
+typedef struct {
+    pthread_mutex_t locks[ADMISSION_LOCK_STRIPES];
+    AdmissionBucket buckets[ADMISSION_TABLE_SIZE];
+    int32_t burst;
+    int32_t per_minute;
+} AdmissionBucketMap;
+
+typedef struct {
+    AdmissionBucketMap authors;
+    AdmissionBucketMap channels;
+    atomic_int pending_lookups;
+    int32_t max_pending_lookups;
+} AdmissionControl;
+
+void admission_init(AdmissionControl *ac);
+// Replace the ADMISSION_* defaults before the first message, e.g. to lift
+// them against a stand-in. Bursts keep their ratio to the rate, values below
+// 1 keep the default.
+void admission_set_limits(AdmissionControl *ac, int32_t channel_per_minute,
+                          int32_t author_per_minute,
+                          int32_t max_pending_lookups);
+// Takes a token from the author's and the channel's buckets. Neither ID is
+// copied, nothing is allocated.
+AdmissionResult admission_check_message(AdmissionControl *ac,
+                                        const char *channel_id,
+                                        const char *author_id);
+// Reserves a pending lookup slot, release it once the lookup's reply is
+// posted or dropped, or the lookup turns out not to be needed
+AdmissionResult admission_acquire_lookup(AdmissionControl *ac);
+void admission_release_lookup(AdmissionControl *ac);
+void admission_destroy(AdmissionControl *ac);
+
+#endif // ADMISSION_H
@@ -0,0 +1,146 @@
+#include "alloc.h"
+
+#ifdef ALLOC_STATS
+
+#include "metrics.h"
+
+#include <cjson/cJSON.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Keeps the allocation behind it aligned like malloc's
+typedef struct {
+    _Alignas(max_align_t) size_t size;
+    AllocTag tag;
+} AllocHeader;
+
+typedef struct {
+    Metric live_bytes;
+    Metric peak_bytes;
+    Metric allocations_total;
+    Metric bytes_total;
+    // Live bytes as one number, the gauge's are spread over metric shards
+    atomic_int_fast64_t live;
+} AllocStats;
+
+#define ALLOC_STATS_INIT(tag_name)                                             \
+    {                                                                          \
+        .live_bytes = METRIC_GAUGE_INIT(                                       \
+            "muse_alloc_" tag_name "_live_bytes",                              \
+            "Bytes allocated for " tag_name " and not yet freed"),             \
+        .peak_bytes = METRIC_GAUGE_INIT(                                       \
+            "muse_alloc_" tag_name "_peak_bytes",                              \
+            "Highest live bytes allocated for " tag_name),                     \
+        .allocations_total = METRIC_COUNTER_INIT(                              \
+            "muse_alloc_" tag_name "_allocations_total",                       \
+            "Allocations and reallocations for " tag_name),                    \
+        .bytes_total = METRIC_COUNTER_INIT(                                    \
+            "muse_alloc_" tag_name "_bytes_total",                             \
+            "Bytes requested by allocations for " tag_name),                   \
+    }
+
+static AllocStats stats[ALLOC_TAG_COUNT] = {
+    [ALLOC_OTHER] = ALLOC_STATS_INIT("other"),
+    [ALLOC_TRANSPORT] = ALLOC_STATS_INIT("transport"),
+    [ALLOC_GATEWAY] = ALLOC_STATS_INIT("gateway"),
+    [ALLOC_REST] = ALLOC_STATS_INIT("rest"),
+    [ALLOC_LINKS] = ALLOC_STATS_INIT("links"),
+};
+
+static _Thread_local AllocTag scope_tag;
+
+static void account(AllocTag tag, int64_t delta) {
+    AllocStats *s = &stats[tag];
+
+    metric_add(&s->live_bytes, delta);
+    int64_t live = atomic_fetch_add_explicit(&s->live, delta,
+                                             memory_order_relaxed) +
+                   delta;
+    if (delta > 0) {
+        metric_add(&s->allocations_total, 1);
+        metric_add(&s->bytes_total, delta);
+        metric_set_max(&s->peak_bytes, live);
+    }
+}
+
+static void *json_malloc(size_t size) { return alloc_malloc(scope_tag, size); }
+
+void alloc_init(void) {
+    cJSON_Hooks hooks = {.malloc_fn = json_malloc, .free_fn = alloc_free};
+
+    for (int32_t i = 0; i < ALLOC_TAG_COUNT; i++) {
+        metrics_register(&stats[i].live_bytes);
+        metrics_register(&stats[i].peak_bytes);
+        metrics_register(&stats[i].allocations_total);
+        metrics_register(&stats[i].bytes_total);
+    }
+    cJSON_InitHooks(&hooks);
+}
+
+void *alloc_malloc(AllocTag tag, size_t size) {
+    AllocHeader *header = malloc(sizeof(*header) + size);
+    if (!header)
+        return NULL;
+
+    header->size = size;
+    header->tag = tag;
+    account(tag, (int64_t)size);
+    return header + 1;
+}
+
+void *alloc_calloc(AllocTag tag, size_t count, size_t size) {
+    if (size != 0 && count > SIZE_MAX / size)
+        return NULL;
+
+    void *ptr = alloc_malloc(tag, count * size);
+    if (ptr)
+        memset(ptr, 0, count * size);
+    return ptr;
+}
+
+void *alloc_realloc(AllocTag tag, void *ptr, size_t size) {
+    if (!ptr)
+        return alloc_malloc(tag, size);
+
+    AllocHeader *header = (AllocHeader *)ptr - 1;
+    AllocTag old_tag = header->tag;
+    size_t old_size = header->size;
+
+    header = realloc(header, sizeof(*header) + size);
+    if (!header)
+        return NULL;
+
+    account(old_tag, -(int64_t)old_size);
+    header->size = size;
+    header->tag = tag;
+    account(tag, (int64_t)size);
+    return header + 1;
+}
+
+char *alloc_strdup(AllocTag tag, const char *str) {
+    size_t size = strlen(str) + 1;
+    char *copy = alloc_malloc(tag, size);
+    if (copy)
+        memcpy(copy, str, size);
+    return copy;
+}
+
+void alloc_free(void *ptr) {
+    if (!ptr)
+        return;
+
+    AllocHeader *header = (AllocHeader *)ptr - 1;
+    account(header->tag, -(int64_t)header->size);
+    free(header);
+}
+
+AllocTag alloc_scope_enter(AllocTag tag) {
+    AllocTag previous = scope_tag;
+    scope_tag = tag;
+    return previous;
+}
+
+void alloc_scope_exit(AllocTag previous) { scope_tag = previous; }
+
+#endif // ALLOC_STATS
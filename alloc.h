@@ -0,0 +1,58 @@
+#ifndef ALLOC_H
+#define ALLOC_H
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Subsystems allocations are accounted to
+typedef enum {
+    // cJSON trees parsed outside any alloc_scope_enter
+    ALLOC_OTHER,
+    // Request and socket contexts, response and websocket message buffers
+    ALLOC_TRANSPORT,
+    // Gateway frames queued for a pipeline and their cJSON trees
+    ALLOC_GATEWAY,
+    // JSON writer buffers, queued REST requests and reply jobs
+    ALLOC_REST,
+    // Matched links, Songlink responses, MusicLinks strings and lookups
+    ALLOC_LINKS,
+    ALLOC_TAG_COUNT,
+} AllocTag;
+
+#ifdef ALLOC_STATS
+
+// Allocation accounting, built with -DALLOC_STATS (make ALLOC_STATS=1).
+// Each allocation carries its size and tag in a header, so it may be freed
+// by another subsystem than the one it is accounted to, but only with
+// alloc_free. Live bytes, peak live bytes and allocation counts per tag are
+// exported as muse_alloc_* metrics.
+
+// Installs the cJSON hooks, before the first cJSON call
+void alloc_init(void);
+void *alloc_malloc(AllocTag tag, size_t size);
+void *alloc_calloc(AllocTag tag, size_t count, size_t size);
+// Accounts the whole new size to tag, whatever ptr's tag was
+void *alloc_realloc(AllocTag tag, void *ptr, size_t size);
+char *alloc_strdup(AllocTag tag, const char *str);
+void alloc_free(void *ptr);
+// cJSON allocations on the calling thread go to tag until alloc_scope_exit
+// is passed the returned previous tag
+AllocTag alloc_scope_enter(AllocTag tag);
+void alloc_scope_exit(AllocTag previous);
+
+#else
+
+// Compiled out, the wrappers are the plain allocator
+#define alloc_init() ((void)0)
+#define alloc_malloc(tag, size) ((void)(tag), malloc(size))
+#define alloc_calloc(tag, count, size) ((void)(tag), calloc(count, size))
+#define alloc_realloc(tag, ptr, size) ((void)(tag), realloc(ptr, size))
+#define alloc_strdup(tag, str) ((void)(tag), strdup(str))
+#define alloc_free(ptr) free(ptr)
+#define alloc_scope_enter(tag) (tag)
+#define alloc_scope_exit(previous) ((void)(previous))
+
+#endif // ALLOC_STATS
+
+#endif // ALLOC_H
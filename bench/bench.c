@@ -0,0 +1,368 @@
+// Microbenchmarks for the hot paths, run with `make bench`. Each benchmark
+// cycles through a checked-in corpus and prints one JSON object per line:
+// name, iterations, ns/op, allocations/op and bytes allocated/op.
+//
+// Usage: muse_bench [corpus_dir] [name_filter]
+
+#include "alloc.h"
+#include "buffer.h"
+#include "discord.h"
+#include "json_writer.h"
+#include "links.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define DEFAULT_CORPUS_DIR ("bench/corpus")
+#define MAX_CORPUS_ENTRIES (256)
+// Each benchmark is grown until one run takes at least this long
+#define MIN_RUN_NS (500000000LL)
+#define MAX_ITERATIONS (1000000000LL)
+// Size of the chunks curl hands the HTTP write callback
+#define RESPONSE_CHUNK_SIZE (1024)
+
+// glibc's allocator, wrapped below so every allocation in the process,
+// including cJSON's and libc's own, is counted
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static bool counting;
+static int64_t alloc_count;
+static int64_t alloc_bytes;
+
+void *malloc(size_t size) {
+    if (counting) {
+        alloc_count++;
+        alloc_bytes += (int64_t)size;
+    }
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+    if (counting) {
+        alloc_count++;
+        alloc_bytes += (int64_t)(count * size);
+    }
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    if (counting) {
+        alloc_count++;
+        alloc_bytes += (int64_t)size;
+    }
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) { __libc_free(ptr); }
+
+typedef struct {
+    char *data;
+    size_t length;
+} CorpusEntry;
+
+typedef struct {
+    CorpusEntry entries[MAX_CORPUS_ENTRIES];
+    int32_t count;
+} Corpus;
+
+typedef struct {
+    const char *name;
+    // Runs the measured operation iterations times
+    void (*run)(int64_t iterations);
+} Benchmark;
+
+static Corpus messages;
+static Corpus gateway_frames;
+static Corpus songlink_responses;
+static cJSON *songlink_trees[MAX_CORPUS_ENTRIES];
+static MusicLinks parsed_links[MAX_CORPUS_ENTRIES];
+static JSONWriter writer;
+
+// Keeps results observable so the measured calls aren't optimized out
+static volatile uint64_t sink;
+
+static int64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// One entry per non-empty line
+static bool corpus_load(Corpus *corpus, const char *dir, const char *name) {
+    char path[512];
+    char *line = NULL;
+    size_t capacity = 0;
+    ssize_t length;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "error: cannot open %s\n", path);
+        return false;
+    }
+
+    while ((length = getline(&line, &capacity, file)) > 0 &&
+           corpus->count < MAX_CORPUS_ENTRIES) {
+        while (length > 0 && (line[length - 1] == '\n' ||
+                              line[length - 1] == '\r')) {
+            line[--length] = '\0';
+        }
+        if (length == 0)
+            continue;
+
+        CorpusEntry *entry = &corpus->entries[corpus->count++];
+        entry->data = strdup(line);
+        entry->length = (size_t)length;
+    }
+    free(line);
+    fclose(file);
+
+    if (corpus->count == 0) {
+        fprintf(stderr, "error: %s is empty\n", path);
+        return false;
+    }
+    return true;
+}
+
+static void corpus_free(Corpus *corpus) {
+    for (int32_t i = 0; i < corpus->count; i++) {
+        free(corpus->entries[i].data);
+    }
+    corpus->count = 0;
+}
+
+static void bench_is_music_link(int64_t iterations) {
+    for (int64_t i = 0; i < iterations; i++) {
+        const CorpusEntry *entry = &messages.entries[i % messages.count];
+        char *url = NULL;
+        if (is_music_link(entry->data, &url)) {
+            sink += (uint64_t)url[0];
+            alloc_free(url);
+        }
+    }
+}
+
+// Encodes whole messages, longer than the links muse looks up
+static void bench_music_links_lookup_url(int64_t iterations) {
+    char url[SONGLINK_URL_SIZE];
+
+    for (int64_t i = 0; i < iterations; i++) {
+        const CorpusEntry *entry = &messages.entries[i % messages.count];
+        if (music_links_lookup_url(entry->data, url, sizeof(url)))
+            sink += (uint64_t)url[0];
+    }
+}
+
+static void bench_gateway_event_parse(int64_t iterations) {
+    for (int64_t i = 0; i < iterations; i++) {
+        CorpusEntry *entry =
+            &gateway_frames.entries[i % gateway_frames.count];
+        GatewayEventPayload payload = {0};
+        if (gateway_event_parse((uint8_t *)entry->data, entry->length,
+                                &payload)) {
+            sink += (uint64_t)payload.op;
+        }
+        gateway_event_cleanup(&payload);
+    }
+}
+
+// Mirrors the embed muse builds for a Songlink result
+static void links_embed(const MusicLinks *links, DiscordEmbed *embed,
+                        DiscordEmbedField *fields) {
+    size_t field_count = 0;
+
+    if (links->spotify_url) {
+        fields[field_count++] =
+            (DiscordEmbedField){"Spotify", links->spotify_url, false};
+    }
+    if (links->youtube_url) {
+        fields[field_count++] =
+            (DiscordEmbedField){"YouTube", links->youtube_url, false};
+    }
+    if (links->apple_music_url) {
+        fields[field_count++] =
+            (DiscordEmbedField){"Apple Music", links->apple_music_url, false};
+    }
+
+    *embed = (DiscordEmbed){
+        .title = "Music Links",
+        .type = "rich",
+        .description = "Here are the available music links:",
+        .color = 0x35556e,
+        .thumbnail = {.url = links->thumbnail_url},
+        .fields = fields,
+        .field_count = field_count,
+    };
+}
+
+// A reply carrying 1 to MAX_MESSAGE_EMBEDS results, serialized into a
+// writer reused across iterations as the pipeline threads do
+static void bench_rest_create_message(int64_t iterations) {
+    DiscordEmbedField fields[MAX_MESSAGE_EMBEDS][3];
+    DiscordEmbed embeds[MAX_MESSAGE_EMBEDS];
+
+    for (int32_t i = 0; i < MAX_MESSAGE_EMBEDS; i++) {
+        links_embed(&parsed_links[i % songlink_responses.count], &embeds[i],
+                    fields[i]);
+    }
+
+    for (int64_t i = 0; i < iterations; i++) {
+        DiscordCreateMessage message = {
+            .content = "",
+            .nonce = (int32_t)i,
+            .embeds = embeds,
+            .embed_count = (size_t)(i % MAX_MESSAGE_EMBEDS) + 1,
+        };
+        rest_create_message(&writer, &message);
+        sink += writer.length;
+    }
+}
+
+static void bench_parse_music_links_response(int64_t iterations) {
+    for (int64_t i = 0; i < iterations; i++) {
+        MusicLinks links = {0};
+        parse_music_links_response(
+            songlink_trees[i % songlink_responses.count], &links);
+        sink += (uint64_t)(links.spotify_url != NULL);
+        music_links_free(&links);
+    }
+}
+
+// The whole Songlink response path: body to cJSON tree to MusicLinks
+static void bench_songlink_response(int64_t iterations) {
+    for (int64_t i = 0; i < iterations; i++) {
+        const CorpusEntry *entry =
+            &songlink_responses.entries[i % songlink_responses.count];
+        MusicLinks links = {0};
+        cJSON *json = cJSON_ParseWithLength(entry->data, entry->length);
+        parse_music_links_response(json, &links);
+        sink += (uint64_t)(links.spotify_url != NULL);
+        music_links_free(&links);
+        cJSON_Delete(json);
+    }
+}
+
+typedef struct {
+    uint8_t *data;
+    size_t length;
+    size_t capacity;
+} ResponseBuffer;
+
+// A response body arriving in chunks into a fresh buffer, as an HTTP
+// request's does
+static void bench_buffer_append(int64_t iterations) {
+    for (int64_t i = 0; i < iterations; i++) {
+        const CorpusEntry *entry =
+            &songlink_responses.entries[i % songlink_responses.count];
+        ResponseBuffer buffer = {0};
+
+        for (size_t offset = 0; offset < entry->length;
+             offset += RESPONSE_CHUNK_SIZE) {
+            size_t chunk_size = entry->length - offset < RESPONSE_CHUNK_SIZE
+                                    ? entry->length - offset
+                                    : RESPONSE_CHUNK_SIZE;
+            buffer_append(&buffer, entry->data + offset, chunk_size);
+        }
+        sink += buffer.length;
+        free(buffer.data);
+    }
+}
+
+static const Benchmark BENCHMARKS[] = {
+    {"is_music_link", bench_is_music_link},
+    {"music_links_lookup_url", bench_music_links_lookup_url},
+    {"gateway_event_parse", bench_gateway_event_parse},
+    {"rest_create_message", bench_rest_create_message},
+    {"parse_music_links_response", bench_parse_music_links_response},
+    {"songlink_response", bench_songlink_response},
+    {"buffer_append", bench_buffer_append},
+};
+
+static void run_benchmark(const Benchmark *bench) {
+    int64_t iterations = 1;
+    int64_t elapsed_ns;
+
+    // Untimed, so one-time setup (metric shards, writer growth) is excluded
+    bench->run(1);
+
+    for (;;) {
+        alloc_count = 0;
+        alloc_bytes = 0;
+        counting = true;
+        int64_t started_ns = now_ns();
+        bench->run(iterations);
+        elapsed_ns = now_ns() - started_ns;
+        counting = false;
+
+        if (elapsed_ns >= MIN_RUN_NS || iterations >= MAX_ITERATIONS)
+            break;
+
+        // Aim 20% past the target, growing at most 100x per round
+        int64_t next = elapsed_ns > 0
+                           ? (int64_t)((double)iterations * 1.2 *
+                                       (double)MIN_RUN_NS /
+                                       (double)elapsed_ns)
+                           : iterations * 100;
+        if (next > iterations * 100)
+            next = iterations * 100;
+        if (next <= iterations)
+            next = iterations + 1;
+        iterations = next < MAX_ITERATIONS ? next : MAX_ITERATIONS;
+    }
+
+    printf("{\"name\":\"%s\",\"iterations\":%lld,\"ns_per_op\":%.1f,"
+           "\"allocs_per_op\":%.2f,\"bytes_per_op\":%.1f}\n",
+           bench->name, (long long)iterations,
+           (double)elapsed_ns / (double)iterations,
+           (double)alloc_count / (double)iterations,
+           (double)alloc_bytes / (double)iterations);
+    fflush(stdout);
+}
+
+int main(int argc, char *argv[]) {
+    const char *corpus_dir = argc > 1 ? argv[1] : DEFAULT_CORPUS_DIR;
+    const char *filter = argc > 2 ? argv[2] : NULL;
+    int status = 1;
+
+    if (!corpus_load(&messages, corpus_dir, "messages.txt") ||
+        !corpus_load(&gateway_frames, corpus_dir, "gateway.jsonl") ||
+        !corpus_load(&songlink_responses, corpus_dir, "songlink.jsonl"))
+        goto cleanup;
+
+    for (int32_t i = 0; i < songlink_responses.count; i++) {
+        songlink_trees[i] =
+            cJSON_ParseWithLength(songlink_responses.entries[i].data,
+                                  songlink_responses.entries[i].length);
+        if (!songlink_trees[i]) {
+            fprintf(stderr, "error: songlink.jsonl line %d is not JSON\n",
+                    i + 1);
+            goto cleanup;
+        }
+        parse_music_links_response(songlink_trees[i], &parsed_links[i]);
+    }
+
+    for (size_t i = 0; i < sizeof(BENCHMARKS) / sizeof(BENCHMARKS[0]); i++) {
+        if (filter && !strstr(BENCHMARKS[i].name, filter))
+            continue;
+        run_benchmark(&BENCHMARKS[i]);
+    }
+    status = 0;
+
+cleanup:
+    for (int32_t i = 0; i < songlink_responses.count; i++) {
+        music_links_free(&parsed_links[i]);
+        cJSON_Delete(songlink_trees[i]);
+    }
+    json_writer_free(&writer);
+    corpus_free(&messages);
+    corpus_free(&gateway_frames);
+    corpus_free(&songlink_responses);
+    return status;
+}
@@ -1,11 +1,21 @@
+// For pthread_setaffinity_np
+#define _GNU_SOURCE
+
 #include "bot.h"
+#include "alloc.h"
+#include "clock.h"
+#include "hash.h"
+#include "log.h"
+#include "metrics.h"
+#include "stall.h"
 
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <time.h>
 
 #define API_BASE_URL ("https://discord.com/api/v10")
+#define GATEWAY_QUERY ("/?v=10&encoding=json")
 
 #ifdef _WIN32
 #define OS_NAME ("windows")
@@ -13,104 +23,803 @@
 #define OS_NAME ("linux")
 #endif
 
-static char url_buffer[2048];
-static const size_t base_url_len = sizeof(API_BASE_URL) - 1;
-
-static const char *format_url(const char *fmt, ...) {
+// Writes the bot's API base URL + path into the caller's buffer, NULL if it
+// won't fit
+static const char *format_url(MuseBot *bot, char *url_buffer, size_t size,
+                              const char *fmt, ...) {
+    size_t base_url_len = strlen(bot->api_base_url);
     va_list ap;
 
-    if (base_url_len >= sizeof(url_buffer)) {
+    if (base_url_len >= size) {
         return NULL;
     }
 
-    memcpy(url_buffer, API_BASE_URL, base_url_len);
+    memcpy(url_buffer, bot->api_base_url, base_url_len);
 
     va_start(ap, fmt);
-    int n = vsnprintf(url_buffer + base_url_len,
-                      sizeof url_buffer - base_url_len, fmt, ap);
+    int n = vsnprintf(url_buffer + base_url_len, size - base_url_len, fmt, ap);
     va_end(ap);
 
-    if (n < 0 || (size_t)n >= sizeof url_buffer - base_url_len) {
+    if (n < 0 || (size_t)n >= size - base_url_len) {
         return NULL;
     }
 
     return url_buffer;
 }
 
-static uint64_t get_now_ms(void) {
-#ifndef _WIN32
-    struct timespec ts;
-    clock_gettime(CLOCK_MONOTONIC, &ts);
-    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
-#else
-    return (uint64_t)GetTickCount64();
-#endif
+static void bot_handle_ready(MuseShard *shard, const char *event_name,
+                             const cJSON *data_json);
+static void bot_handle_resumed(MuseShard *shard, const char *event_name,
+                               const cJSON *data_json);
+static void bot_start_workers(MuseBot *bot);
+static void worker_rest_flush(MuseWorker *worker);
+static void handle_gateway_op(MuseShard *shard,
+                              const GatewayEventPayload *payload);
+static void handle_dispatch_event(MuseShard *shard,
+                                  const GatewayEventPayload *payload);
+
+static struct curl_slist *headers_append(struct curl_slist *headers,
+                                         const char *header) {
+    struct curl_slist *appended = curl_slist_append(headers, header);
+    if (!appended) {
+        fprintf(stderr, "error: out of memory");
+        exit(1);
+    }
+    return appended;
+}
+
+static void bot_build_headers(MuseBot *bot) {
+    char auth_header[256];
+    snprintf(auth_header, sizeof(auth_header), "Authorization: Bot %s",
+             bot->token);
+    bot->auth_headers = headers_append(NULL, auth_header);
+    bot->json_headers = headers_append(NULL, auth_header);
+    bot->json_headers =
+        headers_append(bot->json_headers, "Content-Type: application/json");
 }
 
 void bot_init(MuseBot *bot, MuseTransport *ts, const char *token,
-              int32_t intents, BotEventCallbacks callbacks) {
+              int32_t intents) {
     bot->ts = ts;
     bot->token = token;
     bot->intents = intents;
-    bot->callbacks = callbacks;
+    bot->api_base_url = API_BASE_URL;
+    bot_build_headers(bot);
     bot->is_running = true;
-    bot->is_connected = false;
-    bot->last_seq = -1;
+    bot->requested_worker_count = 1;
+    pthread_mutex_init(&bot->identify_lock, NULL);
+    pthread_mutex_init(&bot->rest_limiter.lock, NULL);
+    bot->rest_limiter.global_limit_per_sec = REST_GLOBAL_LIMIT_PER_SEC;
+    pthread_mutex_init(&bot->session_lock, NULL);
+    pthread_cond_init(&bot->session_cond, NULL);
+    bot->started_ms = clock_now_ms();
+
+    bot->ready_hash = gateway_event_name_hash("READY", &bot->ready_length);
+    bot->resumed_hash =
+        gateway_event_name_hash("RESUMED", &bot->resumed_length);
+
+    // The bot's own session bookkeeping runs before any user handler
+    bot_register_dispatch_handler(bot, "READY", bot_handle_ready);
+    bot_register_dispatch_handler(bot, "RESUMED", bot_handle_resumed);
+}
+
+static DispatchEntry *dispatch_table_find(MuseBot *bot, uint64_t hash,
+                                          size_t name_length) {
+    size_t mask = DISPATCH_TABLE_SIZE - 1;
+
+    for (size_t i = 0; i < DISPATCH_TABLE_SIZE; i++) {
+        DispatchEntry *entry = &bot->dispatch_table[(hash + i) & mask];
+        if (entry->hash == 0 ||
+            (entry->hash == hash && entry->name_length == name_length)) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+bool bot_register_dispatch_handler(MuseBot *bot, const char *event_name,
+                                   DispatchEventHandler handler) {
+    size_t name_length;
+    uint64_t hash = gateway_event_name_hash(event_name, &name_length);
+
+    DispatchEntry *entry = dispatch_table_find(bot, hash, name_length);
+    if (!entry) {
+        log_error(LOG_GATEWAY, "Dispatch table full, cannot register %s",
+                  event_name);
+        return false;
+    }
+
+    if (entry->hash == 0) {
+        entry->hash = hash;
+        entry->name_length = name_length;
+        entry->name = event_name;
+    } else if (strcmp(entry->name, event_name) != 0) {
+        // Lookups compare hashes only, so colliding names are refused here
+        log_error(LOG_GATEWAY, "Dispatch event %s collides with %s", event_name,
+                  entry->name);
+        return false;
+    }
+
+    if (entry->handler_count >= MAX_DISPATCH_HANDLERS) {
+        log_error(LOG_GATEWAY, "Too many handlers for dispatch event %s",
+                  event_name);
+        return false;
+    }
+
+    entry->handlers[entry->handler_count++] = handler;
+    return true;
+}
+
+// Discord hands out bare gateway URLs, the version and encoding are ours
+static void copy_gateway_url(char *dst, size_t size, const char *url) {
+    if (strchr(url, '?')) {
+        snprintf(dst, size, "%s", url);
+    } else {
+        snprintf(dst, size, "%s%s", url, GATEWAY_QUERY);
+    }
 }
 
 void bot_set_gateway_url(MuseBot *bot, const char *url) {
-    strncpy(bot->gateway_url, url, sizeof(bot->gateway_url) - 1);
-    bot->gateway_url[sizeof(bot->gateway_url) - 1] = '\0';
+    copy_gateway_url(bot->gateway_url, sizeof(bot->gateway_url), url);
 }
 
-static void bot_send_heartbeat(MuseBot *bot) {
-    MuseTransport *ts = bot->ts;
-    cJSON *heartbeat_json = gateway_event_heartbeat(bot->last_seq);
-    transport_ws_send_json(ts, heartbeat_json);
-    cJSON_Delete(heartbeat_json);
-    printf("Sent HEARTBEAT with seq %d\n", bot->last_seq);
+void bot_set_api_base_url(MuseBot *bot, const char *url) {
+    bot->api_base_url = url;
 }
 
-static void bot_ensure_connection(MuseBot *bot) {
-    if (!transport_is_ws_open(bot->ts)) {
-        uint64_t now = get_now_ms();
+void bot_set_worker_tick_handler(MuseBot *bot, WorkerTickHandler handler) {
+    bot->worker_tick_handler = handler;
+}
 
-        if (now - bot->last_reconnect_attempt > RECONNECT_INTERVAL_MS) {
-            if (bot->last_reconnect_attempt != 0) {
-                printf("Transport down. Reconnecting...\n");
-            } else {
-                printf("Establishing initial connection...\n");
-            }
-            transport_ws_open(bot->ts, bot->gateway_url);
-            bot->last_reconnect_attempt = now;
+void bot_set_rest_done_handler(MuseBot *bot, RestDoneHandler handler) {
+    bot->rest_done_handler = handler;
+}
 
-            // Reset heartbeat logic on new connection
-            bot->heartbeat_interval_ms = 0;
+void bot_set_pipeline_threads(MuseBot *bot, int32_t thread_count) {
+    if (thread_count < 0)
+        thread_count = 0;
+    if (thread_count > MAX_PIPELINE_THREADS)
+        thread_count = MAX_PIPELINE_THREADS;
+    bot->requested_pipeline_threads = thread_count;
+}
+
+void bot_set_session_file(MuseBot *bot, const char *path) {
+    bot->session_file = path;
+}
+
+void bot_set_shard_count(MuseBot *bot, int32_t shard_count) {
+    bot->requested_shard_count = shard_count > 0 ? shard_count : 0;
+}
+
+void bot_set_rest_global_limit(MuseBot *bot, int32_t per_sec) {
+    bot->rest_limiter.global_limit_per_sec =
+        per_sec > 0 ? per_sec : REST_GLOBAL_LIMIT_PER_SEC;
+}
+
+void bot_set_workers(MuseBot *bot, int32_t worker_count, const int32_t *cpus,
+                     int32_t cpu_count) {
+    if (worker_count < 1)
+        worker_count = 1;
+    if (worker_count > MAX_WORKERS)
+        worker_count = MAX_WORKERS;
+    if (cpu_count > MAX_WORKERS)
+        cpu_count = MAX_WORKERS;
+
+    bot->requested_worker_count = worker_count;
+    bot->worker_cpu_count = cpus ? cpu_count : 0;
+    for (int32_t i = 0; i < bot->worker_cpu_count; i++) {
+        bot->worker_cpus[i] = cpus[i];
+    }
+}
+
+const char *bot_user_id(MuseBot *bot) { return atomic_load(&bot->user_id); }
+
+bool bot_is_idle(MuseBot *bot) {
+    for (int32_t i = 0; i < bot->pipeline.thread_count; i++) {
+        if (task_queue_depth(&bot->pipeline.threads[i].queue) > 0)
+            return false;
+    }
+    for (int32_t i = 0; i < bot->worker_count; i++) {
+        if (task_queue_depth(&bot->workers[i].gateway_tasks) > 0 ||
+            task_queue_depth(&bot->workers[i].http_tasks) > 0 ||
+            atomic_load(&bot->workers[i].gateway_backlog.count) > 0 ||
+            atomic_load(&bot->workers[i].http_backlog.count) > 0)
+            return false;
+    }
+    return true;
+}
+
+static Metric gateway_connected_shards = METRIC_GAUGE_INIT(
+    "muse_gateway_connected_shards", "Shards with an open gateway connection");
+static Metric gateway_reconnects_total = METRIC_COUNTER_INIT(
+    "muse_gateway_reconnects_total",
+    "Gateway connections opened after losing one");
+
+static void shard_on_connect(MuseWebSocket *ws) {
+    MuseShard *shard = (MuseShard *)ws->user_data;
+    if (!shard->is_connected)
+        metric_add(&gateway_connected_shards, 1);
+    shard->is_connected = true;
+    log_info(LOG_GATEWAY, "Shard %d: WebSocket connected!", shard->id);
+}
+
+static Metric gateway_reconnect_ms = METRIC_HISTOGRAM_INIT(
+    "muse_gateway_reconnect_ms",
+    "Time from losing a gateway connection to READY or RESUMED",
+    METRICS_LATENCY_MS_BOUNDS);
+
+static uint64_t shard_random(MuseShard *shard) {
+    uint64_t x = shard->random_state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    shard->random_state = x;
+    return x;
+}
+
+// Resumes at once when Discord asked for the reconnect, otherwise backs off
+// exponentially with full jitter so instances don't retry in lockstep
+static void shard_schedule_reconnect(MuseShard *shard, uint64_t now) {
+    // Only the first attempt skips the backoff, a resume that keeps failing
+    // must not spin
+    bool resume_now = shard->reconnect_now && shard->session_id &&
+                      shard->reconnect_attempts == 0;
+    shard->reconnect_now = false;
+
+    if (resume_now) {
+        shard->reconnect_attempts++;
+        shard->next_connect_ms = now;
+        return;
+    }
+
+    uint64_t ceiling = RECONNECT_BACKOFF_MAX_MS;
+    if (shard->reconnect_attempts < 16) {
+        ceiling = (uint64_t)RECONNECT_BACKOFF_BASE_MS
+                  << shard->reconnect_attempts;
+        if (ceiling > RECONNECT_BACKOFF_MAX_MS)
+            ceiling = RECONNECT_BACKOFF_MAX_MS;
+    }
+    shard->reconnect_attempts++;
+    shard->next_connect_ms = now + shard_random(shard) % (ceiling + 1);
+}
+
+// The next connection identifies as a new session
+static void shard_reset_session(MuseShard *shard) {
+    free(shard->session_id);
+    shard->session_id = NULL;
+    shard->last_seq = -1;
+    // A new session must not connect to the old one's resume URL
+    memcpy(shard->gateway_url, shard->bot->gateway_url,
+           sizeof(shard->gateway_url));
+}
+
+static void shard_on_disconnect(MuseWebSocket *ws, int32_t code,
+                                const char *reason) {
+    MuseShard *shard = (MuseShard *)ws->user_data;
+    uint64_t now = clock_now_ms();
+
+    if (shard->is_connected)
+        metric_add(&gateway_connected_shards, -1);
+    shard->is_connected = false;
+    shard->identify_pending = false;
+    shard->heartbeat_interval_ms = 0;
+    if (shard->disconnected_ms == 0)
+        shard->disconnected_ms = now;
+
+    if (!atomic_load(&shard->bot->is_running)) {
+        log_info(LOG_GATEWAY, "Shard %d: WebSocket closed with %d (%s).",
+                 shard->id, code, reason);
+        return;
+    }
+
+    switch (gateway_close_action(code)) {
+    case GATEWAY_CLOSE_FATAL:
+        log_error(LOG_GATEWAY, "FATAL: Shard %d: Gateway closed with %d (%s)",
+                  shard->id, code, reason);
+        atomic_store(&shard->bot->is_running, false);
+        return;
+    case GATEWAY_CLOSE_REIDENTIFY:
+        shard_reset_session(shard);
+        break;
+    case GATEWAY_CLOSE_RESUME:
+        // A close frame means the server is reachable, resume right away
+        if (code != WS_CLOSE_ABNORMAL)
+            shard->reconnect_now = true;
+        break;
+    }
+
+    shard_schedule_reconnect(shard, now);
+    log_info(LOG_GATEWAY,
+             "Shard %d: WebSocket closed with %d (%s), reconnecting in %llu ms",
+             shard->id, code, reason,
+             (unsigned long long)(shard->next_connect_ms - now));
+}
+
+// READY or RESUMED, the connection is usable again
+static void shard_session_established(MuseShard *shard) {
+    if (shard->disconnected_ms != 0) {
+        metric_observe(&gateway_reconnect_ms,
+                       (int64_t)(clock_now_ms() - shard->disconnected_ms));
+        shard->disconnected_ms = 0;
+    }
+    shard->reconnect_attempts = 0;
+}
+
+static Metric gateway_task_queue_depth = METRIC_GAUGE_INIT(
+    "muse_gateway_task_queue_depth",
+    "Events parsed on a pipeline thread waiting for their gateway loop");
+static PipelineStage gateway_stage =
+    PIPELINE_STAGE_INIT("muse_pipeline_gateway", "gateway frame");
+
+// A frame read on a gateway loop, parsed on its shard's pipeline thread
+typedef struct {
+    MuseShard *shard;
+    uint32_t connection_id;
+    uint64_t submitted_us;
+    GatewayEventPayload payload;
+    size_t length;
+    uint8_t data[];
+} GatewayFrameJob;
+
+// READY or RESUMED, compared by the hash the parser already computed
+static bool gateway_event_is_session(const MuseBot *bot,
+                                     const GatewayEventPayload *payload) {
+    return (payload->t_hash == bot->ready_hash &&
+            payload->t_length == bot->ready_length) ||
+           (payload->t_hash == bot->resumed_hash &&
+            payload->t_length == bot->resumed_length);
+}
+
+// Everything but a plain dispatch changes the connection's state
+static bool gateway_event_needs_loop(const MuseBot *bot,
+                                     const GatewayEventPayload *payload) {
+    if (payload->op != RECEIVE_OPCODE_DISPATCH)
+        return true;
+    return payload->t && gateway_event_is_session(bot, payload);
+}
+
+// Runs on the gateway loop
+static void gateway_event_task(void *context, void *arg) {
+    GatewayFrameJob *job = (GatewayFrameJob *)arg;
+    MuseShard *shard = job->shard;
+    (void)context;
+
+    metric_add(&gateway_task_queue_depth, -1);
+    // Nothing is sent once the bot is shutting down
+    if (atomic_load(&shard->bot->is_running) &&
+        job->connection_id == atomic_load(&shard->connection_id)) {
+        handle_gateway_op(shard, &job->payload);
+    } else {
+        log_debug(LOG_GATEWAY,
+                  "Shard %d: Dropped op %d from a closed connection",
+                  shard->id, job->payload.op);
+    }
+
+    gateway_event_cleanup(&job->payload);
+    alloc_free(job);
+}
+
+static void gateway_frame_task(void *context, void *arg) {
+    GatewayFrameJob *job = (GatewayFrameJob *)arg;
+    MuseShard *shard = job->shard;
+    MuseWorker *worker = shard->worker;
+    (void)context;
+
+    uint64_t started_us =
+        pipeline_stage_begin(&gateway_stage, job->submitted_us);
+
+    if (!gateway_event_parse(job->data, job->length, &job->payload)) {
+        log_error(LOG_GATEWAY, "Failed to parse gateway event payload");
+        alloc_free(job);
+        goto done;
+    }
+
+    // The shard's frames are parsed in order on this thread, so the
+    // sequence is tracked here even for events the gateway loop handles
+    if (job->payload.s != -1 &&
+        job->connection_id == atomic_load(&shard->connection_id))
+        shard->last_seq = job->payload.s;
+
+    if (!gateway_event_needs_loop(shard->bot, &job->payload)) {
+        handle_dispatch_event(shard, &job->payload);
+        gateway_event_cleanup(&job->payload);
+        alloc_free(job);
+        goto done;
+    }
+
+    // The gateway loop drains its queue every tick and never waits on a
+    // pipeline thread, so this can't deadlock
+    metric_add(&gateway_task_queue_depth, 1);
+    while (!task_queue_push(&worker->gateway_tasks, gateway_event_task, job)) {
+        sched_yield();
+    }
+    transport_wake(worker->ts);
+
+done:
+    pipeline_stage_end(&gateway_stage, started_us);
+}
+
+static void shard_on_message(MuseWebSocket *ws, const uint8_t *data,
+                             size_t length) {
+    MuseShard *shard = (MuseShard *)ws->user_data;
+    MuseBot *bot = shard->bot;
+    uint64_t received_us = clock_now_us();
+
+    if (bot->pipeline.thread_count > 0) {
+        GatewayFrameJob *job =
+            alloc_malloc(ALLOC_GATEWAY, sizeof(*job) + length);
+        if (!job) {
+            fprintf(stderr, "error: out of memory");
+            exit(1);
         }
+        job->shard = shard;
+        job->connection_id = atomic_load(&shard->connection_id);
+        job->submitted_us = received_us;
+        job->payload.received_us = received_us;
+        job->length = length;
+        memcpy(job->data, data, length);
+
+        // A full queue holds it back behind the shard's older frames
+        if (pipeline_submit_ordered(&bot->pipeline,
+                                    &shard->worker->gateway_backlog,
+                                    (uint64_t)shard->id, gateway_frame_task,
+                                    job))
+            return;
+        alloc_free(job);
+    }
+
+    GatewayEventPayload payload = {0};
+    if (!gateway_event_parse((uint8_t *)data, length, &payload)) {
+        log_error(LOG_GATEWAY, "Failed to parse gateway event payload");
+        return;
     }
+    payload.received_us = received_us;
+
+    bot_handle_gateway_event(shard, &payload);
+
+    gateway_event_cleanup(&payload);
 }
 
-static void bot_ensure_heartbeat(MuseBot *bot) {
-    if (bot->heartbeat_interval_ms > 0 && transport_is_ws_open(bot->ts)) {
-        uint64_t now = get_now_ms();
-        if (now >= bot->next_heartbeat_ms) {
-            bot_send_heartbeat(bot);
-            bot->next_heartbeat_ms = now + bot->heartbeat_interval_ms;
+static void bot_create_workers(MuseBot *bot) {
+    int32_t worker_count = bot->requested_worker_count;
+    if (worker_count > bot->shard_count)
+        worker_count = bot->shard_count;
+
+    bot->workers = calloc((size_t)worker_count, sizeof(*bot->workers));
+    if (!bot->workers) {
+        fprintf(stderr, "error: out of memory");
+        exit(1);
+    }
+    bot->worker_count = worker_count;
+
+    for (int32_t i = 0; i < worker_count; i++) {
+        MuseWorker *worker = &bot->workers[i];
+        worker->bot = bot;
+        worker->index = i;
+        worker->poll_timeout_ms = POLL_TIMEOUT_MS;
+        worker->cpu = bot->worker_cpu_count > 0
+                          ? bot->worker_cpus[i % bot->worker_cpu_count]
+                          : -1;
+
+        // A single worker's gateway loop runs inline on the caller's
+        // transport
+        if (worker_count == 1) {
+            worker->ts = bot->ts;
+        } else {
+            transport_init(&worker->own_ts, bot->ts->user_agent, worker);
+            transport_set_ca_file(&worker->own_ts, bot->ts->ca_file);
+            worker->ts = &worker->own_ts;
         }
+        transport_init(&worker->http_ts, bot->ts->user_agent, worker);
+        transport_set_ca_file(&worker->http_ts, bot->ts->ca_file);
+        task_queue_init(&worker->http_tasks, HTTP_TASK_QUEUE_SIZE);
+        task_queue_init(&worker->gateway_tasks, GATEWAY_TASK_QUEUE_SIZE);
     }
 }
 
-void bot_tick(MuseBot *bot) {
-    if (!bot || !bot->ts)
+// Saved sessions only apply to the same shard layout
+static void bot_restore_sessions(MuseBot *bot) {
+    // The file lists only shards with a session, in any order, so records
+    // are read aside and placed at their shard's slot, which the
+    // checkpoints rewrite
+    SessionRecord *loaded =
+        calloc((size_t)bot->shard_count, sizeof(*loaded));
+    if (!loaded) {
+        fprintf(stderr, "error: out of memory");
+        exit(1);
+    }
+    int32_t count =
+        session_store_load(bot->session_file, loaded, bot->shard_count);
+
+    memset(bot->session_records, 0,
+           (size_t)bot->shard_count * sizeof(*bot->session_records));
+    for (int32_t i = 0; i < count; i++) {
+        const SessionRecord *record = &loaded[i];
+        if (record->shard_count != bot->shard_count || record->shard_id < 0 ||
+            record->shard_id >= bot->shard_count)
+            continue;
+
+        bot->session_records[record->shard_id] = *record;
+        MuseShard *shard = &bot->shards[record->shard_id];
+        free(shard->session_id);
+        shard->session_id = strdup(record->session_id);
+        shard->last_seq = record->seq;
+        snprintf(shard->gateway_url, sizeof(shard->gateway_url), "%s",
+                 record->resume_url);
+        log_info(LOG_GATEWAY, "Shard %d: Restored session %s at seq %d",
+                 shard->id, shard->session_id, shard->last_seq);
+    }
+    free(loaded);
+}
+
+// Checkpoints shards first, first + stride, ... under session_lock
+static void bot_checkpoint_sessions(MuseBot *bot, int32_t first,
+                                    int32_t stride) {
+    for (int32_t i = first; i < bot->shard_count; i += stride) {
+        MuseShard *shard = &bot->shards[i];
+        SessionRecord *record = &bot->session_records[i];
+        record->shard_id = shard->id;
+        record->shard_count = bot->shard_count;
+        record->seq = shard->last_seq;
+        snprintf(record->session_id, sizeof(record->session_id), "%s",
+                 shard->session_id ? shard->session_id : "");
+        snprintf(record->resume_url, sizeof(record->resume_url), "%s",
+                 shard->gateway_url);
+    }
+}
+
+// Rewrites the session file from a copy of the latest checkpoints, so the
+// fsync never holds session_lock
+static void *session_writer_main(void *arg) {
+    MuseBot *bot = (MuseBot *)arg;
+    size_t size = (size_t)bot->shard_count * sizeof(*bot->session_records);
+    SessionRecord *records = malloc(size);
+    if (!records) {
+        fprintf(stderr, "error: out of memory");
+        exit(1);
+    }
+
+    pthread_mutex_lock(&bot->session_lock);
+    for (;;) {
+        while (!bot->session_dirty && !bot->session_writer_stop)
+            pthread_cond_wait(&bot->session_cond, &bot->session_lock);
+        // bot_destroy saves the final checkpoint itself
+        if (bot->session_writer_stop)
+            break;
+
+        memcpy(records, bot->session_records, size);
+        bot->session_dirty = false;
+        pthread_mutex_unlock(&bot->session_lock);
+        session_store_save(bot->session_file, records, bot->shard_count);
+        pthread_mutex_lock(&bot->session_lock);
+    }
+    pthread_mutex_unlock(&bot->session_lock);
+
+    free(records);
+    return NULL;
+}
+
+// Checkpoints shards first, first + stride, ... and has the session file
+// rewritten from every shard's latest checkpoint
+static void bot_save_sessions(MuseBot *bot, int32_t first, int32_t stride) {
+    pthread_mutex_lock(&bot->session_lock);
+
+    bot_checkpoint_sessions(bot, first, stride);
+    if (bot->has_session_thread) {
+        bot->session_dirty = true;
+        pthread_cond_signal(&bot->session_cond);
+    } else {
+        session_store_save(bot->session_file, bot->session_records,
+                           bot->shard_count);
+    }
+
+    pthread_mutex_unlock(&bot->session_lock);
+}
+
+static void bot_start_session_writer(MuseBot *bot) {
+    if (pthread_create(&bot->session_thread, NULL, session_writer_main,
+                       bot) != 0) {
+        log_warn(LOG_GATEWAY,
+                 "Failed to start session writer, saving synchronously");
+        return;
+    }
+    bot->has_session_thread = true;
+}
+
+static void bot_stop_session_writer(MuseBot *bot) {
+    if (!bot->has_session_thread)
+        return;
+
+    pthread_mutex_lock(&bot->session_lock);
+    bot->session_writer_stop = true;
+    pthread_cond_signal(&bot->session_cond);
+    pthread_mutex_unlock(&bot->session_lock);
+    pthread_join(bot->session_thread, NULL);
+    bot->has_session_thread = false;
+}
+
+static void bot_create_shards(MuseBot *bot, int32_t shard_count,
+                              int32_t max_concurrency) {
+    WSCallbacks cbs = {
+        .on_connect = shard_on_connect,
+        .on_disconnect = shard_on_disconnect,
+        .on_message = shard_on_message,
+    };
+
+    bot->max_concurrency = max_concurrency > 0 ? max_concurrency : 1;
+    bot->identify_ready_ms =
+        calloc((size_t)bot->max_concurrency, sizeof(*bot->identify_ready_ms));
+    bot->shards = calloc((size_t)shard_count, sizeof(*bot->shards));
+    if (!bot->shards || !bot->identify_ready_ms) {
+        fprintf(stderr, "error: out of memory");
+        exit(1);
+    }
+    bot->shard_count = shard_count;
+
+    bot_create_workers(bot);
+
+    for (int32_t i = 0; i < shard_count; i++) {
+        MuseShard *shard = &bot->shards[i];
+        shard->bot = bot;
+        shard->worker = &bot->workers[i % bot->worker_count];
+        shard->id = i;
+        shard->random_state =
+            (clock_now_ms() ^ (uint64_t)(uintptr_t)shard) | 1;
+        shard->last_seq = -1;
+        shard->latency_ms = -1;
+        memcpy(shard->gateway_url, bot->gateway_url, sizeof(bot->gateway_url));
+        transport_ws_init(&shard->ws, shard->worker->ts, cbs, shard);
+    }
+
+    if (bot->session_file) {
+        bot->session_records =
+            calloc((size_t)shard_count, sizeof(*bot->session_records));
+        if (!bot->session_records) {
+            fprintf(stderr, "error: out of memory");
+            exit(1);
+        }
+        bot_restore_sessions(bot);
+        bot_start_session_writer(bot);
+    }
+
+    log_info(LOG_GATEWAY,
+             "Starting %d shard(s) on %d worker(s), max_concurrency %d",
+             bot->shard_count, bot->worker_count, bot->max_concurrency);
+    bot_start_workers(bot);
+}
+
+static void on_gateway_bot(HTTPResponse *res, void *user_data) {
+    MuseBot *bot = (MuseBot *)user_data;
+    int32_t shard_count = bot->requested_shard_count;
+    int32_t max_concurrency = 1;
+    cJSON *json = NULL;
+    GatewayBotData gateway_bot = {0};
+
+    if (res->result != CURLE_OK || res->status < 200 || res->status >= 300) {
+        log_error(LOG_GATEWAY, "GET /gateway/bot failed (%s, HTTP %ld)",
+                  curl_easy_strerror(res->result), res->status);
+        goto fallback;
+    }
+
+    json = cJSON_ParseWithLength((const char *)res->data, res->length);
+    if (!json || !rest_parse_gateway_bot(json, &gateway_bot)) {
+        goto fallback;
+    }
+
+    bot_set_gateway_url(bot, gateway_bot.url);
+    if (shard_count == 0)
+        shard_count = gateway_bot.shards;
+    max_concurrency = gateway_bot.max_concurrency;
+    if (gateway_bot.session_start_remaining >= 0 &&
+        gateway_bot.session_start_remaining < shard_count) {
+        log_warn(LOG_GATEWAY, "Only %d session starts left for %d shard(s)",
+                 gateway_bot.session_start_remaining, shard_count);
+    }
+
+fallback:
+    if (json)
+        cJSON_Delete(json);
+    bot_create_shards(bot, shard_count > 0 ? shard_count : 1,
+                      max_concurrency);
+}
+
+// Shards are created once GET /gateway/bot answers (or fails)
+static void bot_ensure_shards(MuseBot *bot) {
+    if (bot->shards || bot->gateway_info_requested)
         return;
 
-    bot_ensure_connection(bot);
-    transport_poll(bot->ts, POLL_TIMEOUT_MS);
-    bot_ensure_heartbeat(bot);
+    char url[256];
+    bot->gateway_info_requested = true;
+    transport_http_get(bot->ts,
+                       format_url(bot, url, sizeof(url), "/gateway/bot"),
+                       bot->auth_headers, on_gateway_bot, bot);
+}
+
+static void shard_ws_send_writer(MuseShard *shard) {
+    transport_ws_send(&shard->ws, shard->writer.data, shard->writer.length);
+}
+
+static Metric gateway_heartbeat_rtt_ms = METRIC_HISTOGRAM_INIT(
+    "muse_gateway_heartbeat_rtt_ms",
+    "Time between sending a gateway heartbeat and its ACK",
+    METRICS_LATENCY_MS_BOUNDS);
+static Metric gateway_zombie_total = METRIC_COUNTER_INIT(
+    "muse_gateway_zombie_connections_total",
+    "Gateway connections closed after a missed heartbeat ACK");
+
+static void bot_send_heartbeat(MuseShard *shard) {
+    gateway_event_heartbeat(&shard->writer, shard->last_seq);
+    shard_ws_send_writer(shard);
+    shard->heartbeat_acked = false;
+    shard->last_heartbeat_sent_ms = clock_now_ms();
+    log_debug(LOG_GATEWAY, "Shard %d: Sent HEARTBEAT with seq %d", shard->id,
+              shard->last_seq);
+}
+
+static void bot_ensure_connection(MuseShard *shard) {
+    if (!transport_is_ws_open(&shard->ws)) {
+        uint64_t now = clock_now_ms();
+
+        if (now >= shard->next_connect_ms) {
+            if (shard->disconnected_ms != 0) {
+                log_info(LOG_GATEWAY,
+                         "Shard %d: Transport down. Reconnecting...",
+                         shard->id);
+                metric_add(&gateway_reconnects_total, 1);
+            } else {
+                log_info(LOG_GATEWAY,
+                         "Shard %d: Establishing initial connection...",
+                         shard->id);
+            }
+            atomic_fetch_add(&shard->connection_id, 1);
+            transport_ws_open(&shard->ws, shard->gateway_url);
+
+            // Reset heartbeat logic on new connection
+            shard->heartbeat_interval_ms = 0;
+        }
+    }
+}
+
+// min(interval, last round trip + grace), the grace alone before the first
+static uint64_t bot_heartbeat_ack_timeout_ms(const MuseShard *shard) {
+    int64_t timeout_ms = HEARTBEAT_ACK_GRACE_MS;
+
+    if (shard->latency_ms > 0)
+        timeout_ms += shard->latency_ms;
+    if (timeout_ms > shard->heartbeat_interval_ms)
+        timeout_ms = shard->heartbeat_interval_ms;
+    return (uint64_t)timeout_ms;
 }
 
-static void bot_send_identify(MuseBot *bot) {
-    MuseTransport *ts = bot->ts;
+// Checked every tick, so a zombie is caught within the ACK timeout rather
+// than at the next heartbeat
+static void bot_ensure_heartbeat(MuseShard *shard) {
+    if (shard->heartbeat_interval_ms > 0 && transport_is_ws_open(&shard->ws)) {
+        uint64_t now = clock_now_ms();
+        uint64_t waited = now - shard->last_heartbeat_sent_ms;
+        if (!shard->heartbeat_acked &&
+            waited >= bot_heartbeat_ack_timeout_ms(shard)) {
+            // Keep the session, the reconnect resumes it
+            log_warn(LOG_GATEWAY,
+                     "Shard %d: Heartbeat not acknowledged in %llu ms, "
+                     "reconnecting",
+                     shard->id, (unsigned long long)waited);
+            metric_add(&gateway_zombie_total, 1);
+            shard->reconnect_now = true;
+            transport_ws_close(&shard->ws, GATEWAY_CLOSE_KEEP_SESSION,
+                               "heartbeat timeout");
+            return;
+        }
+        if (now >= shard->next_heartbeat_ms) {
+            bot_send_heartbeat(shard);
+            shard->next_heartbeat_ms = now + shard->heartbeat_interval_ms;
+        }
+    }
+}
+
+static void bot_send_identify(MuseShard *shard) {
+    MuseBot *bot = shard->bot;
     IdentifyEventData identify_data = {
         .token = bot->token,
         .properties =
@@ -120,205 +829,932 @@ static void bot_send_identify(MuseBot *bot) {
                 .device = "muse",
             },
         .intents = bot->intents,
+        .shard = {shard->id, bot->shard_count},
     };
 
-    cJSON *identify_json = gateway_event_identify(&identify_data);
-    transport_ws_send_json(ts, identify_json);
-    cJSON_Delete(identify_json);
-    printf("Sent IDENTIFY\n");
+    gateway_event_identify(&shard->writer, &identify_data);
+    shard_ws_send_writer(shard);
+    log_info(LOG_GATEWAY, "Shard %d: Sent IDENTIFY", shard->id);
 }
 
-static void bot_send_resume(MuseBot *bot) {
-    MuseTransport *ts = bot->ts;
-    cJSON *resume_json = cJSON_CreateObject();
-    cJSON_AddNumberToObject(resume_json, "op", SEND_OPCODE_RESUME);
+// Only one shard per bucket may IDENTIFY every IDENTIFY_INTERVAL_MS
+static void bot_ensure_identify(MuseShard *shard) {
+    MuseBot *bot = shard->bot;
+
+    if (!shard->identify_pending || !shard->is_connected)
+        return;
+
+    int32_t bucket = shard->id % bot->max_concurrency;
+    uint64_t now = clock_now_ms();
+    bool ready = false;
+
+    // Buckets are shared by shards on different workers
+    pthread_mutex_lock(&bot->identify_lock);
+    if (now >= bot->identify_ready_ms[bucket]) {
+        bot->identify_ready_ms[bucket] = now + IDENTIFY_INTERVAL_MS;
+        ready = true;
+    }
+    pthread_mutex_unlock(&bot->identify_lock);
 
-    cJSON *d_json = cJSON_CreateObject();
-    cJSON_AddStringToObject(d_json, "token", bot->token);
-    cJSON_AddStringToObject(d_json, "session_id", bot->session_id);
-    cJSON_AddNumberToObject(d_json, "seq", bot->last_seq);
-    cJSON_AddItemToObject(resume_json, "d", d_json);
+    if (!ready)
+        return;
 
-    transport_ws_send_json(ts, resume_json);
-    cJSON_Delete(resume_json);
-    printf("Sent RESUME\n");
+    shard->identify_pending = false;
+    bot_send_identify(shard);
 }
 
-static void bot_handle_hello(MuseBot *bot, const cJSON *data_json) {
+// Gateway events handed back by pipeline threads. Frames keep arriving while
+// this runs, so stop at one queue's worth. Returns how many ran.
+static int32_t worker_run_gateway_tasks(MuseWorker *worker) {
+    TaskFn fn;
+    void *arg;
+    int32_t count = 0;
+
+    while (count < GATEWAY_TASK_QUEUE_SIZE &&
+           task_queue_pop(&worker->gateway_tasks, &fn, &arg)) {
+        STALL_CALL("gateway task", fn, worker, arg);
+        count++;
+    }
+
+    return count;
+}
+
+// Gateway loop: websocket reads, heartbeats and identifies only
+static void worker_tick(MuseWorker *worker) {
+    MuseBot *bot = worker->bot;
+
+    for (int32_t i = worker->index; i < bot->shard_count;
+         i += bot->worker_count) {
+        bot_ensure_connection(&bot->shards[i]);
+    }
+
+    bool backlog_empty =
+        pipeline_backlog_flush(&bot->pipeline, &worker->gateway_backlog);
+    transport_poll(worker->ts,
+                   backlog_empty ? POLL_TIMEOUT_MS : BACKLOG_POLL_TIMEOUT_MS);
+    worker_run_gateway_tasks(worker);
+
+    if (bot->session_file) {
+        uint64_t now = clock_now_ms();
+        if (now >= worker->next_checkpoint_ms) {
+            bot_save_sessions(bot, worker->index, bot->worker_count);
+            worker->next_checkpoint_ms = now + SESSION_CHECKPOINT_INTERVAL_MS;
+        }
+    }
+
+    for (int32_t i = worker->index; i < bot->shard_count;
+         i += bot->worker_count) {
+        bot_ensure_heartbeat(&bot->shards[i]);
+        bot_ensure_identify(&bot->shards[i]);
+    }
+}
+
+static Metric http_tasks_rejected_total = METRIC_COUNTER_INIT(
+    "muse_http_tasks_rejected_total",
+    "Tasks not posted because a worker's HTTP task queue was full");
+static Metric http_task_queue_depth = METRIC_GAUGE_INIT(
+    "muse_http_task_queue_depth", "Tasks waiting for an HTTP loop");
+
+bool bot_post_http_task(MuseWorker *worker, TaskFn fn, void *arg) {
+    // Counted first, the HTTP loop may run it before this returns
+    metric_add(&http_task_queue_depth, 1);
+    if (!task_queue_push(&worker->http_tasks, fn, arg)) {
+        metric_add(&http_task_queue_depth, -1);
+        metric_add(&http_tasks_rejected_total, 1);
+        return false;
+    }
+    transport_wake(&worker->http_ts);
+    return true;
+}
+
+// At most one queue's worth per tick, tasks posted meanwhile wait for the
+// next one. Returns how many ran.
+static int32_t worker_run_http_tasks(MuseWorker *worker) {
+    TaskFn fn;
+    void *arg;
+
+    int32_t count = 0;
+
+    while (count < HTTP_TASK_QUEUE_SIZE &&
+           task_queue_pop(&worker->http_tasks, &fn, &arg)) {
+        metric_add(&http_task_queue_depth, -1);
+        STALL_CALL("http task", fn, worker, arg);
+        count++;
+    }
+
+    return count;
+}
+
+// HTTP loop: posted tasks, REST sends and their completions
+static void worker_http_tick(MuseWorker *worker) {
+    MuseBot *bot = worker->bot;
+
+    bool backlog_empty =
+        pipeline_backlog_flush(&bot->pipeline, &worker->http_backlog);
+    int64_t timeout_ms = worker->poll_timeout_ms;
+    if (!backlog_empty && timeout_ms > BACKLOG_POLL_TIMEOUT_MS)
+        timeout_ms = BACKLOG_POLL_TIMEOUT_MS;
+
+    transport_poll(&worker->http_ts, timeout_ms);
+    worker_run_http_tasks(worker);
+    worker_rest_flush(worker);
+
+    if (bot->worker_tick_handler) {
+        int64_t wait_ms = bot->worker_tick_handler(worker, clock_now_ms());
+        if (wait_ms < 0)
+            wait_ms = 0;
+        worker->poll_timeout_ms =
+            wait_ms < POLL_TIMEOUT_MS ? wait_ms : POLL_TIMEOUT_MS;
+    }
+}
+
+static void *worker_http_main(void *arg) {
+    MuseWorker *worker = (MuseWorker *)arg;
+
+    while (atomic_load(&worker->http_running)) {
+        worker_http_tick(worker);
+    }
+
+    clock_virtual_leave();
+    return NULL;
+}
+
+static void *worker_main(void *arg) {
+    MuseWorker *worker = (MuseWorker *)arg;
+    MuseBot *bot = worker->bot;
+
+#ifdef __linux__
+    if (worker->cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(worker->cpu, &cpus);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+            log_warn(LOG_GATEWAY, "Worker %d: Failed to pin to CPU %d",
+                     worker->index, worker->cpu);
+        }
+    }
+#endif
+
+    while (atomic_load(&bot->workers_running) &&
+           atomic_load(&bot->is_running)) {
+        worker_tick(worker);
+    }
+
+    clock_virtual_leave();
+    return NULL;
+}
+
+static void bot_start_workers(MuseBot *bot) {
+    if (bot->requested_pipeline_threads > 0) {
+        pipeline_init(&bot->pipeline, bot->requested_pipeline_threads,
+                      PIPELINE_QUEUE_SIZE, bot);
+    }
+
+    for (int32_t i = 0; i < bot->worker_count; i++) {
+        MuseWorker *worker = &bot->workers[i];
+        atomic_store(&worker->http_running, true);
+        // Joined here so virtual time can't move before the loop first runs
+        clock_virtual_join();
+        if (pthread_create(&worker->http_thread, NULL, worker_http_main,
+                           worker) != 0) {
+            clock_virtual_leave();
+            log_error(LOG_GATEWAY, "FATAL: Failed to start HTTP loop %d", i);
+            atomic_store(&bot->is_running, false);
+            return;
+        }
+        worker->has_http_thread = true;
+    }
+
+    if (bot->worker_count < 2)
+        return;
+
+    atomic_store(&bot->workers_running, true);
+    for (int32_t i = 0; i < bot->worker_count; i++) {
+        MuseWorker *worker = &bot->workers[i];
+        clock_virtual_join();
+        if (pthread_create(&worker->thread, NULL, worker_main, worker) != 0) {
+            clock_virtual_leave();
+            log_error(LOG_GATEWAY, "FATAL: Failed to start worker %d", i);
+            atomic_store(&bot->is_running, false);
+            return;
+        }
+        worker->has_thread = true;
+    }
+}
+
+void bot_tick(MuseBot *bot) {
+    if (!bot || !bot->ts)
+        return;
+
+    bot_ensure_shards(bot);
+
+    // Threaded workers tick themselves, the caller's transport only serves
+    // the initial GET /gateway/bot
+    if (bot->worker_count == 1) {
+        worker_tick(&bot->workers[0]);
+    } else {
+        transport_poll(bot->ts, POLL_TIMEOUT_MS);
+    }
+}
+
+static void bot_send_resume(MuseShard *shard) {
+    ResumeEventData resume_data = {
+        .token = shard->bot->token,
+        .session_id = shard->session_id,
+        .seq = shard->last_seq,
+    };
+
+    gateway_event_resume(&shard->writer, &resume_data);
+    shard_ws_send_writer(shard);
+    log_info(LOG_GATEWAY, "Shard %d: Sent RESUME", shard->id);
+}
+
+static void bot_handle_hello(MuseShard *shard, const cJSON *data_json) {
     HelloEventData hello_data = {0};
     if (!gateway_event_parse_hello(data_json, &hello_data)) {
-        fprintf(stderr, "Failed to parse HELLO event data\n");
+        log_error(LOG_GATEWAY, "Failed to parse HELLO event data");
         return;
     }
 
-    printf("Received HELLO, heartbeat interval: %d ms\n",
-           hello_data.heartbeat_interval);
-    bot->heartbeat_interval_ms = hello_data.heartbeat_interval;
-    bot->next_heartbeat_ms = get_now_ms() + bot->heartbeat_interval_ms;
-    bot_send_heartbeat(bot);
+    log_info(LOG_GATEWAY, "Shard %d: Received HELLO, heartbeat interval: %d ms",
+             shard->id, hello_data.heartbeat_interval);
+    shard->heartbeat_interval_ms = hello_data.heartbeat_interval;
+    shard->next_heartbeat_ms = clock_now_ms() + shard->heartbeat_interval_ms;
+    shard->heartbeat_acked = true;
+    bot_send_heartbeat(shard);
 
-    if (bot->session_id == NULL) {
-        bot_send_identify(bot);
+    if (shard->session_id == NULL) {
+        shard->identify_pending = true;
+        bot_ensure_identify(shard);
     } else {
-        bot_send_resume(bot);
+        bot_send_resume(shard);
     }
 }
 
-static void bot_handle_invalid_session(MuseBot *bot, const cJSON *data_json) {
+static void bot_handle_invalid_session(MuseShard *shard,
+                                       const cJSON *data_json) {
     bool resumable = data_json && cJSON_IsTrue(data_json);
-    printf("Received INVALID_SESSION (Resumable: %s)\n",
-           resumable ? "true" : "false");
+    log_info(LOG_GATEWAY, "Shard %d: Received INVALID_SESSION (Resumable: %s)",
+             shard->id, resumable ? "true" : "false");
 
-    if (resumable && bot->session_id != NULL) {
-        bot_send_resume(bot);
+    if (resumable && shard->session_id != NULL) {
+        bot_send_resume(shard);
     } else {
-        if (bot->session_id == NULL) {
-            fprintf(stderr, "FATAL: Gateway rejected initial connection. Check "
-                            "TOKEN/INTENTS.\n");
-            bot->is_running = false;
-            transport_ws_close(bot->ts);
+        if (shard->session_id == NULL) {
+            log_error(LOG_GATEWAY,
+                      "FATAL: Gateway rejected initial connection. Check "
+                      "TOKEN/INTENTS.");
+            atomic_store(&shard->bot->is_running, false);
+            transport_ws_close(&shard->ws, WS_CLOSE_NORMAL, "shutting down");
         } else {
-            printf("Session expired. Clearing state for clean Identify...\n");
-            free(bot->session_id);
-            bot->session_id = NULL;
-            bot->last_seq = -1;
-            transport_ws_close(bot->ts);
+            log_info(LOG_GATEWAY,
+                     "Shard %d: Session expired. Clearing state for clean "
+                     "Identify...",
+                     shard->id);
+            shard_reset_session(shard);
+            transport_ws_close(&shard->ws, WS_CLOSE_NORMAL,
+                               "session invalidated");
         }
     }
 }
 
-static void bot_handle_ready(MuseBot *bot, const cJSON *data_json) {
+static void bot_handle_ready(MuseShard *shard, const char *event_name,
+                             const cJSON *data_json) {
+    MuseBot *bot = shard->bot;
+    (void)event_name;
+
     cJSON *session_id_json = cJSON_GetObjectItem(data_json, "session_id");
     if (!session_id_json)
         return;
 
-    if (bot->session_id)
-        free(bot->session_id);
-    bot->session_id = strdup(session_id_json->valuestring);
-    printf("Bot READY. Session ID: %s\n", bot->session_id);
+    if (shard->session_id)
+        free(shard->session_id);
+    shard->session_id = strdup(session_id_json->valuestring);
+    log_info(LOG_GATEWAY, "Shard %d: READY. Session ID: %s", shard->id,
+             shard->session_id);
+    shard_session_established(shard);
 
     cJSON *user_json = cJSON_GetObjectItemCaseSensitive(data_json, "user");
     cJSON *user_id_json = cJSON_GetObjectItemCaseSensitive(user_json, "id");
-    if (cJSON_IsString(user_id_json)) {
-        if (bot->user_id)
-            free(bot->user_id);
-        bot->user_id = strdup(user_id_json->valuestring);
-        printf("Bot User ID: %s\n", bot->user_id);
+    // Every shard reports the same user, the first READY publishes it
+    char *expected = NULL;
+    if (cJSON_IsString(user_id_json) && atomic_load(&bot->user_id) == NULL) {
+        char *user_id = strdup(user_id_json->valuestring);
+        if (atomic_compare_exchange_strong(&bot->user_id, &expected,
+                                           user_id)) {
+            log_info(LOG_GATEWAY, "Bot User ID: %s", user_id);
+        } else {
+            free(user_id);
+        }
     }
 
     cJSON *gateway_url_json =
         cJSON_GetObjectItem(data_json, "resume_gateway_url");
     if (gateway_url_json && cJSON_IsString(gateway_url_json)) {
-        bot_set_gateway_url(bot, gateway_url_json->valuestring);
-        printf("Updated gateway URL for resuming: %s\n", bot->gateway_url);
+        copy_gateway_url(shard->gateway_url, sizeof(shard->gateway_url),
+                         gateway_url_json->valuestring);
+        log_info(LOG_GATEWAY, "Shard %d: Updated gateway URL for resuming: %s",
+                 shard->id, shard->gateway_url);
     }
 }
 
-static void handle_dispatch_event(MuseBot *bot, const char *event_name,
-                                  const cJSON *data_json) {
-    if (strcmp(event_name, "READY") == 0) {
-        bot_handle_ready(bot, data_json);
-        if (bot->callbacks.on_ready) {
-            bot->callbacks.on_ready(bot, event_name, data_json);
-        }
+static void bot_handle_heartbeat_ack(MuseShard *shard) {
+    if (shard->heartbeat_acked)
+        return;
 
-    } else if (strcmp(event_name, "MESSAGE_CREATE") == 0) {
-        if (bot->callbacks.on_message_create) {
-            bot->callbacks.on_message_create(bot, event_name, data_json);
-        }
-    } else {
-        printf("Unhandled DISPATCH event: %s\n", event_name);
+    shard->heartbeat_acked = true;
+    shard->latency_ms =
+        (int64_t)(clock_now_ms() - shard->last_heartbeat_sent_ms);
+    metric_observe(&gateway_heartbeat_rtt_ms, shard->latency_ms);
+    log_debug(LOG_GATEWAY, "Shard %d: Heartbeat ACK in %lld ms.", shard->id,
+              (long long)shard->latency_ms);
+}
+
+static void bot_handle_resumed(MuseShard *shard, const char *event_name,
+                               const cJSON *data_json) {
+    (void)event_name;
+    (void)data_json;
+
+    log_info(LOG_GATEWAY, "Shard %d: RESUMED.", shard->id);
+    shard_session_established(shard);
+}
+
+static Metric gateway_first_event_ms = METRIC_GAUGE_INIT(
+    "muse_gateway_first_event_ms",
+    "Time from startup to the first dispatch event after READY or RESUMED");
+
+// Measures how long a restart leaves us deaf, a resumed session gets there
+// without waiting on IDENTIFY and the guild burst
+static void bot_record_first_event(MuseShard *shard,
+                                   const GatewayEventPayload *payload) {
+    MuseBot *bot = shard->bot;
+
+    if (atomic_load_explicit(&bot->first_event_handled, memory_order_relaxed))
+        return;
+    if (gateway_event_is_session(bot, payload))
+        return;
+    if (atomic_exchange(&bot->first_event_handled, true))
+        return;
+
+    int64_t elapsed_ms = (int64_t)(clock_now_ms() - bot->started_ms);
+    metric_set(&gateway_first_event_ms, elapsed_ms);
+    log_info(LOG_GATEWAY,
+             "Shard %d: First event %s handled %lld ms after startup",
+             shard->id, payload->t, (long long)elapsed_ms);
+}
+
+// Handlers run synchronously on the thread that dispatches them
+static _Thread_local uint64_t dispatch_received_us;
+
+uint64_t bot_dispatch_received_us(void) { return dispatch_received_us; }
+
+static void handle_dispatch_event(MuseShard *shard,
+                                  const GatewayEventPayload *payload) {
+    if (!payload->t)
+        return;
+
+    dispatch_received_us = payload->received_us;
+    bot_record_first_event(shard, payload);
+
+    DispatchEntry *entry =
+        dispatch_table_find(shard->bot, payload->t_hash, payload->t_length);
+    if (!entry || entry->hash == 0) {
+        log_debug(LOG_GATEWAY, "Unhandled DISPATCH event: %s", payload->t);
+        return;
+    }
+
+    for (int32_t i = 0; i < entry->handler_count; i++) {
+        entry->handlers[i](shard, payload->t, payload->d_json);
     }
 }
 
-void bot_handle_gateway_event(MuseBot *bot,
+void bot_handle_gateway_event(MuseShard *shard,
                               const GatewayEventPayload *payload) {
     if (payload->s != -1)
-        bot->last_seq = payload->s;
+        shard->last_seq = payload->s;
+
+    handle_gateway_op(shard, payload);
+}
 
+// Runs on the shard's gateway loop, the caller tracked the sequence
+static void handle_gateway_op(MuseShard *shard,
+                              const GatewayEventPayload *payload) {
     switch (payload->op) {
     case RECEIVE_OPCODE_HELLO:
-        bot_handle_hello(bot, payload->d_json);
+        bot_handle_hello(shard, payload->d_json);
         break;
     case RECEIVE_OPCODE_HEARTBEAT_ACK:
-        printf("Heartbeat ACK.\n");
+        bot_handle_heartbeat_ack(shard);
         break;
     case RECEIVE_OPCODE_HEARTBEAT:
-        bot_send_heartbeat(bot);
+        bot_send_heartbeat(shard);
         break;
     case RECEIVE_OPCODE_RECONNECT:
-        printf("Discord requested RECONNECT.\n");
-        transport_ws_close(bot->ts);
+        log_info(LOG_GATEWAY, "Shard %d: Discord requested RECONNECT.",
+                 shard->id);
+        shard->reconnect_now = true;
+        transport_ws_close(&shard->ws, GATEWAY_CLOSE_KEEP_SESSION,
+                           "reconnect requested");
         break;
     case RECEIVE_OPCODE_INVALID_SESSION:
-        bot_handle_invalid_session(bot, payload->d_json);
+        bot_handle_invalid_session(shard, payload->d_json);
         break;
     case RECEIVE_OPCODE_DISPATCH:
-        handle_dispatch_event(bot, payload->t, payload->d_json);
+        handle_dispatch_event(shard, payload);
         break;
     default:
-        printf("Unhandled gateway opcode: %d\n", payload->op);
+        log_warn(LOG_GATEWAY, "Unhandled gateway opcode: %d", payload->op);
         break;
     }
 }
 
-static void on_done(HTTPResponse *res, void *user_data) {
-    (void)user_data;
+static Metric rest_queue_latency_ms = METRIC_HISTOGRAM_INIT(
+    "muse_rest_queue_latency_ms",
+    "Time REST requests spent queued before being sent",
+    METRICS_LATENCY_MS_BOUNDS);
+static Metric rest_rate_limited_total =
+    METRIC_COUNTER_INIT("muse_rest_rate_limited_total",
+                        "REST requests delayed by a bucket or global limit");
+static Metric rest_429_total = METRIC_COUNTER_INIT(
+    "muse_rest_429_total", "REST responses with HTTP status 429");
+static Metric rest_queue_depth = METRIC_GAUGE_INIT(
+    "muse_rest_queue_depth", "REST requests waiting on a rate limit");
+static Metric rest_shed_total = METRIC_COUNTER_INIT(
+    "muse_rest_shed_total", "REST requests shed by a full REST queue");
+
+typedef enum {
+    REST_SEND,
+    REST_WAIT_BUCKET,
+    REST_WAIT_GLOBAL,
+} RestAcquireResult;
+
+// Buckets are per route and major parameter, e.g. one per channel for
+// POST /channels/{channel_id}/messages
+static uint64_t rest_bucket_key(const char *route, const char *major) {
+    uint64_t hash = hash_fnv1a(FNV_OFFSET_BASIS, route, strlen(route));
+    hash = hash_fnv1a(hash, major, strlen(major));
+    return hash ? hash : 1;
+}
+
+// Must hold the limiter lock. NULL if every probed slot is busy, the
+// request then only follows the global limit.
+static RestBucket *rest_bucket_find(RestRateLimiter *limiter,
+                                    uint64_t key_hash, uint64_t now,
+                                    bool create) {
+    size_t mask = REST_BUCKET_TABLE_SIZE - 1;
+    RestBucket *free_slot = NULL;
+
+    for (size_t i = 0; i < REST_BUCKET_PROBES; i++) {
+        RestBucket *bucket = &limiter->buckets[(key_hash + i) & mask];
+        if (bucket->key_hash == key_hash)
+            return bucket;
+        if (!free_slot && (bucket->key_hash == 0 ||
+                           (bucket->in_flight == 0 && now >= bucket->reset_ms)))
+            free_slot = bucket;
+    }
+
+    if (!create || !free_slot)
+        return NULL;
+
+    *free_slot =
+        (RestBucket){.key_hash = key_hash, .limit = -1, .remaining = -1};
+    return free_slot;
+}
+
+static RestAcquireResult rest_try_acquire(RestRateLimiter *limiter,
+                                          uint64_t key_hash) {
+    RestAcquireResult result = REST_SEND;
+    uint64_t now = clock_now_ms();
+
+    pthread_mutex_lock(&limiter->lock);
+
+    if (now < limiter->global_blocked_until_ms) {
+        result = REST_WAIT_GLOBAL;
+        goto unlock;
+    }
+    // A window starts with its first send, one started by a request that
+    // then waits on its bucket would let the next window overlap the sends
+    bool window_expired = now - limiter->global_window_ms >= 1000;
+    if (!window_expired &&
+        limiter->global_window_count >= limiter->global_limit_per_sec) {
+        result = REST_WAIT_GLOBAL;
+        goto unlock;
+    }
+
+    RestBucket *bucket = rest_bucket_find(limiter, key_hash, now, true);
+    if (bucket) {
+        // A 429 without rate limit headers leaves the limit unknown, probe
+        // the bucket again rather than wait on a limit of 0 forever
+        if (bucket->remaining == 0 && now >= bucket->reset_ms)
+            bucket->remaining = bucket->limit > 0 ? bucket->limit : -1;
+
+        // Until the first response only one request probes the bucket
+        if (bucket->remaining == 0 ||
+            (bucket->remaining < 0 && bucket->in_flight > 0) ||
+            (bucket->remaining > 0 && bucket->in_flight >= bucket->remaining)) {
+            result = REST_WAIT_BUCKET;
+            goto unlock;
+        }
+        bucket->in_flight++;
+    }
+
+    if (window_expired) {
+        limiter->global_window_ms = now;
+        limiter->global_window_count = 0;
+    }
+    limiter->global_window_count++;
+
+unlock:
+    pthread_mutex_unlock(&limiter->lock);
+    return result;
+}
+
+static int64_t header_seconds_to_ms(const HTTPResponse *res, const char *name,
+                                    int64_t fallback) {
+    const char *value = transport_http_header(res, name);
+    return value ? (int64_t)(strtod(value, NULL) * 1000.0) : fallback;
+}
+
+// Updates the request's bucket from the response and returns how long a 429
+// asks us to wait, or -1
+static int64_t rest_update_limits(RestRateLimiter *limiter,
+                                  const RestRequest *req,
+                                  const HTTPResponse *res) {
+    uint64_t now = clock_now_ms();
+    int64_t retry_after_ms = -1;
+    bool global = false;
+
+    if (res->result == CURLE_OK && res->status == 429) {
+        cJSON *json =
+            cJSON_ParseWithLength((const char *)res->data, res->length);
+        cJSON *retry_json =
+            cJSON_GetObjectItemCaseSensitive(json, "retry_after");
+        cJSON *global_json = cJSON_GetObjectItemCaseSensitive(json, "global");
+        if (cJSON_IsNumber(retry_json)) {
+            retry_after_ms = (int64_t)(retry_json->valuedouble * 1000.0);
+        } else {
+            retry_after_ms = header_seconds_to_ms(res, "Retry-After", 1000);
+        }
+        global = cJSON_IsTrue(global_json) ||
+                 transport_http_header(res, "X-RateLimit-Global") != NULL;
+        cJSON_Delete(json);
+    }
+
+    pthread_mutex_lock(&limiter->lock);
+
+    RestBucket *bucket = rest_bucket_find(limiter, req->key_hash, now, false);
+    if (bucket) {
+        if (bucket->in_flight > 0)
+            bucket->in_flight--;
+
+        const char *limit = transport_http_header(res, "X-RateLimit-Limit");
+        const char *remaining =
+            transport_http_header(res, "X-RateLimit-Remaining");
+        int64_t reset_after_ms =
+            header_seconds_to_ms(res, "X-RateLimit-Reset-After", -1);
+        if (limit)
+            bucket->limit = (int32_t)strtol(limit, NULL, 10);
+        if (remaining)
+            bucket->remaining = (int32_t)strtol(remaining, NULL, 10);
+        if (reset_after_ms >= 0)
+            bucket->reset_ms = now + (uint64_t)reset_after_ms;
+
+        if (retry_after_ms >= 0 && !global) {
+            bucket->remaining = 0;
+            bucket->reset_ms = now + (uint64_t)retry_after_ms;
+        }
+    }
+
+    if (retry_after_ms >= 0 && global)
+        limiter->global_blocked_until_ms = now + (uint64_t)retry_after_ms;
+
+    pthread_mutex_unlock(&limiter->lock);
+    return retry_after_ms;
+}
+
+// Once per message request, posted or not, so the caller can let go of what
+// it held for the reply
+static void rest_request_done(MuseWorker *worker, int32_t trace_count) {
+    if (worker->bot->rest_done_handler)
+        worker->bot->rest_done_handler(worker, trace_count);
+}
+
+// Every way out of the queue ends here, so the traces it carries are counted
+// and logged whether the request was posted or not
+static void rest_request_free(RestRequest *req) {
+    for (int32_t i = 0; i < req->trace_count; i++) {
+        trace_finish(&req->traces[i]);
+    }
+    rest_request_done(req->worker, req->trace_count);
+    alloc_free(req);
+}
+
+static void on_rest_done(HTTPResponse *res, void *user_data) {
+    RestRequest *req = (RestRequest *)user_data;
+    MuseWorker *worker = req->worker;
+
+    int64_t retry_after_ms =
+        rest_update_limits(&worker->bot->rest_limiter, req, res);
+
+    if (retry_after_ms >= 0) {
+        metric_add(&rest_429_total, 1);
+        if (req->attempts < REST_MAX_ATTEMPTS) {
+            log_warn(LOG_REST,
+                     "REST request to %s rate limited, retrying in %lld ms",
+                     req->url, (long long)retry_after_ms);
+            // Retries go first to keep the bucket's order
+            req->enqueued_ms = clock_now_ms();
+            req->next = worker->rest_head;
+            worker->rest_head = req;
+            if (!worker->rest_tail)
+                worker->rest_tail = req;
+            worker->rest_depth++;
+            metric_add(&rest_queue_depth, 1);
+            return;
+        }
+        log_error(LOG_REST, "REST request to %s dropped after %d attempts",
+                  req->url, req->attempts);
+        goto cleanup;
+    }
 
     if (res->result != CURLE_OK) {
-        fprintf(stderr, "REST request failed: %s\n",
-                curl_easy_strerror(res->result));
-        return;
+        log_error(LOG_REST, "REST request failed: %s",
+                  curl_easy_strerror(res->result));
+        goto cleanup;
     }
 
     if (res->status < 200 || res->status >= 300) {
-        fprintf(stderr, "REST request returned HTTP status %ld\n", res->status);
-        return;
+        log_error(LOG_REST, "REST request returned HTTP status %ld",
+                  res->status);
+        goto cleanup;
     }
 
-    printf("REST request succeeded with status %ld, response length: %zu\n",
-           res->status, res->length);
+    log_debug(LOG_REST,
+              "REST request succeeded with status %ld, response length: %zu",
+              res->status, res->length);
+    for (int32_t i = 0; i < req->trace_count; i++) {
+        trace_mark(&req->traces[i], TRACE_POSTED);
+    }
+
+cleanup:
+    rest_request_free(req);
+    // A freed slot in the bucket may unblock queued requests
+    worker_rest_flush(worker);
 }
 
-static void bot_rest_send_json(MuseBot *bot, const char *url,
-                               const cJSON *body_json) {
-    char *body_str = cJSON_PrintUnformatted(body_json);
-    if (!body_str) {
-        fprintf(stderr, "Failed to serialize JSON body for REST request\n");
+static void rest_request_send(RestRequest *req) {
+    MuseWorker *worker = req->worker;
+
+    metric_observe(&rest_queue_latency_ms,
+                   (int64_t)(clock_now_ms() - req->enqueued_ms));
+    req->attempts++;
+    for (int32_t i = 0; i < req->trace_count; i++) {
+        trace_mark(&req->traces[i], TRACE_SENT);
+    }
+
+    log_debug(LOG_REST, "Sending REST POST to %s with body: %.*s", req->url,
+              (int)req->body_length, (const char *)req->body);
+
+    transport_http_post(&worker->http_ts, req->url, req->body,
+                        req->body_length, NULL, worker->bot->json_headers,
+                        on_rest_done, req);
+}
+
+// Sends every queued request whose bucket has room, in FIFO order. Requests
+// for a waiting bucket stay behind so a bucket never reorders.
+static void worker_rest_flush(MuseWorker *worker) {
+    RestRateLimiter *limiter = &worker->bot->rest_limiter;
+    RestRequest **link = &worker->rest_head;
+    RestRequest *prev = NULL;
+
+    while (*link) {
+        RestRequest *req = *link;
+        RestAcquireResult result = rest_try_acquire(limiter, req->key_hash);
+
+        if (result != REST_SEND) {
+            if (!req->was_limited) {
+                req->was_limited = true;
+                metric_add(&rest_rate_limited_total, 1);
+            }
+            if (result == REST_WAIT_GLOBAL)
+                break;
+            prev = req;
+            link = &req->next;
+            continue;
+        }
+
+        *link = req->next;
+        if (worker->rest_tail == req)
+            worker->rest_tail = prev;
+        req->next = NULL;
+        worker->rest_depth--;
+        metric_add(&rest_queue_depth, -1);
+        rest_request_send(req);
+    }
+}
+
+static RestRequest *rest_request_new(MuseWorker *worker, uint64_t key_hash,
+                                     const char *url, const JSONWriter *body) {
+    RestRequest *req = alloc_malloc(ALLOC_REST, sizeof(*req) + body->length);
+    if (!req) {
+        fprintf(stderr, "error: out of memory");
+        exit(1);
+    }
+
+    req->next = NULL;
+    req->worker = worker;
+    req->key_hash = key_hash;
+    snprintf(req->url, sizeof(req->url), "%s", url);
+    req->enqueued_ms = clock_now_ms();
+    req->attempts = 0;
+    req->was_limited = false;
+    req->trace_count = 0;
+    req->body_length = body->length;
+    memcpy(req->body, body->data, body->length);
+    return req;
+}
+
+static void rest_queue_push(MuseWorker *worker, RestRequest *req) {
+    // Past the global limit replies would pile up here without end
+    if (worker->rest_depth >= REST_QUEUE_MAX_DEPTH) {
+        metric_add(&rest_shed_total, 1);
+        log_debug(LOG_REST, "REST request to %s shed, queue is full",
+                  req->url);
+        rest_request_free(req);
         return;
     }
 
-    printf("Sending REST POST to %s with body: %s\n", url, body_str);
+    if (worker->rest_tail) {
+        worker->rest_tail->next = req;
+    } else {
+        worker->rest_head = req;
+    }
+    worker->rest_tail = req;
+    worker->rest_depth++;
+    metric_add(&rest_queue_depth, 1);
 
-    char auth_header[256];
-    snprintf(auth_header, sizeof(auth_header), "Authorization: Bot %s",
-             bot->token);
-    struct curl_slist *headers = NULL;
-    headers = curl_slist_append(headers, auth_header);
+    worker_rest_flush(worker);
+}
+
+static RestRequest *rest_message_request(MuseWorker *worker,
+                                         JSONWriter *writer,
+                                         const char *channel_id,
+                                         const DiscordCreateMessage *message,
+                                         const TraceContext *traces,
+                                         int32_t trace_count) {
+    char url[256];
 
-    transport_http_post(bot->ts, url, (const uint8_t *)body_str,
-                        strlen(body_str), "application/json", headers, on_done,
-                        bot);
+    rest_create_message(writer, message);
+    if (!format_url(worker->bot, url, sizeof(url), "/channels/%s/messages",
+                    channel_id)) {
+        log_error(LOG_REST,
+                  "REST request to channel %.32s dropped, URL too long",
+                  channel_id);
+        rest_request_done(worker, trace_count);
+        return NULL;
+    }
+    uint64_t key_hash =
+        rest_bucket_key("POST /channels/{channel_id}/messages", channel_id);
+    RestRequest *req = rest_request_new(worker, key_hash, url, writer);
+
+    if (trace_count > MAX_MESSAGE_EMBEDS)
+        trace_count = MAX_MESSAGE_EMBEDS;
+    for (int32_t i = 0; i < trace_count; i++) {
+        req->traces[i] = traces[i];
+        trace_mark(&req->traces[i], TRACE_SERIALIZED);
+    }
+    req->trace_count = trace_count;
+    return req;
+}
 
-    curl_slist_free_all(headers);
-    free(body_str);
+void bot_rest_send_message(MuseWorker *worker, const char *channel_id,
+                           const DiscordCreateMessage *message,
+                           const TraceContext *traces, int32_t trace_count) {
+    RestRequest *req = rest_message_request(
+        worker, &worker->writer, channel_id, message, traces, trace_count);
+    if (req)
+        rest_queue_push(worker, req);
+}
+
+static void rest_queue_push_task(void *context, void *arg) {
+    rest_queue_push((MuseWorker *)context, (RestRequest *)arg);
+}
+
+bool bot_rest_post_message(MuseWorker *worker, JSONWriter *writer,
+                           const char *channel_id,
+                           const DiscordCreateMessage *message,
+                           const TraceContext *traces, int32_t trace_count) {
+    RestRequest *req = rest_message_request(worker, writer, channel_id,
+                                            message, traces, trace_count);
+    if (!req)
+        return false;
+
+    if (!bot_post_http_task(worker, rest_queue_push_task, req)) {
+        log_error(LOG_REST, "REST request to %s dropped, HTTP loop %d is full",
+                  req->url, worker->index);
+        rest_request_free(req);
+        return false;
+    }
+    return true;
 }
 
-void bot_rest_send_message(MuseBot *bot, const char *channel_id,
-                           const DiscordCreateMessage *message) {
-    cJSON *message_json = rest_create_message(message);
-    bot_rest_send_json(bot, format_url("/channels/%s/messages", channel_id),
-                       message_json);
-    cJSON_Delete(message_json);
+bool bot_pipeline_submit(MuseWorker *worker, uint64_t key, TaskFn fn,
+                         void *arg) {
+    return pipeline_submit_ordered(&worker->bot->pipeline,
+                                   &worker->http_backlog, key, fn, arg);
 }
 
 void bot_destroy(MuseBot *bot) {
-    if (bot->session_id) {
-        free(bot->session_id);
-        bot->session_id = NULL;
+    atomic_store(&bot->is_running, false);
+    atomic_store(&bot->workers_running, false);
+    for (int32_t i = 0; i < bot->worker_count; i++) {
+        if (bot->workers[i].has_thread) {
+            pthread_join(bot->workers[i].thread, NULL);
+        }
+    }
+    // Gateway loops are done reading, stop the HTTP loops and the pipeline
+    for (int32_t i = 0; i < bot->worker_count; i++) {
+        MuseWorker *worker = &bot->workers[i];
+        atomic_store(&worker->http_running, false);
+        transport_wake(&worker->http_ts);
+        if (worker->has_http_thread) {
+            pthread_join(worker->http_thread, NULL);
+        }
+    }
+    pipeline_stop(&bot->pipeline);
+
+    // Tasks own their arguments, run the last ones so nothing leaks. HTTP
+    // tasks and pipeline jobs submit each other, so go until both are empty.
+    // Held back jobs are newer than the queued ones for their thread.
+    int32_t ran;
+    do {
+        ran = pipeline_drain(&bot->pipeline);
+        for (int32_t i = 0; i < bot->worker_count; i++) {
+            MuseWorker *worker = &bot->workers[i];
+            ran += pipeline_backlog_run(&bot->pipeline,
+                                        &worker->gateway_backlog);
+            ran += pipeline_backlog_run(&bot->pipeline, &worker->http_backlog);
+            ran += worker_run_gateway_tasks(worker);
+            ran += worker_run_http_tasks(worker);
+        }
+    } while (ran > 0);
+    pipeline_destroy(&bot->pipeline);
+
+    // Synchronous, the process may exit right after
+    bot_stop_session_writer(bot);
+    if (bot->session_file && bot->shards)
+        bot_save_sessions(bot, 0, 1);
+
+    for (int32_t i = 0; i < bot->shard_count; i++) {
+        MuseShard *shard = &bot->shards[i];
+        // Not 1000, the session stays resumable for the next process
+        transport_ws_close(&shard->ws, GATEWAY_CLOSE_KEEP_SESSION,
+                           "shutting down");
+        transport_ws_destroy(&shard->ws);
+        json_writer_free(&shard->writer);
+        free(shard->session_id);
     }
-    if (bot->user_id) {
-        free(bot->user_id);
-        bot->user_id = NULL;
+    free(bot->shards);
+    bot->shards = NULL;
+    bot->shard_count = 0;
+    free(bot->identify_ready_ms);
+    bot->identify_ready_ms = NULL;
+    pthread_mutex_destroy(&bot->identify_lock);
+    pthread_mutex_destroy(&bot->rest_limiter.lock);
+    free(bot->session_records);
+    bot->session_records = NULL;
+    pthread_cond_destroy(&bot->session_cond);
+    pthread_mutex_destroy(&bot->session_lock);
+
+    for (int32_t i = 0; i < bot->worker_count; i++) {
+        MuseWorker *worker = &bot->workers[i];
+        json_writer_free(&worker->writer);
+        while (worker->rest_head) {
+            RestRequest *req = worker->rest_head;
+            worker->rest_head = req->next;
+            metric_add(&rest_queue_depth, -1);
+            rest_request_free(req);
+        }
+        worker->rest_tail = NULL;
+        worker->rest_depth = 0;
+        if (worker->ts == &worker->own_ts) {
+            transport_destroy(&worker->own_ts);
+        }
+        transport_destroy(&worker->http_ts);
+        task_queue_destroy(&worker->http_tasks);
+        task_queue_destroy(&worker->gateway_tasks);
+        pipeline_backlog_destroy(&worker->http_backlog);
+        pipeline_backlog_destroy(&worker->gateway_backlog);
     }
+    free(bot->workers);
+    bot->workers = NULL;
+    bot->worker_count = 0;
+
+    free(atomic_exchange(&bot->user_id, NULL));
+    // The REST requests borrowing them went with the worker transports, an
+    // unanswered GET /gateway/bot on bot->ts is only cleaned up, not sent
+    curl_slist_free_all(bot->auth_headers);
+    bot->auth_headers = NULL;
+    curl_slist_free_all(bot->json_headers);
+    bot->json_headers = NULL;
 }
@@ -1,56 +1,354 @@
 #ifndef BOT_H
 #define BOT_H
 
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 
 #include <cjson/cJSON.h>
 
 #include "discord.h"
+#include "json_writer.h"
+#include "pipeline.h"
+#include "session_store.h"
+#include "task_queue.h"
+#include "trace.h"
 #include "transport.h"
 
 #define POLL_TIMEOUT_MS (100L)
-#define RECONNECT_INTERVAL_MS (5000L)
+// Polls while jobs wait for room in a pipeline queue, which has no fd to wake
+// the loop when it drains
+#define BACKLOG_POLL_TIMEOUT_MS (1L)
+// Reconnects wait a random time up to min(MAX, BASE * 2^attempt)
+#define RECONNECT_BACKOFF_BASE_MS (1000L)
+#define RECONNECT_BACKOFF_MAX_MS (60000L)
+// https://discord.com/developers/docs/events/gateway#session-start-limit-object
+#define IDENTIFY_INTERVAL_MS (5000L)
+// A heartbeat ACK later than the last round trip plus this, or than the
+// heartbeat interval, means the connection is a zombie
+#define HEARTBEAT_ACK_GRACE_MS (5000L)
+
+#define MAX_WORKERS (64)
+// Tasks waiting for a worker's HTTP loop, must be a power of two
+#define HTTP_TASK_QUEUE_SIZE (1024)
+// Gateway events handed back to a worker's gateway loop, power of two
+#define GATEWAY_TASK_QUEUE_SIZE (256)
+// Jobs waiting for each pipeline thread, power of two
+#define PIPELINE_QUEUE_SIZE (1024)
+#define MAX_PIPELINE_THREADS (64)
+
+// Resume state is also saved at shutdown, a crash replays at most this much
+#define SESSION_CHECKPOINT_INTERVAL_MS (10000L)
 
 typedef struct MuseBot MuseBot;
+typedef struct MuseShard MuseShard;
+typedef struct MuseWorker MuseWorker;
+
+// Slots in the dispatch table, must be a power of two
+#define DISPATCH_TABLE_SIZE (64)
+#define MAX_DISPATCH_HANDLERS (4)
 
-typedef void (*DispatchEventHandler)(MuseBot *bot, const char *event_name,
+typedef void (*DispatchEventHandler)(MuseShard *shard, const char *event_name,
                                      const cJSON *data_json);
 
+// Open-addressed by the event name hash, hash 0 marks an empty slot
 typedef struct {
-    DispatchEventHandler on_ready;
-    DispatchEventHandler on_message_create;
-} BotEventCallbacks;
+    uint64_t hash;
+    size_t name_length;
+    const char *name;
+    DispatchEventHandler handlers[MAX_DISPATCH_HANDLERS];
+    int32_t handler_count;
+} DispatchEntry;
 
-typedef struct MuseBot {
+// REST rate limiting
+// https://discord.com/developers/docs/topics/rate-limits
+// Slots in the bucket table, must be a power of two
+#define REST_BUCKET_TABLE_SIZE (1024)
+#define REST_BUCKET_PROBES (8)
+#define REST_GLOBAL_LIMIT_PER_SEC (50)
+// Sends per request, including 429 retries
+#define REST_MAX_ATTEMPTS (5)
+// Requests waiting on a worker's rate limits, new ones past it are shed
+#define REST_QUEUE_MAX_DEPTH (256)
+
+// One route + major parameter, open-addressed by key hash (0 marks an empty
+// slot). Slots whose window has reset and that have nothing in flight are
+// reused for new keys.
+typedef struct {
+    uint64_t key_hash;
+    // Both -1 until a response tells us the bucket's limits
+    int32_t limit;
+    int32_t remaining;
+    int32_t in_flight;
+    uint64_t reset_ms;
+} RestBucket;
+
+// Shared by every worker, Discord limits the token rather than a connection
+typedef struct {
+    pthread_mutex_t lock;
+    RestBucket buckets[REST_BUCKET_TABLE_SIZE];
+    // REST_GLOBAL_LIMIT_PER_SEC unless bot_set_rest_global_limit changed it
+    int32_t global_limit_per_sec;
+    uint64_t global_window_ms;
+    int32_t global_window_count;
+    // Set by a global 429
+    uint64_t global_blocked_until_ms;
+} RestRateLimiter;
+
+// A REST call waiting for (or holding) a slot in its bucket
+typedef struct RestRequest {
+    struct RestRequest *next;
+    MuseWorker *worker;
+    uint64_t key_hash;
+    char url[256];
+    uint64_t enqueued_ms;
+    int32_t attempts;
+    // Counted once in the rate-limited metric
+    bool was_limited;
+    // The messages this request replies to
+    TraceContext traces[MAX_MESSAGE_EMBEDS];
+    int32_t trace_count;
+    size_t body_length;
+    uint8_t body[];
+} RestRequest;
+
+// Runs on the worker's HTTP loop after every poll. Returns how long the loop
+// may wait before calling it again, capped at POLL_TIMEOUT_MS.
+typedef int64_t (*WorkerTickHandler)(MuseWorker *worker, uint64_t now_ms);
+// Runs once per message given to bot_rest_send_message or
+// bot_rest_post_message, when it is posted or dropped, with the number of
+// traces it carried. Runs on the worker's HTTP loop, or on the caller's
+// thread if the message never got there.
+typedef void (*RestDoneHandler)(MuseWorker *worker, int32_t trace_count);
+
+// Two event loops sharing a set of shards. The gateway loop owns the shards'
+// websockets: with one worker it runs inline in bot_tick on the caller's
+// transport, otherwise on its own thread with its own epoll set and curl
+// multi. The HTTP loop always has its own thread and transport and runs REST
+// sends, the tick handler and tasks posted with bot_post_http_task, so
+// gateway reads and heartbeats never wait behind HTTP completions.
+typedef struct MuseWorker {
+    MuseBot *bot;
+    // Gateway loop
     MuseTransport *ts;
+    MuseTransport own_ts;
+    int32_t index;
+    // CPU the gateway thread is pinned to, -1 to leave it to the scheduler
+    int32_t cpu;
+    pthread_t thread;
+    bool has_thread;
+    uint64_t next_checkpoint_ms;
+    // Events that pipeline threads parsed but that change connection state
+    // (HELLO, READY, ...), run by the gateway loop
+    TaskQueue gateway_tasks;
+    // Frames waiting for room in their shard's pipeline queue
+    PipelineBacklog gateway_backlog;
+
+    // HTTP loop
+    MuseTransport http_ts;
+    pthread_t http_thread;
+    bool has_http_thread;
+    atomic_bool http_running;
+    // Pushed from any thread, drained by the HTTP loop
+    TaskQueue http_tasks;
+    // Jobs from bot_pipeline_submit waiting for room in a pipeline queue
+    PipelineBacklog http_backlog;
+
+    // Reused for every REST body built on this worker's HTTP loop
+    JSONWriter writer;
+    // Requests waiting on a rate limit, sent in FIFO order per bucket
+    RestRequest *rest_head;
+    RestRequest *rest_tail;
+    int32_t rest_depth;
+
+    // Set from the tick handler's last answer
+    int64_t poll_timeout_ms;
+} MuseWorker;
+
+// One gateway session, with its own connection and resume state
+// https://discord.com/developers/docs/events/gateway#sharding
+typedef struct MuseShard {
+    MuseBot *bot;
+    MuseWorker *worker;
+    MuseWebSocket ws;
+    int32_t id;
+
+    // Initially the bot's gateway URL, then the resume URL from READY
     char gateway_url[256];
-    const char *token;
-    int32_t intents;
+    char *session_id;
 
-    uint64_t last_reconnect_attempt;
-    bool is_running;
+    // Earliest time the next connection attempt may start
+    uint64_t next_connect_ms;
+    int32_t reconnect_attempts;
+    // Discord asked us to reconnect, the next attempt resumes without
+    // backing off
+    bool reconnect_now;
+    // When the connection was lost, 0 once READY or RESUMED arrives
+    uint64_t disconnected_ms;
+    // xorshift64 state for the backoff jitter
+    uint64_t random_state;
     bool is_connected;
-    char *session_id;
-    char *user_id;
+    // Bumped for every connection, frames parsed on a pipeline thread carry
+    // it so events from a closed connection are not acted on
+    atomic_uint connection_id;
+    // HELLO arrived but the identify bucket was not ready yet
+    bool identify_pending;
 
-    int32_t last_seq;
+    // Written by the pipeline thread parsing the shard's frames, if any
+    _Atomic int32_t last_seq;
     int32_t heartbeat_interval_ms;
     uint64_t next_heartbeat_ms;
+    // A heartbeat still unacknowledged past HEARTBEAT_ACK_GRACE_MS, or when
+    // the next one is due, means the connection is a zombie
+    // https://discord.com/developers/docs/events/gateway#sending-heartbeats
+    bool heartbeat_acked;
+    uint64_t last_heartbeat_sent_ms;
+    // Round trip of the last acknowledged heartbeat, -1 before the first
+    int64_t latency_ms;
+
+    // Reused for every gateway send on this shard
+    JSONWriter writer;
+} MuseShard;
+
+typedef struct MuseBot {
+    MuseTransport *ts;
+    char gateway_url[256];
+    // REST endpoints are resolved against it, no trailing slash
+    const char *api_base_url;
+    const char *token;
+    int32_t intents;
+    // Built once by bot_init and borrowed by every request: Authorization
+    // alone, and with the JSON Content-Type of REST bodies
+    struct curl_slist *auth_headers;
+    struct curl_slist *json_headers;
+
+    atomic_bool is_running;
+    // Set once by the first READY, read from every worker
+    _Atomic(char *) user_id;
 
-    BotEventCallbacks callbacks;
+    // 0 until GET /gateway/bot answers, or the requested count if set
+    int32_t requested_shard_count;
+    bool gateway_info_requested;
+    MuseShard *shards;
+    int32_t shard_count;
+
+    // Earliest time each identify bucket (shard_id % max_concurrency) may
+    // send its next IDENTIFY
+    int32_t max_concurrency;
+    uint64_t *identify_ready_ms;
+    pthread_mutex_t identify_lock;
+
+    // Shard i runs on worker i % worker_count
+    int32_t requested_worker_count;
+    int32_t worker_cpus[MAX_WORKERS];
+    int32_t worker_cpu_count;
+    MuseWorker *workers;
+    int32_t worker_count;
+    atomic_bool workers_running;
+
+    // 0 parses and handles events on the event loops
+    int32_t requested_pipeline_threads;
+    Pipeline pipeline;
+
+    // Read-only once the first tick has run
+    DispatchEntry dispatch_table[DISPATCH_TABLE_SIZE];
+    // READY and RESUMED change the connection's state, so their frames go
+    // to the gateway loop. Matched by hash like the dispatch table.
+    uint64_t ready_hash;
+    size_t ready_length;
+    uint64_t resumed_hash;
+    size_t resumed_length;
+    WorkerTickHandler worker_tick_handler;
+    RestDoneHandler rest_done_handler;
+
+    RestRateLimiter rest_limiter;
+
+    // NULL to not persist sessions. Record i is shard i's resume state as of
+    // its worker's last checkpoint. Checkpoints are written and fsynced by
+    // the session writer thread, off the gateway loops.
+    const char *session_file;
+    SessionRecord *session_records;
+    pthread_mutex_t session_lock;
+    pthread_cond_t session_cond;
+    pthread_t session_thread;
+    bool has_session_thread;
+    // Under session_lock
+    bool session_dirty;
+    bool session_writer_stop;
+
+    uint64_t started_ms;
+    atomic_bool first_event_handled;
 } MuseBot;
 
 void bot_init(MuseBot *bot, MuseTransport *ts, const char *token,
-              int32_t intents, BotEventCallbacks callbacks);
+              int32_t intents);
 void bot_set_gateway_url(MuseBot *bot, const char *url);
+// Replaces https://discord.com/api/v10, e.g. to point the bot at a local
+// stand-in. The string must outlive the bot.
+void bot_set_api_base_url(MuseBot *bot, const char *url);
+// 0 (the default) uses the shard count Discord recommends
+void bot_set_shard_count(MuseBot *bot, int32_t shard_count);
+// Requests per second across all workers, e.g. to lift the limit against a
+// stand-in. Values below 1 keep REST_GLOBAL_LIMIT_PER_SEC.
+void bot_set_rest_global_limit(MuseBot *bot, int32_t per_sec);
+// Worker i is pinned to cpus[i % cpu_count], pass 0 CPUs to not pin.
+// More workers than shards are never started.
+void bot_set_workers(MuseBot *bot, int32_t worker_count, const int32_t *cpus,
+                     int32_t cpu_count);
+// Gateway frames are parsed and dispatched on a pool of thread_count threads,
+// the gateway loops only read them. 0 (the default) disables the pool.
+void bot_set_pipeline_threads(MuseBot *bot, int32_t thread_count);
+// Shards resume the sessions saved in path at startup, and checkpoint them
+// there periodically and at shutdown
+void bot_set_session_file(MuseBot *bot, const char *path);
+// Handlers run in registration order, register them before the first tick.
+// They run on the shard's gateway loop, or with pipeline threads on the
+// thread owning the shard, which sees its events in order. Returns false if
+// the table or the event's handler slots are full.
+bool bot_register_dispatch_handler(MuseBot *bot, const char *event_name,
+                                   DispatchEventHandler handler);
+// Set them before the first tick
+void bot_set_worker_tick_handler(MuseBot *bot, WorkerTickHandler handler);
+void bot_set_rest_done_handler(MuseBot *bot, RestDoneHandler handler);
 void bot_tick(MuseBot *bot);
+// NULL until the first READY
+const char *bot_user_id(MuseBot *bot);
+// No task is queued for a pipeline thread or an event loop. Tasks already
+// running aren't seen.
+bool bot_is_idle(MuseBot *bot);
+// For dispatch handlers: when the frame of the event being handled on this
+// thread was read
+uint64_t bot_dispatch_received_us(void);
+
+void bot_handle_gateway_event(MuseShard *shard,
+                              const GatewayEventPayload *payload);
+
+// Runs fn(worker, arg) on the worker's HTTP loop, callable from any thread.
+// Returns false without running it if the worker's task queue is full.
+bool bot_post_http_task(MuseWorker *worker, TaskFn fn, void *arg);
 
-// returns True if the event was DISPATCH, letting the caller handle it
-void bot_handle_gateway_event(MuseBot *bot, const GatewayEventPayload *payload);
+// Must be called on the worker's HTTP loop. Runs fn on a pipeline thread,
+// jobs with the same key in submission order, held back on the worker while
+// the queue is full. Returns false if there are no pipeline threads, the
+// caller then does the work itself.
+bool bot_pipeline_submit(MuseWorker *worker, uint64_t key, TaskFn fn,
+                         void *arg);
 
-void bot_rest_send_message(MuseBot *bot, const char *channel_id,
-                           const DiscordCreateMessage *message);
+// Must be called on the worker's HTTP loop. Queued while the route or the
+// global rate limit is exhausted, 429s are retried after retry_after. The
+// traces of the messages replied to (up to MAX_MESSAGE_EMBEDS) are finished
+// once the request is done.
+void bot_rest_send_message(MuseWorker *worker, const char *channel_id,
+                           const DiscordCreateMessage *message,
+                           const TraceContext *traces, int32_t trace_count);
+// Callable from any thread: serializes the body into writer, then hands the
+// request to the worker's HTTP loop. Returns false if the URL doesn't fit or
+// the loop's task queue is full.
+bool bot_rest_post_message(MuseWorker *worker, JSONWriter *writer,
+                           const char *channel_id,
+                           const DiscordCreateMessage *message,
+                           const TraceContext *traces, int32_t trace_count);
 
 void bot_destroy(MuseBot *bot);
 
@@ -0,0 +1,44 @@
+#ifndef BUFFER_H
+#define BUFFER_H
+
+#include "alloc.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BUFFER_DEFAULT_CAPACITY (16384)
+
+// Appends to any struct with `uint8_t *data`, `size_t length` and
+// `size_t capacity` members, growing the allocation geometrically.
+#define buffer_append(buffer, chunk, chunk_size)                               \
+    buffer_append_with(buffer, chunk, chunk_size, buffer_realloc, 0)
+// Same, accounting the allocation to tag. The data is freed with alloc_free.
+#define buffer_append_tagged(buffer, chunk, chunk_size, tag)                   \
+    buffer_append_with(buffer, chunk, chunk_size, alloc_realloc, tag)
+
+// Shared by the two above, resize is called like alloc_realloc
+#define buffer_realloc(tag, ptr, size) realloc(ptr, size)
+#define buffer_append_with(buffer, chunk, chunk_size, resize, tag)             \
+    do {                                                                       \
+        if ((buffer)->length + chunk_size > (buffer)->capacity) {              \
+            size_t new_capacity = (buffer)->capacity == 0                      \
+                                      ? BUFFER_DEFAULT_CAPACITY                \
+                                      : (buffer)->capacity;                    \
+            while ((buffer)->length + chunk_size > new_capacity) {             \
+                new_capacity *= 2;                                             \
+            }                                                                  \
+            uint8_t *ptr = resize(tag, (buffer)->data, new_capacity);          \
+            if (!ptr) {                                                        \
+                fprintf(stderr, "error: out of memory");                       \
+                exit(1);                                                       \
+            }                                                                  \
+            (buffer)->data = ptr;                                              \
+            (buffer)->capacity = new_capacity;                                 \
+        }                                                                      \
+        memcpy(&((buffer)->data[(buffer)->length]), chunk, chunk_size);        \
+        (buffer)->length += chunk_size;                                        \
+    } while (0);
+
+#endif // BUFFER_H
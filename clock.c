@@ -0,0 +1,171 @@
+#include "clock.h"
+
+#include <pthread.h>
+#include <stddef.h>
+#include <time.h>
+
+#ifdef _WIN32
+#define _WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#endif
+
+// A loop in clock_virtual_sleep_us, listed until it returns
+typedef struct VirtualSleeper {
+    uint64_t deadline_us;
+    atomic_bool *woken;
+    struct VirtualSleeper *next;
+} VirtualSleeper;
+
+static ClockSource clock_source;
+
+static atomic_uint_fast64_t virtual_now_us;
+// Guards everything below, virtual_cond is signalled whenever time moves,
+// a loop is woken or a loop or hold goes away
+static pthread_mutex_t virtual_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t virtual_cond = PTHREAD_COND_INITIALIZER;
+static int32_t virtual_loops;
+static int32_t virtual_holds;
+static int32_t virtual_sleeping;
+static VirtualSleeper *virtual_sleepers;
+
+uint64_t clock_real_now_us(void) {
+#ifndef _WIN32
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+#else
+    LARGE_INTEGER counter;
+    LARGE_INTEGER frequency;
+    QueryPerformanceCounter(&counter);
+    QueryPerformanceFrequency(&frequency);
+    return (uint64_t)(counter.QuadPart / frequency.QuadPart * 1000000 +
+                      counter.QuadPart % frequency.QuadPart * 1000000 /
+                          frequency.QuadPart);
+#endif
+}
+
+uint64_t clock_now_ms(void) {
+    if (clock_source)
+        return clock_source() / 1000;
+#ifndef _WIN32
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+#else
+    return (uint64_t)GetTickCount64();
+#endif
+}
+
+uint64_t clock_now_us(void) {
+    if (clock_source)
+        return clock_source();
+    return clock_real_now_us();
+}
+
+void clock_set_source(ClockSource source) { clock_source = source; }
+
+static uint64_t virtual_source(void) {
+    return atomic_load_explicit(&virtual_now_us, memory_order_acquire);
+}
+
+void clock_virtual_enable(uint64_t start_us) {
+    atomic_store(&virtual_now_us, start_us);
+    clock_set_source(virtual_source);
+}
+
+bool clock_is_virtual(void) { return clock_source == virtual_source; }
+
+void clock_virtual_join(void) {
+    if (!clock_is_virtual())
+        return;
+    pthread_mutex_lock(&virtual_lock);
+    virtual_loops++;
+    pthread_mutex_unlock(&virtual_lock);
+}
+
+void clock_virtual_leave(void) {
+    if (!clock_is_virtual())
+        return;
+    pthread_mutex_lock(&virtual_lock);
+    virtual_loops--;
+    pthread_cond_broadcast(&virtual_cond);
+    pthread_mutex_unlock(&virtual_lock);
+}
+
+void clock_virtual_hold(void) {
+    if (!clock_is_virtual())
+        return;
+    pthread_mutex_lock(&virtual_lock);
+    virtual_holds++;
+    pthread_mutex_unlock(&virtual_lock);
+}
+
+void clock_virtual_release(void) {
+    if (!clock_is_virtual())
+        return;
+    pthread_mutex_lock(&virtual_lock);
+    virtual_holds--;
+    pthread_cond_broadcast(&virtual_cond);
+    pthread_mutex_unlock(&virtual_lock);
+}
+
+// Called with virtual_lock held. Moves time to the earliest deadline if no
+// loop or hold can still produce work at the current time.
+static void virtual_try_advance(void) {
+    if (virtual_holds > 0 || virtual_sleeping < virtual_loops)
+        return;
+
+    uint64_t earliest = UINT64_MAX;
+    for (VirtualSleeper *s = virtual_sleepers; s; s = s->next) {
+        // Woken, but hasn't run yet
+        if (atomic_load(s->woken))
+            return;
+        if (s->deadline_us < earliest)
+            earliest = s->deadline_us;
+    }
+    if (earliest == UINT64_MAX)
+        return;
+
+    if (earliest > atomic_load(&virtual_now_us))
+        atomic_store_explicit(&virtual_now_us, earliest, memory_order_release);
+    pthread_cond_broadcast(&virtual_cond);
+}
+
+void clock_virtual_sleep_us(uint64_t timeout_us, atomic_bool *woken) {
+    VirtualSleeper sleeper = {
+        .deadline_us = atomic_load(&virtual_now_us) + timeout_us,
+        .woken = woken,
+    };
+
+    pthread_mutex_lock(&virtual_lock);
+    sleeper.next = virtual_sleepers;
+    virtual_sleepers = &sleeper;
+    virtual_sleeping++;
+
+    while (!atomic_load(woken) &&
+           atomic_load(&virtual_now_us) < sleeper.deadline_us) {
+        virtual_try_advance();
+        if (atomic_load(woken) ||
+            atomic_load(&virtual_now_us) >= sleeper.deadline_us)
+            break;
+        pthread_cond_wait(&virtual_cond, &virtual_lock);
+    }
+
+    for (VirtualSleeper **link = &virtual_sleepers; *link;
+         link = &(*link)->next) {
+        if (*link == &sleeper) {
+            *link = sleeper.next;
+            break;
+        }
+    }
+    virtual_sleeping--;
+    pthread_mutex_unlock(&virtual_lock);
+    atomic_store(woken, false);
+}
+
+void clock_virtual_wake(atomic_bool *woken) {
+    pthread_mutex_lock(&virtual_lock);
+    atomic_store(woken, true);
+    pthread_cond_broadcast(&virtual_cond);
+    pthread_mutex_unlock(&virtual_lock);
+}
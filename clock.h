@@ -0,0 +1,41 @@
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Reads the current time in microseconds
+typedef uint64_t (*ClockSource)(void);
+
+// Monotonic milliseconds, only meaningful as differences
+uint64_t clock_now_ms(void);
+// Same clock in microseconds, for timing work shorter than a millisecond
+uint64_t clock_now_us(void);
+// The host's monotonic clock, whatever source clock_now_* reads
+uint64_t clock_real_now_us(void);
+
+// Replaces the source clock_now_ms/us read, NULL restores the monotonic
+// clock. Set it before any other thread reads the clock.
+void clock_set_source(ClockSource source);
+
+// Virtual time for simulations. clock_now_* read a clock that stands still
+// while any loop is busy or any hold is taken, and jumps to the earliest
+// deadline once every loop is sleeping in clock_virtual_sleep_us.
+void clock_virtual_enable(uint64_t start_us);
+bool clock_is_virtual(void);
+// A loop joins before it first runs and leaves when it stops for good.
+// Threads may join on behalf of the loop threads they start.
+void clock_virtual_join(void);
+void clock_virtual_leave(void);
+// For work in flight outside the loops (pipeline jobs), time doesn't move
+// until it is released
+void clock_virtual_hold(void);
+void clock_virtual_release(void);
+// Sleeps the calling loop for timeout_us of virtual time, or until woken is
+// set by clock_virtual_wake. Clears woken before returning.
+void clock_virtual_sleep_us(uint64_t timeout_us, atomic_bool *woken);
+// Sets woken and ends the sleep waiting on it
+void clock_virtual_wake(atomic_bool *woken);
+
+#endif // CLOCK_H
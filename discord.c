@@ -1,23 +1,54 @@
 #include "discord.h"
+#include "alloc.h"
+#include "clock.h"
+#include "hash.h"
+#include "log.h"
+#include "metrics.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+// 64-bit FNV-1a, never 0 so that 0 can mark an empty dispatch slot
+uint64_t gateway_event_name_hash(const char *name, size_t *out_length) {
+    uint64_t hash = FNV_OFFSET_BASIS;
+    const char *p = name;
+
+    for (; *p; p++) {
+        hash ^= (uint8_t)*p;
+        hash *= FNV_PRIME;
+    }
+
+    if (out_length)
+        *out_length = (size_t)(p - name);
+    return hash ? hash : 1;
+}
+
+static Metric gateway_frames_total = METRIC_COUNTER_INIT(
+    "muse_gateway_frames_total", "Gateway frames parsed, across all shards");
+static Metric gateway_parse_errors_total = METRIC_COUNTER_INIT(
+    "muse_gateway_parse_errors_total", "Gateway frames that failed to parse");
+static Metric gateway_parse_us = METRIC_HISTOGRAM_INIT(
+    "muse_gateway_parse_us", "Microseconds spent parsing a gateway frame",
+    METRICS_LATENCY_US_BOUNDS);
+
 bool gateway_event_parse(uint8_t *data, size_t length,
                          GatewayEventPayload *out_payload) {
+    uint64_t started_us = clock_now_us();
     bool success = false;
     cJSON *payload_json = NULL;
     const cJSON *op = NULL;
     const cJSON *event_data = NULL;
     const cJSON *seq = NULL;
     const cJSON *type = NULL;
+    AllocTag previous_tag = alloc_scope_enter(ALLOC_GATEWAY);
 
     payload_json = cJSON_ParseWithLength((const char *)data, length);
     if (!payload_json) {
         const char *error_ptr = cJSON_GetErrorPtr();
         if (error_ptr) {
-            fprintf(stderr, "Failed to parse JSON payload: %s\n", error_ptr);
+            log_error(LOG_GATEWAY, "Failed to parse JSON payload: %s",
+                      error_ptr);
         }
         goto cleanup;
     }
@@ -28,21 +59,34 @@ bool gateway_event_parse(uint8_t *data, size_t length,
     type = cJSON_GetObjectItemCaseSensitive(payload_json, "t");
 
     if (!cJSON_IsNumber(op)) {
-        fprintf(stderr, "Invalid/missing 'op' field in payload\n");
+        log_error(LOG_GATEWAY, "Invalid/missing 'op' field in payload");
         goto cleanup;
     }
 
     out_payload->op = (int)op->valueint;
     out_payload->d_json = event_data ? cJSON_Duplicate(event_data, true) : NULL;
     out_payload->s = cJSON_IsNumber(seq) ? (int)seq->valueint : -1;
-    out_payload->t = cJSON_IsString(type) && (type->valuestring != NULL)
-                         ? strdup(type->valuestring)
-                         : NULL;
+    out_payload->t = NULL;
+    out_payload->t_length = 0;
+    out_payload->t_hash = 0;
+    if (cJSON_IsString(type) && type->valuestring != NULL) {
+        out_payload->t_hash = gateway_event_name_hash(type->valuestring,
+                                                      &out_payload->t_length);
+        out_payload->t =
+            alloc_malloc(ALLOC_GATEWAY, out_payload->t_length + 1);
+        memcpy(out_payload->t, type->valuestring, out_payload->t_length + 1);
+    }
     success = true;
 
 cleanup:
     if (payload_json)
         cJSON_Delete(payload_json);
+    alloc_scope_exit(previous_tag);
+    metric_add(&gateway_frames_total, 1);
+    if (!success)
+        metric_add(&gateway_parse_errors_total, 1);
+    metric_observe(&gateway_parse_us,
+                   (int64_t)(clock_now_us() - started_us));
     return success;
 }
 
@@ -50,8 +94,8 @@ bool gateway_event_parse_hello(const cJSON *data, HelloEventData *out_data) {
     const cJSON *heartbeat_interval =
         cJSON_GetObjectItemCaseSensitive(data, "heartbeat_interval");
     if (!cJSON_IsNumber(heartbeat_interval)) {
-        fprintf(stderr,
-                "Invalid/missing 'heartbeat_interval' in Hello event data\n");
+        log_error(LOG_GATEWAY,
+                  "Invalid/missing 'heartbeat_interval' in Hello event data");
         return false;
     }
 
@@ -59,221 +103,198 @@ bool gateway_event_parse_hello(const cJSON *data, HelloEventData *out_data) {
     return true;
 }
 
-cJSON *gateway_event_create(int32_t op, int32_t seq, const char *type,
-                            cJSON *data_json) {
-    cJSON *payload_json = NULL;
-
-    payload_json = cJSON_CreateObject();
-    if (!payload_json) {
-        fprintf(stderr, "Failed to create Gateway Event payload JSON\n");
-        goto cleanup;
+bool rest_parse_gateway_bot(const cJSON *data, GatewayBotData *out_data) {
+    const cJSON *url = cJSON_GetObjectItemCaseSensitive(data, "url");
+    const cJSON *shards = cJSON_GetObjectItemCaseSensitive(data, "shards");
+    const cJSON *limit =
+        cJSON_GetObjectItemCaseSensitive(data, "session_start_limit");
+    const cJSON *max_concurrency =
+        cJSON_GetObjectItemCaseSensitive(limit, "max_concurrency");
+    const cJSON *remaining =
+        cJSON_GetObjectItemCaseSensitive(limit, "remaining");
+
+    if (!cJSON_IsString(url) || !cJSON_IsNumber(shards)) {
+        log_error(LOG_GATEWAY,
+                  "Invalid/missing 'url' or 'shards' in Gateway Bot");
+        return false;
     }
 
-    cJSON_AddNumberToObject(payload_json, "op", op);
-    if (data_json) {
-        cJSON_AddItemToObject(payload_json, "d", data_json);
-    } else {
-        cJSON_AddNullToObject(payload_json, "d");
-    }
-    if (seq >= 0) {
-        cJSON_AddNumberToObject(payload_json, "s", seq);
-    }
-    if (type) {
-        cJSON_AddStringToObject(payload_json, "t", type);
-    }
+    out_data->url = url->valuestring;
+    out_data->shards = (int32_t)shards->valueint;
+    out_data->max_concurrency = cJSON_IsNumber(max_concurrency)
+                                    ? (int32_t)max_concurrency->valueint
+                                    : 1;
+    out_data->session_start_remaining =
+        cJSON_IsNumber(remaining) ? (int32_t)remaining->valueint : -1;
+    return true;
+}
 
-    return payload_json;
+GatewayCloseAction gateway_close_action(int32_t code) {
+    switch (code) {
+    case GATEWAY_CLOSE_AUTHENTICATION_FAILED:
+    case GATEWAY_CLOSE_INVALID_SHARD:
+    case GATEWAY_CLOSE_SHARDING_REQUIRED:
+    case GATEWAY_CLOSE_INVALID_API_VERSION:
+    case GATEWAY_CLOSE_INVALID_INTENTS:
+    case GATEWAY_CLOSE_DISALLOWED_INTENTS:
+        return GATEWAY_CLOSE_FATAL;
+    case GATEWAY_CLOSE_INVALID_SEQ:
+    case GATEWAY_CLOSE_SESSION_TIMED_OUT:
+        return GATEWAY_CLOSE_REIDENTIFY;
+    default:
+        return GATEWAY_CLOSE_RESUME;
+    }
+}
 
-cleanup:
-    if (payload_json)
-        cJSON_Delete(payload_json);
-    return NULL;
+// cJSON drops members whose string is NULL, keep doing the same
+static void json_member_string(JSONWriter *w, const char *key,
+                               const char *value) {
+    if (value) {
+        json_key(w, key);
+        json_string(w, value);
+    }
 }
 
-cJSON *gateway_event_identify(const IdentifyEventData *data) {
-    cJSON *d_json = NULL;
-    cJSON *properties_json = NULL;
-    cJSON *payload_json = NULL;
+void gateway_event_begin(JSONWriter *w, int32_t op) {
+    json_writer_reset(w);
+    json_object_begin(w);
+    json_key(w, "op");
+    json_int(w, op);
+    json_key(w, "d");
+}
 
-    d_json = cJSON_CreateObject();
-    if (!d_json) {
-        fprintf(stderr, "Failed to create 'd' object for Identify payload\n");
-        goto cleanup;
+void gateway_event_end(JSONWriter *w, int32_t seq, const char *type) {
+    if (seq >= 0) {
+        json_key(w, "s");
+        json_int(w, seq);
     }
+    json_member_string(w, "t", type);
+    json_object_end(w);
+}
 
-    cJSON_AddStringToObject(d_json, "token", data->token);
+void gateway_event_identify(JSONWriter *w, const IdentifyEventData *data) {
+    gateway_event_begin(w, SEND_OPCODE_IDENTIFY);
 
-    properties_json = cJSON_CreateObject();
-    if (!properties_json) {
-        fprintf(stderr,
-                "Failed to create 'properties' object for Identify payload\n");
-        goto cleanup;
-    }
+    json_object_begin(w);
+    json_member_string(w, "token", data->token);
 
-    cJSON_AddStringToObject(properties_json, "os", data->properties.os);
-    cJSON_AddStringToObject(properties_json, "browser",
-                            data->properties.browser);
-    cJSON_AddStringToObject(properties_json, "device", data->properties.device);
+    json_key(w, "properties");
+    json_object_begin(w);
+    json_member_string(w, "os", data->properties.os);
+    json_member_string(w, "browser", data->properties.browser);
+    json_member_string(w, "device", data->properties.device);
+    json_object_end(w);
 
-    cJSON_AddItemToObject(d_json, "properties", properties_json);
-    cJSON_AddNumberToObject(d_json, "intents", data->intents);
+    json_key(w, "intents");
+    json_int(w, data->intents);
 
-    payload_json = gateway_event_create(SEND_OPCODE_IDENTIFY, -1, NULL, d_json);
-    if (!payload_json) {
-        goto cleanup;
+    if (data->shard[1] > 0) {
+        json_key(w, "shard");
+        json_array_begin(w);
+        json_int(w, data->shard[0]);
+        json_int(w, data->shard[1]);
+        json_array_end(w);
     }
+    json_object_end(w);
 
-    return payload_json;
-
-cleanup:
-    if (properties_json)
-        cJSON_Delete(properties_json);
-    if (d_json)
-        cJSON_Delete(d_json);
-    return NULL;
+    gateway_event_end(w, -1, NULL);
 }
 
-cJSON *gateway_event_heartbeat(int32_t seq) {
-    return gateway_event_create(SEND_OPCODE_HEARTBEAT, -1, NULL,
-                                seq == -1 ? NULL : cJSON_CreateNumber(seq));
-}
+void gateway_event_resume(JSONWriter *w, const ResumeEventData *data) {
+    gateway_event_begin(w, SEND_OPCODE_RESUME);
 
-static cJSON *serialize_embed(const DiscordEmbed *embed) {
-    cJSON *embed_json = NULL;
-    cJSON *fields_json = NULL;
-    cJSON *field_json = NULL;
-    cJSON *image_json = NULL;
-    cJSON *thumbnail_json = NULL;
+    json_object_begin(w);
+    json_member_string(w, "token", data->token);
+    json_member_string(w, "session_id", data->session_id);
+    json_key(w, "seq");
+    json_int(w, data->seq);
+    json_object_end(w);
 
-    embed_json = cJSON_CreateObject();
-    if (!embed_json) {
-        fprintf(stderr, "Failed to create embed JSON object\n");
-        goto cleanup;
-    }
+    gateway_event_end(w, -1, NULL);
+}
 
-    if (embed->title) {
-        cJSON_AddStringToObject(embed_json, "title", embed->title);
-    }
-    if (embed->type) {
-        cJSON_AddStringToObject(embed_json, "type", embed->type);
-    }
-    if (embed->description) {
-        cJSON_AddStringToObject(embed_json, "description", embed->description);
-    }
-    if (embed->color != -1) {
-        cJSON_AddNumberToObject(embed_json, "color", embed->color);
+void gateway_event_heartbeat(JSONWriter *w, int32_t seq) {
+    gateway_event_begin(w, SEND_OPCODE_HEARTBEAT);
+    if (seq == -1) {
+        json_null(w);
+    } else {
+        json_int(w, seq);
     }
+    gateway_event_end(w, -1, NULL);
+}
 
-    if (embed->image.url) {
-        image_json = cJSON_CreateObject();
-        if (!image_json) {
-            fprintf(stderr, "Failed to create embed image JSON object\n");
-            goto cleanup;
-        }
-        cJSON_AddStringToObject(image_json, "url", embed->image.url);
-        cJSON_AddItemToObject(embed_json, "image", image_json);
-        image_json = NULL;
-    }
+static void serialize_embed_image(JSONWriter *w, const char *key,
+                                  const DiscordEmbedImage *image) {
+    if (!image->url)
+        return;
 
-    if (embed->thumbnail.url) {
-        thumbnail_json = cJSON_CreateObject();
-        if (!thumbnail_json) {
-            fprintf(stderr, "Failed to create embed thumbnail JSON object\n");
-            goto cleanup;
-        }
-        cJSON_AddStringToObject(thumbnail_json, "url", embed->thumbnail.url);
-        cJSON_AddItemToObject(embed_json, "thumbnail", thumbnail_json);
-        thumbnail_json = NULL;
-    }
+    json_key(w, key);
+    json_object_begin(w);
+    json_member_string(w, "url", image->url);
+    json_object_end(w);
+}
 
-    fields_json = cJSON_CreateArray();
-    if (!fields_json) {
-        fprintf(stderr, "Failed to create embed fields JSON array\n");
-        goto cleanup;
+static void serialize_embed(JSONWriter *w, const DiscordEmbed *embed) {
+    json_object_begin(w);
+
+    json_member_string(w, "title", embed->title);
+    json_member_string(w, "type", embed->type);
+    json_member_string(w, "description", embed->description);
+    if (embed->color != -1) {
+        json_key(w, "color");
+        json_int(w, embed->color);
     }
 
-    for (int i = 0; i < MAX_EMBED_FIELDS; i++) {
+    serialize_embed_image(w, "image", &embed->image);
+    serialize_embed_image(w, "thumbnail", &embed->thumbnail);
+
+    json_key(w, "fields");
+    json_array_begin(w);
+    size_t field_count = embed->field_count < MAX_EMBED_FIELDS
+                             ? embed->field_count
+                             : MAX_EMBED_FIELDS;
+    for (size_t i = 0; i < field_count; i++) {
         const DiscordEmbedField *field = &embed->fields[i];
         if (!field->name || !field->value) {
             continue;
         }
 
-        field_json = cJSON_CreateObject();
-        if (!field_json) {
-            fprintf(stderr, "Failed to create embed field JSON object\n");
-            goto cleanup;
-        }
-
-        cJSON_AddStringToObject(field_json, "name", field->name);
-        cJSON_AddStringToObject(field_json, "value", field->value);
-        cJSON_AddBoolToObject(field_json, "inline", field->inline_field);
-
-        cJSON_AddItemToArray(fields_json, field_json);
-        field_json = NULL;
+        json_object_begin(w);
+        json_member_string(w, "name", field->name);
+        json_member_string(w, "value", field->value);
+        json_key(w, "inline");
+        json_bool(w, field->inline_field);
+        json_object_end(w);
     }
+    json_array_end(w);
 
-    cJSON_AddItemToObject(embed_json, "fields", fields_json);
-    return embed_json;
-
-cleanup:
-    if (field_json)
-        cJSON_Delete(field_json);
-    if (fields_json)
-        cJSON_Delete(fields_json);
-    if (image_json)
-        cJSON_Delete(image_json);
-    if (thumbnail_json)
-        cJSON_Delete(thumbnail_json);
-    if (embed_json)
-        cJSON_Delete(embed_json);
-    return NULL;
+    json_object_end(w);
 }
 
-cJSON *rest_create_message(const DiscordCreateMessage *message) {
-    cJSON *message_json = NULL;
-    cJSON *embeds_json = NULL;
-    cJSON *embed_json = NULL;
+void rest_create_message(JSONWriter *w, const DiscordCreateMessage *message) {
+    json_writer_reset(w);
+    json_object_begin(w);
 
-    message_json = cJSON_CreateObject();
-    if (!message_json) {
-        fprintf(stderr, "Failed to create message JSON object\n");
-        goto cleanup;
-    }
-
-    cJSON_AddStringToObject(message_json, "content", message->content);
-    cJSON_AddNumberToObject(message_json, "nonce", message->nonce);
+    json_member_string(w, "content", message->content);
+    json_key(w, "nonce");
+    json_int(w, message->nonce);
 
-    embeds_json = cJSON_CreateArray();
-    if (!embeds_json) {
-        fprintf(stderr, "Failed to create embeds JSON array\n");
-        goto cleanup;
-    }
-    for (int i = 0; i < MAX_MESSAGE_EMBEDS; i++) {
+    json_key(w, "embeds");
+    json_array_begin(w);
+    size_t embed_count = message->embed_count < MAX_MESSAGE_EMBEDS
+                             ? message->embed_count
+                             : MAX_MESSAGE_EMBEDS;
+    for (size_t i = 0; i < embed_count; i++) {
         const DiscordEmbed *embed = &message->embeds[i];
         if (!embed->title && !embed->description) {
             continue;
         }
 
-        embed_json = serialize_embed(embed);
-        if (!embed_json) {
-            goto cleanup;
-        }
-
-        cJSON_AddItemToArray(embeds_json, embed_json);
-        embed_json = NULL;
+        serialize_embed(w, embed);
     }
+    json_array_end(w);
 
-    cJSON_AddItemToObject(message_json, "embeds", embeds_json);
-    return message_json;
-
-cleanup:
-    if (embed_json)
-        cJSON_Delete(embed_json);
-    if (embeds_json)
-        cJSON_Delete(embeds_json);
-    if (message_json)
-        cJSON_Delete(message_json);
-    return NULL;
+    json_object_end(w);
 }
 
 void gateway_event_cleanup(GatewayEventPayload *payload) {
@@ -281,6 +302,6 @@ void gateway_event_cleanup(GatewayEventPayload *payload) {
         cJSON_Delete(payload->d_json);
     }
     if (payload->t) {
-        free(payload->t);
+        alloc_free(payload->t);
     }
 }
@@ -5,6 +5,8 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#include "json_writer.h"
+
 #define MAX_EMBED_FIELDS (25)
 #define MAX_MESSAGE_EMBEDS (10)
 
@@ -40,6 +42,35 @@ typedef enum {
     SEND_OPCODE_RESUME = 6,
 } GatewayOpcodeSend;
 
+// https://discord.com/developers/docs/topics/opcodes-and-status-codes#gateway-gateway-close-event-codes
+typedef enum {
+    GATEWAY_CLOSE_UNKNOWN_ERROR = 4000,
+    GATEWAY_CLOSE_UNKNOWN_OPCODE = 4001,
+    GATEWAY_CLOSE_DECODE_ERROR = 4002,
+    GATEWAY_CLOSE_NOT_AUTHENTICATED = 4003,
+    GATEWAY_CLOSE_AUTHENTICATION_FAILED = 4004,
+    GATEWAY_CLOSE_ALREADY_AUTHENTICATED = 4005,
+    GATEWAY_CLOSE_INVALID_SEQ = 4007,
+    GATEWAY_CLOSE_RATE_LIMITED = 4008,
+    GATEWAY_CLOSE_SESSION_TIMED_OUT = 4009,
+    GATEWAY_CLOSE_INVALID_SHARD = 4010,
+    GATEWAY_CLOSE_SHARDING_REQUIRED = 4011,
+    GATEWAY_CLOSE_INVALID_API_VERSION = 4012,
+    GATEWAY_CLOSE_INVALID_INTENTS = 4013,
+    GATEWAY_CLOSE_DISALLOWED_INTENTS = 4014,
+} GatewayCloseCode;
+
+// Closing with 1000 or 1001 invalidates the session, we close with this
+// whenever we intend to resume
+#define GATEWAY_CLOSE_KEEP_SESSION (GATEWAY_CLOSE_UNKNOWN_ERROR)
+
+typedef enum {
+    GATEWAY_CLOSE_RESUME,
+    GATEWAY_CLOSE_REIDENTIFY,
+    // Reconnecting cannot succeed without a config change
+    GATEWAY_CLOSE_FATAL,
+} GatewayCloseAction;
+
 // https://discord.com/developers/docs/events/gateway-events#payload-structure
 typedef struct {
     // Gateway opcode, which indicates the payload type
@@ -50,6 +81,11 @@ typedef struct {
     int32_t s;
     // Event name
     char *t;
+    // Event name length and hash, computed once while parsing the frame
+    size_t t_length;
+    uint64_t t_hash;
+    // clock_now_us when the frame was read, set by the receiver
+    uint64_t received_us;
 } GatewayEventPayload;
 
 // https://discord.com/developers/docs/events/gateway-events#identify-identify-structure
@@ -61,12 +97,30 @@ typedef struct {
         const char *device;
     } properties;
     int32_t intents;
+    // [shard_id, num_shards], omitted when num_shards is 0
+    int32_t shard[2];
 } IdentifyEventData;
 
+// https://discord.com/developers/docs/events/gateway-events#resume-resume-structure
+typedef struct {
+    const char *token;
+    const char *session_id;
+    int32_t seq;
+} ResumeEventData;
+
 typedef struct {
     int32_t heartbeat_interval;
 } HelloEventData;
 
+// https://discord.com/developers/docs/events/gateway#get-gateway-bot
+typedef struct {
+    // Points into the parsed response
+    const char *url;
+    int32_t shards;
+    int32_t max_concurrency;
+    int32_t session_start_remaining;
+} GatewayBotData;
+
 // https://discord.com/developers/docs/resources/message#embed-object-embed-image-structure
 typedef struct {
     const char *url;
@@ -87,16 +141,21 @@ typedef struct {
     int32_t color;
     DiscordEmbedImage image;
     DiscordEmbedImage thumbnail;
-    DiscordEmbedField fields[MAX_EMBED_FIELDS];
+    // Caller-owned slice, serialized up to MAX_EMBED_FIELDS entries
+    const DiscordEmbedField *fields;
+    size_t field_count;
 } DiscordEmbed;
 
 // https://discord.com/developers/docs/resources/message#create-message
 typedef struct {
     const char *content;
     int32_t nonce;
-    const DiscordEmbed embeds[MAX_MESSAGE_EMBEDS];
+    // Caller-owned slice, serialized up to MAX_MESSAGE_EMBEDS entries
+    const DiscordEmbed *embeds;
+    size_t embed_count;
 } DiscordCreateMessage;
 
+uint64_t gateway_event_name_hash(const char *name, size_t *out_length);
 bool gateway_event_parse(uint8_t *data, size_t length,
                          GatewayEventPayload *out_payload);
 void gateway_event_cleanup(GatewayEventPayload *payload);
@@ -104,14 +163,18 @@ void gateway_event_cleanup(GatewayEventPayload *payload);
 // Receive Events
 
 bool gateway_event_parse_hello(const cJSON *data, HelloEventData *out_data);
+bool rest_parse_gateway_bot(const cJSON *data, GatewayBotData *out_data);
+GatewayCloseAction gateway_close_action(int32_t code);
 
 // Send Events
+// Builders reset the writer and serialize a complete document into it
 
-cJSON *gateway_event_create(int32_t op, int32_t seq, const char *type,
-                            cJSON *data_json);
-cJSON *gateway_event_identify(const IdentifyEventData *data);
-cJSON *gateway_event_heartbeat(int32_t seq);
+void gateway_event_begin(JSONWriter *w, int32_t op);
+void gateway_event_end(JSONWriter *w, int32_t seq, const char *type);
+void gateway_event_identify(JSONWriter *w, const IdentifyEventData *data);
+void gateway_event_resume(JSONWriter *w, const ResumeEventData *data);
+void gateway_event_heartbeat(JSONWriter *w, int32_t seq);
 
-cJSON *rest_create_message(const DiscordCreateMessage *message);
+void rest_create_message(JSONWriter *w, const DiscordCreateMessage *message);
 
 #endif // DISCORD_H
@@ -0,0 +1,23 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FNV_OFFSET_BASIS (14695981039346656037ULL)
+#define FNV_PRIME (1099511628211ULL)
+
+// 64-bit FNV-1a, chain calls by passing the previous result as the seed
+static inline uint64_t hash_fnv1a(uint64_t seed, const void *data,
+                                  size_t length) {
+    const uint8_t *bytes = (const uint8_t *)data;
+    uint64_t hash = seed;
+
+    for (size_t i = 0; i < length; i++) {
+        hash ^= bytes[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+#endif // HASH_H
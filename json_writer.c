@@ -0,0 +1,147 @@
+#include "json_writer.h"
+#include "buffer.h"
+
+#include <assert.h>
+
+// Escape character for each byte, 'u' for \u00XX and 0 for verbatim.
+// Mirrors cJSON: only quotes, backslashes and control characters are escaped.
+static const char escape_table[256] = {
+    ['\b'] = 'b', ['\f'] = 'f', ['\n'] = 'n', ['\r'] = 'r', ['\t'] = 't',
+    [0x00] = 'u', [0x01] = 'u', [0x02] = 'u', [0x03] = 'u', [0x04] = 'u',
+    [0x05] = 'u', [0x06] = 'u', [0x07] = 'u', [0x0b] = 'u', [0x0e] = 'u',
+    [0x0f] = 'u', [0x10] = 'u', [0x11] = 'u', [0x12] = 'u', [0x13] = 'u',
+    [0x14] = 'u', [0x15] = 'u', [0x16] = 'u', [0x17] = 'u', [0x18] = 'u',
+    [0x19] = 'u', [0x1a] = 'u', [0x1b] = 'u', [0x1c] = 'u', [0x1d] = 'u',
+    [0x1e] = 'u', [0x1f] = 'u', ['"'] = '"',  ['\\'] = '\\',
+};
+
+static const char hex_digits[] = "0123456789abcdef";
+
+// Writers mostly build REST bodies, the gateway's few sends count there too
+#define writer_append(w, chunk, chunk_size)                                    \
+    buffer_append_tagged(w, chunk, chunk_size, ALLOC_REST)
+
+void json_writer_reset(JSONWriter *w) {
+    w->length = 0;
+    w->has_member = 0;
+    w->depth = 0;
+    w->after_key = false;
+}
+
+void json_writer_free(JSONWriter *w) {
+    alloc_free(w->data);
+    w->data = NULL;
+    w->capacity = 0;
+    json_writer_reset(w);
+}
+
+// Emits the comma between siblings, unless the value belongs to a key
+static void json_separator(JSONWriter *w) {
+    if (w->after_key) {
+        w->after_key = false;
+        return;
+    }
+
+    uint32_t bit = (uint32_t)1 << w->depth;
+    if (w->has_member & bit) {
+        writer_append(w, ",", 1);
+    }
+    w->has_member |= bit;
+}
+
+static void json_container_begin(JSONWriter *w, const char *open) {
+    json_separator(w);
+    writer_append(w, open, 1);
+
+    assert(w->depth + 1 < JSON_WRITER_MAX_DEPTH);
+    w->depth++;
+    w->has_member &= ~((uint32_t)1 << w->depth);
+}
+
+static void json_container_end(JSONWriter *w, const char *close) {
+    assert(w->depth > 0);
+    w->depth--;
+    writer_append(w, close, 1);
+}
+
+void json_object_begin(JSONWriter *w) { json_container_begin(w, "{"); }
+
+void json_object_end(JSONWriter *w) { json_container_end(w, "}"); }
+
+void json_array_begin(JSONWriter *w) { json_container_begin(w, "["); }
+
+void json_array_end(JSONWriter *w) { json_container_end(w, "]"); }
+
+static void json_write_escaped(JSONWriter *w, const char *value) {
+    const uint8_t *run = (const uint8_t *)value;
+    const uint8_t *p = run;
+
+    writer_append(w, "\"", 1);
+    for (; *p; p++) {
+        char escape = escape_table[*p];
+        if (!escape)
+            continue;
+
+        // Copy the verbatim run before the escaped byte in one go
+        if (p > run) {
+            writer_append(w, run, (size_t)(p - run));
+        }
+
+        if (escape == 'u') {
+            char seq[6] = {'\\', 'u', '0', '0', hex_digits[*p >> 4],
+                           hex_digits[*p & 0xf]};
+            writer_append(w, seq, sizeof(seq));
+        } else {
+            char seq[2] = {'\\', escape};
+            writer_append(w, seq, sizeof(seq));
+        }
+        run = p + 1;
+    }
+    if (p > run) {
+        writer_append(w, run, (size_t)(p - run));
+    }
+    writer_append(w, "\"", 1);
+}
+
+void json_key(JSONWriter *w, const char *key) {
+    json_separator(w);
+    json_write_escaped(w, key);
+    writer_append(w, ":", 1);
+    w->after_key = true;
+}
+
+void json_string(JSONWriter *w, const char *value) {
+    json_separator(w);
+    json_write_escaped(w, value);
+}
+
+void json_int(JSONWriter *w, int64_t value) {
+    char digits[20];
+    size_t n = 0;
+    // Negate in unsigned space so INT64_MIN does not overflow
+    uint64_t magnitude = value < 0 ? 0 - (uint64_t)value : (uint64_t)value;
+
+    json_separator(w);
+    if (value < 0) {
+        writer_append(w, "-", 1);
+    }
+    do {
+        digits[sizeof(digits) - 1 - n++] = (char)('0' + magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude);
+    writer_append(w, &digits[sizeof(digits) - n], n);
+}
+
+void json_bool(JSONWriter *w, bool value) {
+    json_separator(w);
+    if (value) {
+        writer_append(w, "true", 4);
+    } else {
+        writer_append(w, "false", 5);
+    }
+}
+
+void json_null(JSONWriter *w) {
+    json_separator(w);
+    writer_append(w, "null", 4);
+}
@@ -0,0 +1,38 @@
+#ifndef JSON_WRITER_H
+#define JSON_WRITER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define JSON_WRITER_MAX_DEPTH (32)
+
+// Streaming JSON writer that serializes straight into a growable buffer.
+// The buffer is kept across documents, so a writer that is reset and reused
+// stops allocating once it has grown to fit the largest document.
+// Output matches cJSON_PrintUnformatted for the same sequence of members.
+typedef struct {
+    uint8_t *data;
+    size_t length;
+    size_t capacity;
+    // Bit N is set once the container at depth N has its first member
+    uint32_t has_member;
+    uint8_t depth;
+    bool after_key;
+} JSONWriter;
+
+void json_writer_reset(JSONWriter *w);
+void json_writer_free(JSONWriter *w);
+
+void json_object_begin(JSONWriter *w);
+void json_object_end(JSONWriter *w);
+void json_array_begin(JSONWriter *w);
+void json_array_end(JSONWriter *w);
+
+void json_key(JSONWriter *w, const char *key);
+void json_string(JSONWriter *w, const char *value);
+void json_int(JSONWriter *w, int64_t value);
+void json_bool(JSONWriter *w, bool value);
+void json_null(JSONWriter *w);
+
+#endif // JSON_WRITER_H
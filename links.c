@@ -1,4 +1,9 @@
 #include "links.h"
+#include "alloc.h"
+#include "clock.h"
+#include "hash.h"
+#include "log.h"
+#include "metrics.h"
 
 #include <regex.h>
 #include <stdio.h>
@@ -24,25 +29,27 @@ const char *APPLE_MUSIC_PATTERNS[] = {
     NULL,
 };
 
-static char encoded_url[2048];
-static char api_url[4096];
+static const char *songlink_api_url = SONGLINK_API_BASE_URL;
 
-static bool match_music_link(const char *message, char **out_url,
-                             const char **patterns) {
+static Metric links_matched_total = METRIC_COUNTER_INIT(
+    "muse_links_matched_total", "Messages found to contain a music link");
+static Metric links_lookups_total = METRIC_COUNTER_INIT(
+    "muse_links_lookups_total", "Songlink lookups sent");
+static Metric links_cache_hits_total = METRIC_COUNTER_INIT(
+    "muse_links_cache_hits_total", "Music links answered from the cache");
+static Metric links_cache_misses_total = METRIC_COUNTER_INIT(
+    "muse_links_cache_misses_total", "Music links missing from the cache");
+
+static bool match_music_link(const char *message, const char **out_start,
+                             size_t *out_length, const char **patterns) {
     regex_t regex;
     regmatch_t matches[1];
 
     for (int i = 0; patterns[i] != NULL; i++) {
         if (regcomp(&regex, patterns[i], REG_EXTENDED | REG_ICASE) == 0) {
             if (regexec(&regex, message, 1, matches, 0) == 0) {
-                int start = matches[0].rm_so;
-                int end = matches[0].rm_eo;
-                size_t len = end - start;
-                *out_url = malloc(len + 1);
-                if (*out_url) {
-                    memcpy(*out_url, message + start, len);
-                    (*out_url)[len] = '\0';
-                }
+                *out_start = message + matches[0].rm_so;
+                *out_length = (size_t)(matches[0].rm_eo - matches[0].rm_so);
                 regfree(&regex);
                 return true;
             }
@@ -52,25 +59,64 @@ static bool match_music_link(const char *message, char **out_url,
     return false;
 }
 
-bool is_music_link(const char *message, char **out_url) {
-    if (match_music_link(message, out_url, SPOTIFY_PATTERNS)) {
-        return true;
-    }
-    if (match_music_link(message, out_url, YOUTUBE_PATTERNS)) {
-        return true;
-    }
-    if (match_music_link(message, out_url, APPLE_MUSIC_PATTERNS)) {
+bool find_music_link(const char *message, const char **out_start,
+                     size_t *out_length) {
+    if (match_music_link(message, out_start, out_length, SPOTIFY_PATTERNS) ||
+        match_music_link(message, out_start, out_length, YOUTUBE_PATTERNS) ||
+        match_music_link(message, out_start, out_length,
+                         APPLE_MUSIC_PATTERNS)) {
+        metric_add(&links_matched_total, 1);
         return true;
     }
     return false;
 }
 
+char *music_link_dup(const char *start, size_t length) {
+    char *url = alloc_malloc(ALLOC_LINKS, length + 1);
+    if (url) {
+        memcpy(url, start, length);
+        url[length] = '\0';
+    }
+    return url;
+}
+
+bool is_music_link(const char *message, char **out_url) {
+    const char *start;
+    size_t length;
+
+    if (!find_music_link(message, &start, &length))
+        return false;
+    *out_url = music_link_dup(start, length);
+    return true;
+}
+
+void links_set_api_url(const char *url) { songlink_api_url = url; }
+
+bool music_links_lookup_url(const char *music_url, char *url, size_t size) {
+    size_t base_length = strlen(songlink_api_url);
+
+    if (base_length >= size)
+        return false;
+    memcpy(url, songlink_api_url, base_length);
+    return transport_url_encode(music_url, url + base_length,
+                                size - base_length);
+}
+
 void fetch_music_links(MuseTransport *ts, const char *music_url,
                        HTTPCallback on_done, void *user_data) {
-    transport_url_encode(music_url, encoded_url, sizeof(encoded_url));
-    snprintf(api_url, sizeof(api_url), "%s%s", SONGLINK_API_BASE_URL,
-             encoded_url);
-    transport_http_get(ts, api_url, on_done, user_data);
+    // curl copies the URL, so it can live on this stack
+    char url[SONGLINK_URL_SIZE];
+
+    if (!music_links_lookup_url(music_url, url, sizeof(url))) {
+        log_warn(LOG_LINKS, "Music link too long to look up: %.64s...",
+                 music_url);
+        HTTPResponse res = {.result = CURLE_URL_MALFORMAT};
+        on_done(&res, user_data);
+        return;
+    }
+    metric_add(&links_lookups_total, 1);
+    log_debug(LOG_LINKS, "Looking up '%s'", music_url);
+    transport_http_get(ts, url, NULL, on_done, user_data);
 }
 
 void parse_music_links_response(cJSON *response_json, MusicLinks *out_links) {
@@ -80,7 +126,8 @@ void parse_music_links_response(cJSON *response_json, MusicLinks *out_links) {
         if (spotify) {
             cJSON *url = cJSON_GetObjectItem(spotify, "url");
             if (url && url->valuestring) {
-                out_links->spotify_url = strdup(url->valuestring);
+                out_links->spotify_url =
+                    alloc_strdup(ALLOC_LINKS, url->valuestring);
             }
         }
 
@@ -88,7 +135,8 @@ void parse_music_links_response(cJSON *response_json, MusicLinks *out_links) {
         if (youtube) {
             cJSON *url = cJSON_GetObjectItem(youtube, "url");
             if (url && url->valuestring) {
-                out_links->youtube_url = strdup(url->valuestring);
+                out_links->youtube_url =
+                    alloc_strdup(ALLOC_LINKS, url->valuestring);
             }
         }
 
@@ -96,7 +144,8 @@ void parse_music_links_response(cJSON *response_json, MusicLinks *out_links) {
         if (apple) {
             cJSON *url = cJSON_GetObjectItem(apple, "url");
             if (url && url->valuestring) {
-                out_links->apple_music_url = strdup(url->valuestring);
+                out_links->apple_music_url =
+                    alloc_strdup(ALLOC_LINKS, url->valuestring);
             }
         }
     }
@@ -112,7 +161,8 @@ void parse_music_links_response(cJSON *response_json, MusicLinks *out_links) {
             if (entity) {
                 cJSON *thumb = cJSON_GetObjectItem(entity, "thumbnailUrl");
                 if (thumb && thumb->valuestring) {
-                    out_links->thumbnail_url = strdup(thumb->valuestring);
+                    out_links->thumbnail_url =
+                        alloc_strdup(ALLOC_LINKS, thumb->valuestring);
                 }
             }
         }
@@ -121,19 +171,101 @@ void parse_music_links_response(cJSON *response_json, MusicLinks *out_links) {
 
 void music_links_free(MusicLinks *links) {
     if (links->spotify_url) {
-        free(links->spotify_url);
+        alloc_free(links->spotify_url);
         links->spotify_url = NULL;
     }
     if (links->youtube_url) {
-        free(links->youtube_url);
+        alloc_free(links->youtube_url);
         links->youtube_url = NULL;
     }
     if (links->apple_music_url) {
-        free(links->apple_music_url);
+        alloc_free(links->apple_music_url);
         links->apple_music_url = NULL;
     }
     if (links->thumbnail_url) {
-        free(links->thumbnail_url);
+        alloc_free(links->thumbnail_url);
         links->thumbnail_url = NULL;
     }
 }
+
+static char *strdup_or_null(const char *str) {
+    return str ? alloc_strdup(ALLOC_LINKS, str) : NULL;
+}
+
+static void music_links_copy(const MusicLinks *src, MusicLinks *dst) {
+    dst->spotify_url = strdup_or_null(src->spotify_url);
+    dst->youtube_url = strdup_or_null(src->youtube_url);
+    dst->apple_music_url = strdup_or_null(src->apple_music_url);
+    dst->thumbnail_url = strdup_or_null(src->thumbnail_url);
+}
+
+static uint64_t link_cache_hash(const char *str) {
+    return hash_fnv1a(FNV_OFFSET_BASIS, str, strlen(str));
+}
+
+void link_cache_init(LinkCache *cache, uint64_t ttl_ms) {
+    memset(cache->entries, 0, sizeof(cache->entries));
+    for (int i = 0; i < LINK_CACHE_LOCK_STRIPES; i++) {
+        pthread_mutex_init(&cache->locks[i], NULL);
+    }
+    cache->ttl_ms = ttl_ms;
+}
+
+bool link_cache_get(LinkCache *cache, const char *music_url,
+                    MusicLinks *out_links) {
+    uint64_t hash = link_cache_hash(music_url);
+    size_t index = hash & (LINK_CACHE_SIZE - 1);
+    pthread_mutex_t *lock = &cache->locks[index % LINK_CACHE_LOCK_STRIPES];
+    LinkCacheEntry *entry = &cache->entries[index];
+    bool hit = false;
+
+    pthread_mutex_lock(lock);
+    if (entry->music_url && entry->hash == hash &&
+        entry->expires_ms > clock_now_ms() &&
+        strcmp(entry->music_url, music_url) == 0) {
+        music_links_copy(&entry->links, out_links);
+        hit = true;
+    }
+    pthread_mutex_unlock(lock);
+
+    metric_add(hit ? &links_cache_hits_total : &links_cache_misses_total, 1);
+    return hit;
+}
+
+void link_cache_put(LinkCache *cache, const char *music_url,
+                    const MusicLinks *links) {
+    // Not worth the TTL, a later lookup may find them
+    if (!links->spotify_url && !links->youtube_url && !links->apple_music_url)
+        return;
+
+    uint64_t hash = link_cache_hash(music_url);
+    size_t index = hash & (LINK_CACHE_SIZE - 1);
+    pthread_mutex_t *lock = &cache->locks[index % LINK_CACHE_LOCK_STRIPES];
+    LinkCacheEntry *entry = &cache->entries[index];
+
+    // Copy outside the lock, the previous occupant is freed outside it too
+    LinkCacheEntry replacement = {
+        .hash = hash,
+        .music_url = alloc_strdup(ALLOC_LINKS, music_url),
+        .expires_ms = clock_now_ms() + cache->ttl_ms,
+    };
+    music_links_copy(links, &replacement.links);
+
+    pthread_mutex_lock(lock);
+    LinkCacheEntry evicted = *entry;
+    *entry = replacement;
+    pthread_mutex_unlock(lock);
+
+    alloc_free(evicted.music_url);
+    music_links_free(&evicted.links);
+}
+
+void link_cache_destroy(LinkCache *cache) {
+    for (int i = 0; i < LINK_CACHE_SIZE; i++) {
+        alloc_free(cache->entries[i].music_url);
+        music_links_free(&cache->entries[i].links);
+    }
+    for (int i = 0; i < LINK_CACHE_LOCK_STRIPES; i++) {
+        pthread_mutex_destroy(&cache->locks[i]);
+    }
+}
@@ -1,7 +1,9 @@
 #ifndef LINKS_H
 #define LINKS_H
 
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 
 #include <cjson/cJSON.h>
@@ -19,10 +21,55 @@ typedef struct {
     char *thumbnail_url;
 } MusicLinks;
 
+// Direct-mapped, must be a power of two
+#define LINK_CACHE_SIZE (1024)
+#define LINK_CACHE_LOCK_STRIPES (16)
+#define LINK_CACHE_TTL_MS (6L * 60 * 60 * 1000)
+// Room for a lookup URL, a music link encodes to at most 3 times its length
+#define SONGLINK_URL_SIZE (4096)
+
+typedef struct {
+    uint64_t hash;
+    char *music_url;
+    MusicLinks links;
+    uint64_t expires_ms;
+} LinkCacheEntry;
+
+// Songlink results by source URL, shared by all workers. Entry i is guarded
+// by locks[i % LINK_CACHE_LOCK_STRIPES].
+typedef struct {
+    pthread_mutex_t locks[LINK_CACHE_LOCK_STRIPES];
+    LinkCacheEntry entries[LINK_CACHE_SIZE];
+    uint64_t ttl_ms;
+} LinkCache;
+
+// Points into message, nothing is allocated
+bool find_music_link(const char *message, const char **out_start,
+                     size_t *out_length);
+// Freed with alloc_free
+char *music_link_dup(const char *start, size_t length);
+// find_music_link followed by music_link_dup, the caller frees out_url with
+// alloc_free
 bool is_music_link(const char *message, char **out_url);
+// Replaces the Songlink links endpoint, the encoded music URL is appended to
+// it. Call before the first lookup, the string must outlive the lookups.
+void links_set_api_url(const char *url);
+// Writes the Songlink lookup URL for music_url into url, false if it won't
+// fit. Reentrant, nothing is allocated.
+bool music_links_lookup_url(const char *music_url, char *url, size_t size);
+// on_done gets CURLE_URL_MALFORMAT at once if the URL is too long to look up
 void fetch_music_links(MuseTransport *ts, const char *music_url,
                        HTTPCallback on_done, void *user_data);
 void parse_music_links_response(cJSON *response_json, MusicLinks *out_links);
 void music_links_free(MusicLinks *links);
 
+void link_cache_init(LinkCache *cache, uint64_t ttl_ms);
+// On a hit, out_links receives copies the caller frees
+bool link_cache_get(LinkCache *cache, const char *music_url,
+                    MusicLinks *out_links);
+// Results without any platform link are not cached
+void link_cache_put(LinkCache *cache, const char *music_url,
+                    const MusicLinks *links);
+void link_cache_destroy(LinkCache *cache);
+
 #endif // LINKS_H
@@ -0,0 +1,286 @@
+#include "log.h"
+#include "clock.h"
+#include "metrics.h"
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef _WIN32
+#define _WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#endif
+
+typedef struct {
+    // Vyukov's bounded MPMC sequence: equals the slot's position when free,
+    // position + 1 once a record is published
+    atomic_size_t seq;
+    int64_t time_ms;
+    uint8_t subsystem;
+    uint8_t level;
+    uint16_t length;
+    char text[LOG_MAX_MESSAGE];
+} LogSlot;
+
+static const char *level_names[] = {"DEBUG", "INFO", "WARN", "ERROR", "OFF"};
+// As spelled in log_configure specs
+static const char *level_config_names[] = {"debug", "info", "warn", "error",
+                                           "off"};
+static const char *subsystem_names[] = {"main", "transport", "gateway", "rest",
+                                        "links"};
+
+// Per-event noise (heartbeats, REST results) is DEBUG and stays out of
+// production by default
+atomic_uchar log_levels[LOG_SUBSYSTEM_COUNT] = {
+    LOG_LEVEL_INFO, LOG_LEVEL_INFO, LOG_LEVEL_INFO,
+    LOG_LEVEL_INFO, LOG_LEVEL_INFO,
+};
+
+static LogSlot ring[LOG_RING_SIZE];
+static atomic_size_t ring_head;
+// Only touched by the writer thread
+static size_t ring_tail;
+
+static pthread_t writer_thread;
+static atomic_bool writer_running;
+static atomic_bool writer_stop;
+
+static atomic_uint_fast64_t dropped;
+static uint64_t dropped_reported;
+static Metric log_dropped_total = METRIC_COUNTER_INIT(
+    "muse_log_dropped_total", "Log records dropped because the ring was full");
+
+// Wall clock minus the monotonic clock as of log_init
+static int64_t wall_offset_ms;
+
+static int64_t log_wall_ms(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int64_t log_time_ms(void) {
+    // Simulations stamp lines with virtual time, tools/simulate.py checks
+    // event timing from them
+    if (clock_is_virtual())
+        return (int64_t)(clock_now_us() / 1000) + wall_offset_ms;
+    return log_wall_ms();
+}
+
+static void log_sleep_ms(int32_t ms) {
+#ifdef _WIN32
+    Sleep((DWORD)ms);
+#else
+    struct timespec ts = {.tv_sec = 0, .tv_nsec = (long)ms * 1000000L};
+    nanosleep(&ts, NULL);
+#endif
+}
+
+static void log_emit(const LogSlot *slot) {
+    char stamp[32];
+    struct tm tm;
+    time_t seconds = (time_t)(slot->time_ms / 1000);
+
+#ifdef _WIN32
+    gmtime_s(&tm, &seconds);
+#else
+    gmtime_r(&seconds, &tm);
+#endif
+    strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+
+    FILE *stream = slot->level >= LOG_LEVEL_WARN ? stderr : stdout;
+    fprintf(stream, "%s.%03dZ %-5s %s: %.*s\n", stamp,
+            (int)(slot->time_ms % 1000), level_names[slot->level],
+            subsystem_names[slot->subsystem], (int)slot->length, slot->text);
+}
+
+static void log_format(LogSlot *slot, LogSubsystem subsystem, LogLevel level,
+                       const char *fmt, va_list ap) {
+    slot->time_ms = log_time_ms();
+    slot->subsystem = (uint8_t)subsystem;
+    slot->level = (uint8_t)level;
+
+    int n = vsnprintf(slot->text, sizeof(slot->text), fmt, ap);
+    if (n < 0)
+        n = 0;
+    if ((size_t)n >= sizeof(slot->text))
+        n = sizeof(slot->text) - 1;
+    slot->length = (uint16_t)n;
+}
+
+void log_write(LogSubsystem subsystem, LogLevel level, const char *fmt, ...) {
+    va_list ap;
+
+    // Before log_init and after log_shutdown there is nobody to drain the
+    // ring
+    if (!atomic_load_explicit(&writer_running, memory_order_acquire)) {
+        LogSlot slot;
+        va_start(ap, fmt);
+        log_format(&slot, subsystem, level, fmt, ap);
+        va_end(ap);
+        log_emit(&slot);
+        return;
+    }
+
+    size_t pos = atomic_load_explicit(&ring_head, memory_order_relaxed);
+    LogSlot *slot;
+    for (;;) {
+        slot = &ring[pos & (LOG_RING_SIZE - 1)];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(
+                    &ring_head, &pos, pos + 1, memory_order_relaxed,
+                    memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            // The writer hasn't freed this slot yet, the ring is full
+            atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+            metric_add(&log_dropped_total, 1);
+            return;
+        } else {
+            pos = atomic_load_explicit(&ring_head, memory_order_relaxed);
+        }
+    }
+
+    va_start(ap, fmt);
+    log_format(slot, subsystem, level, fmt, ap);
+    va_end(ap);
+
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+}
+
+// Writes every published record in order, returns how many
+static size_t log_drain(void) {
+    size_t count = 0;
+
+    for (;;) {
+        LogSlot *slot = &ring[ring_tail & (LOG_RING_SIZE - 1)];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        if (seq != ring_tail + 1)
+            break;
+
+        log_emit(slot);
+        atomic_store_explicit(&slot->seq, ring_tail + LOG_RING_SIZE,
+                              memory_order_release);
+        ring_tail++;
+        count++;
+    }
+
+    uint64_t total = atomic_load_explicit(&dropped, memory_order_relaxed);
+    if (total != dropped_reported) {
+        fprintf(stderr, "log: dropped %llu record(s), ring full\n",
+                (unsigned long long)(total - dropped_reported));
+        dropped_reported = total;
+        count++;
+    }
+
+    if (count > 0) {
+        fflush(stdout);
+        fflush(stderr);
+    }
+    return count;
+}
+
+static void *log_writer_main(void *arg) {
+    (void)arg;
+
+    for (;;) {
+        bool stopping = atomic_load(&writer_stop);
+        if (log_drain() == 0) {
+            if (stopping)
+                break;
+            log_sleep_ms(LOG_FLUSH_INTERVAL_MS);
+        }
+    }
+
+    return NULL;
+}
+
+void log_init(void) {
+    if (atomic_load(&writer_running))
+        return;
+
+    for (size_t i = 0; i < LOG_RING_SIZE; i++) {
+        atomic_store_explicit(&ring[i].seq, i, memory_order_relaxed);
+    }
+    atomic_store(&ring_head, 0);
+    ring_tail = 0;
+    atomic_store(&writer_stop, false);
+    wall_offset_ms = log_wall_ms() - (int64_t)(clock_real_now_us() / 1000);
+    metrics_register(&log_dropped_total);
+
+    if (pthread_create(&writer_thread, NULL, log_writer_main, NULL) != 0) {
+        fprintf(stderr, "Failed to start log writer, logging synchronously\n");
+        return;
+    }
+    atomic_store_explicit(&writer_running, true, memory_order_release);
+}
+
+void log_set_level(LogSubsystem subsystem, LogLevel level) {
+    atomic_store_explicit(&log_levels[subsystem], (unsigned char)level,
+                          memory_order_relaxed);
+}
+
+static bool parse_name(const char *name, size_t length, const char **names,
+                       int32_t count, int32_t *out_index) {
+    for (int32_t i = 0; i < count; i++) {
+        if (strlen(names[i]) == length &&
+            strncmp(names[i], name, length) == 0) {
+            *out_index = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool log_configure(const char *spec) {
+    while (*spec) {
+        const char *end = strchr(spec, ',');
+        size_t length = end ? (size_t)(end - spec) : strlen(spec);
+        const char *equals = memchr(spec, '=', length);
+        int32_t subsystem = -1;
+        int32_t level;
+
+        const char *level_name = equals ? equals + 1 : spec;
+        size_t level_length = length - (size_t)(level_name - spec);
+        if (!parse_name(level_name, level_length, level_config_names,
+                        LOG_LEVEL_OFF + 1, &level) ||
+            (equals &&
+             !parse_name(spec, (size_t)(equals - spec), subsystem_names,
+                         LOG_SUBSYSTEM_COUNT, &subsystem))) {
+            fprintf(stderr, "Unknown log setting '%.*s'\n", (int)length, spec);
+            return false;
+        }
+
+        if (subsystem >= 0) {
+            log_set_level((LogSubsystem)subsystem, (LogLevel)level);
+        } else {
+            for (int32_t i = 0; i < LOG_SUBSYSTEM_COUNT; i++) {
+                log_set_level((LogSubsystem)i, (LogLevel)level);
+            }
+        }
+
+        spec = end ? end + 1 : spec + length;
+    }
+
+    return true;
+}
+
+uint64_t log_dropped(void) {
+    return atomic_load_explicit(&dropped, memory_order_relaxed);
+}
+
+void log_shutdown(void) {
+    if (!atomic_load(&writer_running))
+        return;
+
+    atomic_store(&writer_stop, true);
+    pthread_join(writer_thread, NULL);
+    atomic_store_explicit(&writer_running, false, memory_order_release);
+    // Records published while the writer was exiting
+    log_drain();
+}
@@ -0,0 +1,71 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Records go through a lock-free ring to a background writer thread, so a
+// log call never blocks on stdout. When the ring is full records are
+// dropped and counted rather than waited for.
+
+// Slots in the ring, must be a power of two
+#define LOG_RING_SIZE (4096)
+// Longer messages are truncated
+#define LOG_MAX_MESSAGE (256)
+#define LOG_FLUSH_INTERVAL_MS (5)
+
+typedef enum {
+    LOG_LEVEL_DEBUG,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_ERROR,
+    LOG_LEVEL_OFF,
+} LogLevel;
+
+typedef enum {
+    LOG_MAIN,
+    LOG_TRANSPORT,
+    LOG_GATEWAY,
+    LOG_REST,
+    LOG_LINKS,
+    LOG_SUBSYSTEM_COUNT,
+} LogSubsystem;
+
+// Minimum level per subsystem, read on every log call
+extern atomic_uchar log_levels[LOG_SUBSYSTEM_COUNT];
+
+static inline bool log_enabled(LogSubsystem subsystem, LogLevel level) {
+    return level >=
+           atomic_load_explicit(&log_levels[subsystem], memory_order_relaxed);
+}
+
+// Arguments are only evaluated and formatted when the level is enabled
+#define log_at(subsystem, level, ...)                                          \
+    do {                                                                       \
+        if (log_enabled((subsystem), (level)))                                 \
+            log_write((subsystem), (level), __VA_ARGS__);                      \
+    } while (0)
+
+#define log_debug(subsystem, ...)                                              \
+    log_at(subsystem, LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define log_info(subsystem, ...) log_at(subsystem, LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_warn(subsystem, ...) log_at(subsystem, LOG_LEVEL_WARN, __VA_ARGS__)
+#define log_error(subsystem, ...)                                              \
+    log_at(subsystem, LOG_LEVEL_ERROR, __VA_ARGS__)
+
+// Starts the writer thread, records logged before are written synchronously
+void log_init(void);
+// Comma separated "level" or "subsystem=level" entries, e.g.
+// "warn,gateway=debug". Returns false on an unknown name, entries before it
+// still apply.
+bool log_configure(const char *spec);
+void log_set_level(LogSubsystem subsystem, LogLevel level);
+void log_write(LogSubsystem subsystem, LogLevel level, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+// Records dropped because the ring was full
+uint64_t log_dropped(void);
+// Writes out every queued record and stops the writer thread
+void log_shutdown(void);
+
+#endif // LOG_H
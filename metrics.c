@@ -0,0 +1,298 @@
+#include "metrics.h"
+#include "buffer.h"
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+
+const int64_t METRICS_LATENCY_MS_BOUNDS[13] = {
+    1, 2, 5, 10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000,
+};
+
+const int64_t METRICS_LATENCY_US_BOUNDS[13] = {
+    10,   25,   50,    100,   250,   500,    1000,
+    2500, 5000, 10000, 25000, 50000, 100000,
+};
+
+const int64_t METRICS_SPAN_US_BOUNDS[16] = {
+    100,    200,    500,     1000,    2000,    5000,    10000,   20000,
+    50000,  100000, 200000,  500000,  1000000, 2000000, 5000000, 10000000,
+};
+
+// One thread's cells. Only the owning thread writes them, so updates are a
+// relaxed load and store instead of a locked read-modify-write, and no
+// cache line is shared between writers.
+typedef struct MetricsShard {
+    atomic_int_fast64_t cells[METRICS_MAX_CELLS];
+    struct MetricsShard *next;
+} MetricsShard;
+
+// Guards the registry, the shard list and cells_used
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static Metric *registry_head = NULL;
+static int32_t cells_used;
+static MetricsShard *shards_head;
+// Totals of the threads that have exited
+static MetricsShard retired;
+
+static pthread_once_t shard_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t shard_key;
+static _Thread_local MetricsShard *local_shard;
+
+// Runs as a thread exits, its counts are kept in the retired shard
+static void shard_retire(void *arg) {
+    MetricsShard *shard = (MetricsShard *)arg;
+
+    pthread_mutex_lock(&registry_lock);
+    for (MetricsShard **link = &shards_head; *link; link = &(*link)->next) {
+        if (*link == shard) {
+            *link = shard->next;
+            break;
+        }
+    }
+    for (int32_t i = 0; i < cells_used; i++) {
+        atomic_fetch_add_explicit(
+            &retired.cells[i],
+            atomic_load_explicit(&shard->cells[i], memory_order_relaxed),
+            memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&registry_lock);
+
+    local_shard = NULL;
+    free(shard);
+}
+
+static void shard_key_create(void) {
+    pthread_key_create(&shard_key, shard_retire);
+}
+
+static MetricsShard *metrics_local_shard(void) {
+    if (local_shard)
+        return local_shard;
+
+    MetricsShard *shard = calloc(1, sizeof(*shard));
+    if (!shard) {
+        fprintf(stderr, "error: out of memory");
+        exit(1);
+    }
+    pthread_once(&shard_key_once, shard_key_create);
+    pthread_setspecific(shard_key, shard);
+
+    pthread_mutex_lock(&registry_lock);
+    shard->next = shards_head;
+    shards_head = shard;
+    pthread_mutex_unlock(&registry_lock);
+
+    local_shard = shard;
+    return shard;
+}
+
+static void cell_add(int32_t cell, int64_t delta) {
+    atomic_int_fast64_t *value = &metrics_local_shard()->cells[cell];
+    atomic_store_explicit(
+        value, atomic_load_explicit(value, memory_order_relaxed) + delta,
+        memory_order_relaxed);
+}
+
+// Called with registry_lock held
+static int64_t cell_sum(int32_t cell) {
+    int64_t sum = atomic_load_explicit(&retired.cells[cell],
+                                       memory_order_relaxed);
+    for (MetricsShard *shard = shards_head; shard; shard = shard->next) {
+        sum += atomic_load_explicit(&shard->cells[cell], memory_order_relaxed);
+    }
+    return sum;
+}
+
+void metrics_register(Metric *metric) {
+    bool out_of_cells = false;
+
+    if (atomic_load_explicit(&metric->registered, memory_order_acquire))
+        return;
+
+    pthread_mutex_lock(&registry_lock);
+    if (!atomic_load_explicit(&metric->registered, memory_order_relaxed)) {
+        int32_t cell_count = metric->type == METRIC_HISTOGRAM ||
+                                     metric->type == METRIC_SUMMARY
+                                 ? metric->bound_count + 2
+                                 : 1;
+        if (cells_used + cell_count <= METRICS_MAX_CELLS) {
+            metric->cell = cells_used;
+            cells_used += cell_count;
+        } else {
+            metric->cell = -1;
+            out_of_cells = true;
+        }
+        metric->next = registry_head;
+        registry_head = metric;
+        atomic_store_explicit(&metric->registered, true, memory_order_release);
+    }
+    pthread_mutex_unlock(&registry_lock);
+
+    if (out_of_cells) {
+        fprintf(stderr, "error: out of metric cells for %s\n", metric->name);
+    }
+}
+
+void metric_add(Metric *metric, int64_t delta) {
+    metrics_register(metric);
+    if (metric->cell >= 0)
+        cell_add(metric->cell, delta);
+}
+
+void metric_set(Metric *metric, int64_t value) {
+    metrics_register(metric);
+    atomic_store_explicit(&metric->set_value, value, memory_order_relaxed);
+}
+
+void metric_set_max(Metric *metric, int64_t value) {
+    metrics_register(metric);
+    int_fast64_t current =
+        atomic_load_explicit(&metric->set_value, memory_order_relaxed);
+    while (current < value &&
+           !atomic_compare_exchange_weak_explicit(&metric->set_value, &current,
+                                                  value, memory_order_relaxed,
+                                                  memory_order_relaxed)) {
+    }
+}
+
+void metric_observe(Metric *metric, int64_t value) {
+    int32_t bucket = 0;
+
+    metrics_register(metric);
+    if (metric->cell < 0)
+        return;
+
+    while (bucket < metric->bound_count && value > metric->bounds[bucket]) {
+        bucket++;
+    }
+
+    cell_add(metric->cell + bucket, 1);
+    // The sum follows the bucket cells
+    cell_add(metric->cell + metric->bound_count + 1, value);
+}
+
+static void metrics_printf(MetricsOutput *out, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static void metrics_printf(MetricsOutput *out, const char *fmt, ...) {
+    char line[512];
+    va_list ap;
+
+    va_start(ap, fmt);
+    int n = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+
+    if (n < 0)
+        return;
+    if ((size_t)n >= sizeof(line))
+        n = sizeof(line) - 1;
+    buffer_append(out, line, (size_t)n);
+}
+
+static void render_histogram(MetricsOutput *out, Metric *metric) {
+    int64_t cumulative = 0;
+
+    for (int32_t i = 0; i <= metric->bound_count; i++) {
+        if (metric->cell >= 0)
+            cumulative += cell_sum(metric->cell + i);
+        if (i < metric->bound_count) {
+            metrics_printf(out, "%s_bucket{le=\"%lld\"} %lld\n",
+                           metric->name, (long long)metric->bounds[i],
+                           (long long)cumulative);
+        } else {
+            metrics_printf(out, "%s_bucket{le=\"+Inf\"} %lld\n",
+                           metric->name, (long long)cumulative);
+        }
+    }
+
+    int64_t sum = 0;
+    if (metric->cell >= 0)
+        sum = cell_sum(metric->cell + metric->bound_count + 1);
+    metrics_printf(out, "%s_sum %lld\n", metric->name, (long long)sum);
+    metrics_printf(out, "%s_count %lld\n", metric->name,
+                   (long long)cumulative);
+}
+
+// Linear interpolation within the bucket the quantile falls in. Values past
+// the last bound are reported as the last bound.
+static double summary_quantile(Metric *metric, int64_t count, double q) {
+    double rank = q * (double)count;
+    int64_t cumulative = 0;
+
+    for (int32_t i = 0; i <= metric->bound_count; i++) {
+        int64_t in_bucket = cell_sum(metric->cell + i);
+        if (in_bucket > 0 && (double)(cumulative + in_bucket) >= rank) {
+            if (i == metric->bound_count)
+                break;
+            double lower = i == 0 ? 0 : (double)metric->bounds[i - 1];
+            double upper = (double)metric->bounds[i];
+            return lower + (upper - lower) * (rank - (double)cumulative) /
+                               (double)in_bucket;
+        }
+        cumulative += in_bucket;
+    }
+    return (double)metric->bounds[metric->bound_count - 1];
+}
+
+static void render_summary(MetricsOutput *out, Metric *metric) {
+    static const char *quantiles[] = {"0.5", "0.99", "0.999"};
+    int64_t count = 0;
+    int64_t sum = 0;
+
+    if (metric->cell >= 0) {
+        for (int32_t i = 0; i <= metric->bound_count; i++) {
+            count += cell_sum(metric->cell + i);
+        }
+        sum = cell_sum(metric->cell + metric->bound_count + 1);
+    }
+
+    for (size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++) {
+        if (count == 0) {
+            metrics_printf(out, "%s{quantile=\"%s\"} NaN\n", metric->name,
+                           quantiles[i]);
+            continue;
+        }
+        metrics_printf(out, "%s{quantile=\"%s\"} %.0f\n", metric->name,
+                       quantiles[i],
+                       summary_quantile(metric, count, atof(quantiles[i])));
+    }
+    metrics_printf(out, "%s_sum %lld\n", metric->name, (long long)sum);
+    metrics_printf(out, "%s_count %lld\n", metric->name, (long long)count);
+}
+
+void metrics_render(MetricsOutput *out) {
+    static const char *type_names[] = {"counter", "gauge", "histogram",
+                                       "summary"};
+
+    pthread_mutex_lock(&registry_lock);
+    for (Metric *metric = registry_head; metric; metric = metric->next) {
+        metrics_printf(out, "# HELP %s %s\n", metric->name, metric->help);
+        metrics_printf(out, "# TYPE %s %s\n", metric->name,
+                       type_names[metric->type]);
+
+        if (metric->type == METRIC_HISTOGRAM) {
+            render_histogram(out, metric);
+            continue;
+        }
+        if (metric->type == METRIC_SUMMARY) {
+            render_summary(out, metric);
+            continue;
+        }
+
+        int64_t value = metric->cell >= 0 ? cell_sum(metric->cell) : 0;
+        if (metric->type == METRIC_GAUGE) {
+            value += atomic_load_explicit(&metric->set_value,
+                                          memory_order_relaxed);
+        }
+        metrics_printf(out, "%s %lld\n", metric->name, (long long)value);
+    }
+    pthread_mutex_unlock(&registry_lock);
+}
+
+void metrics_output_free(MetricsOutput *out) {
+    free(out->data);
+    out->data = NULL;
+    out->length = 0;
+    out->capacity = 0;
+}
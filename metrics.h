@@ -0,0 +1,87 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Cells in every thread's shard: one per counter or gauge, bucket count + 2
+// per histogram or summary
+#define METRICS_MAX_CELLS (2048)
+
+typedef enum {
+    METRIC_COUNTER,
+    METRIC_GAUGE,
+    METRIC_HISTOGRAM,
+    // Bucketed like a histogram, rendered as the estimated p50, p99 and p999
+    METRIC_SUMMARY,
+} MetricType;
+
+// Metrics are statically allocated by the module that owns them and listed
+// in the registry on first use. Updates go to cells in the calling thread's
+// shard, written only by that thread, and metrics_render sums the shards.
+typedef struct Metric {
+    const char *name;
+    const char *help;
+    MetricType type;
+
+    // Histograms and summaries, bucket i counts observations <= bounds[i],
+    // the last bucket counts the rest (+Inf)
+    const int64_t *bounds;
+    int32_t bound_count;
+
+    // Gauges only: the last metric_set value, metric_add deltas are summed
+    // on top of it
+    atomic_int_fast64_t set_value;
+
+    // First of the metric's cells in every shard, -1 if the cells ran out
+    int32_t cell;
+    atomic_bool registered;
+    struct Metric *next;
+} Metric;
+
+typedef struct {
+    uint8_t *data;
+    size_t length;
+    size_t capacity;
+} MetricsOutput;
+
+#define METRIC_COUNTER_INIT(metric_name, metric_help)                          \
+    {.name = (metric_name), .help = (metric_help), .type = METRIC_COUNTER}
+#define METRIC_GAUGE_INIT(metric_name, metric_help)                            \
+    {.name = (metric_name), .help = (metric_help), .type = METRIC_GAUGE}
+#define METRIC_HISTOGRAM_INIT(metric_name, metric_help, metric_bounds)         \
+    {.name = (metric_name),                                                    \
+     .help = (metric_help),                                                    \
+     .type = METRIC_HISTOGRAM,                                                 \
+     .bounds = (metric_bounds),                                                \
+     .bound_count = sizeof(metric_bounds) / sizeof((metric_bounds)[0])}
+#define METRIC_SUMMARY_INIT(metric_name, metric_help, metric_bounds)           \
+    {.name = (metric_name),                                                    \
+     .help = (metric_help),                                                    \
+     .type = METRIC_SUMMARY,                                                   \
+     .bounds = (metric_bounds),                                                \
+     .bound_count = sizeof(metric_bounds) / sizeof((metric_bounds)[0])}
+
+// Millisecond bounds shared by the latency histograms
+extern const int64_t METRICS_LATENCY_MS_BOUNDS[13];
+// Microsecond bounds for CPU-bound stages
+extern const int64_t METRICS_LATENCY_US_BOUNDS[13];
+// Microsecond bounds from 100 us to 10 s, for spans that include network
+// round trips
+extern const int64_t METRICS_SPAN_US_BOUNDS[16];
+
+// Lists a metric before its first update so it is rendered from startup
+void metrics_register(Metric *metric);
+void metric_add(Metric *metric, int64_t delta);
+void metric_set(Metric *metric, int64_t value);
+// Gauges only, raises the metric_set value to value if it is lower
+void metric_set_max(Metric *metric, int64_t value);
+void metric_observe(Metric *metric, int64_t value);
+
+// Renders every registered metric in the Prometheus text format
+void metrics_render(MetricsOutput *out);
+void metrics_output_free(MetricsOutput *out);
+
+#endif // METRICS_H
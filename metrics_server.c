@@ -0,0 +1,260 @@
+#include "metrics_server.h"
+#include "buffer.h"
+#include "log.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#define socket_close close
+#define socket_error() errno
+#define SOCKET_WOULD_BLOCK(err) ((err) == EAGAIN || (err) == EWOULDBLOCK)
+#else
+#include <ws2tcpip.h>
+#define socket_close closesocket
+#define socket_error() WSAGetLastError()
+#define SOCKET_WOULD_BLOCK(err) ((err) == WSAEWOULDBLOCK)
+#endif
+
+// A scraper that hangs up early must not kill the process
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL (0)
+#endif
+
+static Metric metrics_scrapes_total = METRIC_COUNTER_INIT(
+    "muse_metrics_scrapes_total", "Requests served by the metrics endpoint");
+
+static bool socket_set_nonblocking(curl_socket_t fd) {
+#ifndef _WIN32
+    int flags = fcntl(fd, F_GETFL, 0);
+    return flags != -1 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) != -1;
+#else
+    u_long mode = 1;
+    return ioctlsocket(fd, FIONBIO, &mode) == 0;
+#endif
+}
+
+static void client_close(MetricsClient *client) {
+    transport_unwatch_socket(client->server->ts, client->watch);
+    socket_close(client->fd);
+    metrics_output_free(&client->response);
+    client->watch = NULL;
+    client->in_use = false;
+}
+
+static void client_respond(MetricsClient *client, const char *status,
+                           const char *content_type, const uint8_t *body,
+                           size_t body_length) {
+    char headers[256];
+    int n = snprintf(headers, sizeof(headers),
+                     "HTTP/1.1 %s\r\n"
+                     "Content-Type: %s\r\n"
+                     "Content-Length: %zu\r\n"
+                     "Connection: close\r\n"
+                     "\r\n",
+                     status, content_type, body_length);
+
+    buffer_append(&client->response, headers, (size_t)n);
+    if (body_length > 0)
+        buffer_append(&client->response, body, body_length);
+    client->sent = 0;
+    transport_watch_interest(client->server->ts, client->watch,
+                             TRANSPORT_SOCKET_WRITABLE);
+}
+
+static void client_handle_request(MetricsClient *client) {
+    static const char not_found[] = "Not Found\n";
+    static const char not_allowed[] = "Method Not Allowed\n";
+    char *line_end = strstr(client->request, "\r\n");
+    char *method = client->request;
+    char *path = strchr(method, ' ');
+
+    if (!path || path > line_end) {
+        client_respond(client, "400 Bad Request", "text/plain", NULL, 0);
+        return;
+    }
+    *path++ = '\0';
+    size_t path_length = strcspn(path, " ?\r");
+
+    if (path_length != strlen("/metrics") ||
+        strncmp(path, "/metrics", path_length) != 0) {
+        client_respond(client, "404 Not Found", "text/plain",
+                       (const uint8_t *)not_found, sizeof(not_found) - 1);
+        return;
+    }
+    if (strcmp(method, "GET") != 0) {
+        client_respond(client, "405 Method Not Allowed", "text/plain",
+                       (const uint8_t *)not_allowed, sizeof(not_allowed) - 1);
+        return;
+    }
+
+    MetricsOutput body = {0};
+    metric_add(&metrics_scrapes_total, 1);
+    metrics_render(&body);
+    // https://prometheus.io/docs/instrumenting/exposition_formats/
+    client_respond(client, "200 OK", "text/plain; version=0.0.4", body.data,
+                   body.length);
+    metrics_output_free(&body);
+}
+
+static void client_read(MetricsClient *client) {
+    for (;;) {
+        size_t space = sizeof(client->request) - 1 - client->request_length;
+        if (space == 0) {
+            client_respond(client, "431 Request Header Fields Too Large",
+                           "text/plain", NULL, 0);
+            return;
+        }
+
+        int n = (int)recv(client->fd, client->request + client->request_length,
+                          space, 0);
+        if (n <= 0) {
+            if (n < 0 && SOCKET_WOULD_BLOCK(socket_error()))
+                return;
+            client_close(client);
+            return;
+        }
+
+        client->request_length += (size_t)n;
+        client->request[client->request_length] = '\0';
+        if (strstr(client->request, "\r\n\r\n")) {
+            client_handle_request(client);
+            return;
+        }
+    }
+}
+
+static void client_write(MetricsClient *client) {
+    while (client->sent < client->response.length) {
+        int n = (int)send(client->fd,
+                          (const char *)client->response.data + client->sent,
+                          client->response.length - client->sent,
+                          MSG_NOSIGNAL);
+        if (n < 0) {
+            if (SOCKET_WOULD_BLOCK(socket_error()))
+                return;
+            break;
+        }
+        client->sent += (size_t)n;
+    }
+    client_close(client);
+}
+
+static void client_on_ready(void *user_data, int32_t ready) {
+    MetricsClient *client = (MetricsClient *)user_data;
+
+    if (client->response.length > 0) {
+        if (ready & TRANSPORT_SOCKET_WRITABLE)
+            client_write(client);
+        else
+            client_close(client);
+    } else if (ready & TRANSPORT_SOCKET_READABLE) {
+        client_read(client);
+    }
+}
+
+static void server_on_ready(void *user_data, int32_t ready) {
+    MetricsServer *server = (MetricsServer *)user_data;
+    (void)ready;
+
+    for (;;) {
+        curl_socket_t fd = accept(server->listen_fd, NULL, NULL);
+        if (fd == CURL_SOCKET_BAD)
+            return;
+
+        MetricsClient *client = NULL;
+        for (int32_t i = 0; i < METRICS_SERVER_MAX_CLIENTS; i++) {
+            if (!server->clients[i].in_use) {
+                client = &server->clients[i];
+                break;
+            }
+        }
+        if (!client || !socket_set_nonblocking(fd)) {
+            log_warn(LOG_MAIN, "Metrics: dropping a scrape connection");
+            socket_close(fd);
+            continue;
+        }
+
+        memset(client, 0, sizeof(*client));
+        client->server = server;
+        client->fd = fd;
+        client->watch = transport_watch_socket(
+            server->ts, fd, TRANSPORT_SOCKET_READABLE, client_on_ready, client);
+        if (!client->watch) {
+            socket_close(fd);
+            continue;
+        }
+        client->in_use = true;
+    }
+}
+
+bool metrics_server_start(MetricsServer *server, MuseTransport *ts,
+                          const char *host, uint16_t port) {
+    struct sockaddr_in addr = {0};
+    int reuse = 1;
+
+    memset(server, 0, sizeof(*server));
+    server->ts = ts;
+    server->listen_fd = CURL_SOCKET_BAD;
+
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+        log_error(LOG_MAIN, "Metrics: invalid listen address %s", host);
+        goto fail;
+    }
+
+    server->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (server->listen_fd == CURL_SOCKET_BAD) {
+        log_error(LOG_MAIN, "Metrics: failed to create socket: %s",
+                  strerror(errno));
+        goto fail;
+    }
+    setsockopt(server->listen_fd, SOL_SOCKET, SO_REUSEADDR,
+               (const char *)&reuse, sizeof(reuse));
+
+    if (bind(server->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(server->listen_fd, METRICS_SERVER_MAX_CLIENTS) != 0 ||
+        !socket_set_nonblocking(server->listen_fd)) {
+        log_error(LOG_MAIN, "Metrics: failed to listen on %s:%u: %s", host,
+                  (unsigned)port, strerror(errno));
+        goto fail;
+    }
+
+    server->listen_watch =
+        transport_watch_socket(ts, server->listen_fd,
+                               TRANSPORT_SOCKET_READABLE, server_on_ready,
+                               server);
+    if (!server->listen_watch)
+        goto fail;
+
+    metrics_register(&metrics_scrapes_total);
+    log_info(LOG_MAIN, "Metrics: serving http://%s:%u/metrics", host,
+             (unsigned)port);
+    return true;
+
+fail:
+    if (server->listen_fd != CURL_SOCKET_BAD) {
+        socket_close(server->listen_fd);
+        server->listen_fd = CURL_SOCKET_BAD;
+    }
+    return false;
+}
+
+void metrics_server_stop(MetricsServer *server) {
+    for (int32_t i = 0; i < METRICS_SERVER_MAX_CLIENTS; i++) {
+        if (server->clients[i].in_use)
+            client_close(&server->clients[i]);
+    }
+    if (server->listen_fd != CURL_SOCKET_BAD) {
+        transport_unwatch_socket(server->ts, server->listen_watch);
+        socket_close(server->listen_fd);
+        server->listen_watch = NULL;
+        server->listen_fd = CURL_SOCKET_BAD;
+    }
+}
@@ -0,0 +1,45 @@
+#ifndef METRICS_SERVER_H
+#define METRICS_SERVER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "metrics.h"
+#include "transport.h"
+
+#define METRICS_SERVER_MAX_CLIENTS (8)
+#define METRICS_SERVER_MAX_REQUEST (2048)
+
+typedef struct MetricsServer MetricsServer;
+
+typedef struct {
+    MetricsServer *server;
+    curl_socket_t fd;
+    SocketContext *watch;
+    bool in_use;
+    // Read until the blank line ending the headers, the body is ignored
+    char request[METRICS_SERVER_MAX_REQUEST];
+    size_t request_length;
+    // Headers and body, written out as the socket accepts them
+    MetricsOutput response;
+    size_t sent;
+} MetricsClient;
+
+// Serves GET /metrics in the Prometheus text format from the event loop of
+// the transport it is started on. Meant for a local scraper, it answers one
+// request per connection and drops clients beyond
+// METRICS_SERVER_MAX_CLIENTS.
+typedef struct MetricsServer {
+    MuseTransport *ts;
+    curl_socket_t listen_fd;
+    SocketContext *listen_watch;
+    MetricsClient clients[METRICS_SERVER_MAX_CLIENTS];
+} MetricsServer;
+
+// host is a numeric IPv4 address
+bool metrics_server_start(MetricsServer *server, MuseTransport *ts,
+                          const char *host, uint16_t port);
+// Before the transport is destroyed
+void metrics_server_stop(MetricsServer *server);
+
+#endif // METRICS_SERVER_H
@@ -7,13 +7,26 @@
 
 #include <cjson/cJSON.h>
 
+#include "admission.h"
+#include "alloc.h"
 #include "bot.h"
+#include "clock.h"
 #include "discord.h"
+#include "hash.h"
 #include "links.h"
+#include "log.h"
+#include "metrics_server.h"
+#include "recording.h"
+#include "stall.h"
+#include "trace.h"
 #include "transport.h"
 
 #define USER_AGENT ("Muse (https://github.com/DaCurse/muse, 1.0)")
 #define GATEWAY_URL ("wss://gateway.discord.gg/?v=10&encoding=json")
+#define METRICS_DEFAULT_HOST ("127.0.0.1")
+// A replay ends once it stayed idle this long, a frame's lookups and replies
+// pass through queues the replay can't see
+#define REPLAY_SETTLE_MS (500)
 
 /**
  * GUILDS, GUILD_MESSAGES, MESSAGE_CONTENT
@@ -21,104 +34,424 @@
  */
 const uint32_t DISCORD_BOT_INTENTS = (1 << 0) | (1 << 9) | (1 << 15);
 
-void on_connect(MuseTransport *ts) {
-    MuseBot *bot = (MuseBot *)ts->user_data;
-    bot->is_connected = true;
-    printf("WebSocket connected!\n");
-}
-
-void on_disconnect(MuseTransport *ts) {
-    MuseBot *bot = (MuseBot *)ts->user_data;
-    bot->is_connected = false;
-    printf("WebSocket disconnected.\n");
-}
+// Shared by every worker
+static LinkCache link_cache;
+static AdmissionControl admission;
 
 typedef struct {
-    MuseBot *bot;
+    MuseWorker *worker;
     char *channel_id;
+    char *music_url;
+    // Parsed on a pipeline thread, then replied with on the HTTP loop
+    MusicLinks links;
+    TraceContext trace;
 } MusicLinkContext;
 
-void on_music_link_fetched(HTTPResponse *res, void *user_data) {
-    MusicLinkContext *ctx = (MusicLinkContext *)user_data;
-    MuseBot *bot = ctx->bot;
-    const char *channel_id = ctx->channel_id;
-
-    if (res->result != CURLE_OK) {
-        fprintf(stderr, "Failed to fetch music links: %s\n",
-                curl_easy_strerror(res->result));
-        return;
-    }
-
-    cJSON *json = cJSON_ParseWithLength((const char *)res->data, res->length);
-    if (!json) {
-        const char *error_ptr = cJSON_GetErrorPtr();
-        if (error_ptr) {
-            fprintf(stderr, "Failed to parse music links JSON: %s\n",
-                    error_ptr);
-        }
-        return;
-    }
+// A Songlink response body waiting for a pipeline thread
+typedef struct {
+    MusicLinkContext *ctx;
+    uint64_t submitted_us;
+    size_t length;
+    uint8_t data[];
+} SonglinkJob;
+
+// Set when PIPELINE_THREADS starts pipeline threads
+static bool use_pipeline;
+static PipelineStage songlink_stage =
+    PIPELINE_STAGE_INIT("muse_pipeline_songlink", "Songlink response");
+static PipelineStage reply_stage =
+    PIPELINE_STAGE_INIT("muse_pipeline_reply", "reply serialization");
+
+// Channels with a pending coalesced reply, per worker
+#define REPLY_BATCH_SLOTS (64)
+// Snowflakes are at most 20 digits
+#define REPLY_CHANNEL_ID_SIZE (32)
+
+// Results for one channel waiting to go out as a single message
+typedef struct {
+    char channel_id[REPLY_CHANNEL_ID_SIZE];
+    MusicLinks links[MAX_MESSAGE_EMBEDS];
+    TraceContext traces[MAX_MESSAGE_EMBEDS];
+    int32_t count;
+    uint64_t first_ms;
+    uint64_t flush_ms;
+} ReplyBatch;
 
-    MusicLinks links = {0};
-    parse_music_links_response(json, &links);
-    cJSON_Delete(json);
+typedef struct {
+    ReplyBatch batches[REPLY_BATCH_SLOTS];
+    int32_t batch_count;
+} ReplyCoalescer;
+
+// 0 disables coalescing. Every result extends its channel's window by
+// reply_window_ms, but no result waits longer than reply_max_delay_ms.
+static int64_t reply_window_ms;
+static int64_t reply_max_delay_ms;
+// Indexed by worker, only touched on the worker's HTTP loop
+static ReplyCoalescer reply_coalescers[MAX_WORKERS];
+
+// A reply's results waiting for a pipeline thread to serialize them
+typedef struct {
+    MuseWorker *worker;
+    char channel_id[REPLY_CHANNEL_ID_SIZE];
+    MusicLinks links[MAX_MESSAGE_EMBEDS];
+    TraceContext traces[MAX_MESSAGE_EMBEDS];
+    int32_t count;
+    uint64_t submitted_us;
+} ReplyJob;
+
+// Jobs for one channel share a pipeline thread, which keeps them in order
+static uint64_t channel_key(const char *channel_id) {
+    return hash_fnv1a(FNV_OFFSET_BASIS, channel_id, strlen(channel_id));
+}
 
-    DiscordEmbedField fields[3] = {0};
-    int field_count = 0;
+static void music_links_embed(const MusicLinks *links, DiscordEmbed *embed,
+                              DiscordEmbedField *fields) {
+    size_t field_count = 0;
 
-    if (links.spotify_url) {
+    if (links->spotify_url) {
         fields[field_count].name = "Spotify";
-        fields[field_count].value = links.spotify_url;
+        fields[field_count].value = links->spotify_url;
         fields[field_count].inline_field = false;
         field_count++;
     }
-    if (links.youtube_url) {
+    if (links->youtube_url) {
         fields[field_count].name = "YouTube";
-        fields[field_count].value = links.youtube_url;
+        fields[field_count].value = links->youtube_url;
         fields[field_count].inline_field = false;
         field_count++;
     }
-    if (links.apple_music_url) {
+    if (links->apple_music_url) {
         fields[field_count].name = "Apple Music";
-        fields[field_count].value = links.apple_music_url;
+        fields[field_count].value = links->apple_music_url;
         fields[field_count].inline_field = false;
         field_count++;
     }
 
     DiscordEmbedImage thumbnail = {0};
-    if (links.thumbnail_url) {
-        thumbnail.url = links.thumbnail_url;
+    if (links->thumbnail_url) {
+        thumbnail.url = links->thumbnail_url;
     }
 
-    DiscordEmbed embed = {
+    *embed = (DiscordEmbed){
         .title = "Music Links",
         .type = "rich",
         .description = "Here are the available music links:",
         .color = 0x35556e,
         .thumbnail = thumbnail,
-        .image = NULL,
-        .fields = {{0}},
+        .fields = fields,
+        .field_count = field_count,
     };
+}
 
-    for (int i = 0; i < field_count; ++i) {
-        embed.fields[i] = fields[i];
+// One message with an embed per result, count <= MAX_MESSAGE_EMBEDS.
+// Serialized into writer and handed to the worker's HTTP loop, or with a
+// NULL writer queued directly from the HTTP loop.
+static void serialize_music_links(MuseWorker *worker, JSONWriter *writer,
+                                  const char *channel_id,
+                                  const MusicLinks *links,
+                                  const TraceContext *traces, int32_t count) {
+    DiscordEmbedField fields[MAX_MESSAGE_EMBEDS][3] = {0};
+    DiscordEmbed embeds[MAX_MESSAGE_EMBEDS];
+
+    for (int32_t i = 0; i < count; i++) {
+        music_links_embed(&links[i], &embeds[i], fields[i]);
     }
 
     DiscordCreateMessage message = {
         .content = "",
         .nonce = (int32_t)time(NULL),
-        .embeds = {embed},
+        .embeds = embeds,
+        .embed_count = (size_t)count,
     };
 
-    bot_rest_send_message(bot, channel_id, &message);
+    if (writer) {
+        bot_rest_post_message(worker, writer, channel_id, &message, traces,
+                              count);
+    } else {
+        bot_rest_send_message(worker, channel_id, &message, traces, count);
+    }
+}
+
+static void reply_job_task(void *context, void *arg) {
+    PipelineThread *thread = (PipelineThread *)context;
+    ReplyJob *job = (ReplyJob *)arg;
+    uint64_t started_us = pipeline_stage_begin(&reply_stage, job->submitted_us);
+
+    serialize_music_links(job->worker, &thread->writer, job->channel_id,
+                          job->links, job->traces, job->count);
+    for (int32_t i = 0; i < job->count; i++) {
+        music_links_free(&job->links[i]);
+    }
+    alloc_free(job);
+
+    pipeline_stage_end(&reply_stage, started_us);
+}
+
+// Takes ownership of links, count <= MAX_MESSAGE_EMBEDS
+static void send_music_links(MuseWorker *worker, const char *channel_id,
+                             MusicLinks *links, const TraceContext *traces,
+                             int32_t count) {
+    size_t channel_id_length = strlen(channel_id);
+
+    if (use_pipeline && channel_id_length < REPLY_CHANNEL_ID_SIZE) {
+        ReplyJob *job = alloc_malloc(ALLOC_REST, sizeof(*job));
+        if (!job) {
+            fprintf(stderr, "error: out of memory");
+            exit(1);
+        }
+        job->worker = worker;
+        memcpy(job->channel_id, channel_id, channel_id_length + 1);
+        memcpy(job->links, links, (size_t)count * sizeof(*links));
+        memcpy(job->traces, traces, (size_t)count * sizeof(*traces));
+        job->count = count;
+        job->submitted_us = clock_now_us();
+
+        if (bot_pipeline_submit(worker, channel_key(channel_id),
+                                reply_job_task, job))
+            return;
+        alloc_free(job);
+    }
+
+    serialize_music_links(worker, NULL, channel_id, links, traces, count);
+    for (int32_t i = 0; i < count; i++) {
+        music_links_free(&links[i]);
+    }
+}
+
+static void reply_batch_flush(MuseWorker *worker, ReplyCoalescer *coalescer,
+                              int32_t index) {
+    ReplyBatch *batch = &coalescer->batches[index];
+
+    log_debug(LOG_LINKS, "Sending %d coalesced result(s) to channel %s",
+              batch->count, batch->channel_id);
+    send_music_links(worker, batch->channel_id, batch->links, batch->traces,
+                     batch->count);
+
+    *batch = coalescer->batches[--coalescer->batch_count];
+}
+
+// Takes ownership of links, which are sent now or within the window
+static void reply_music_links(MuseWorker *worker, const char *channel_id,
+                              MusicLinks *links, const TraceContext *trace) {
+    ReplyCoalescer *coalescer = &reply_coalescers[worker->index];
+    size_t channel_id_length = strlen(channel_id);
+    ReplyBatch *batch = NULL;
+
+    if (reply_window_ms <= 0 || channel_id_length >= REPLY_CHANNEL_ID_SIZE)
+        goto send_now;
+
+    int32_t index;
+    for (index = 0; index < coalescer->batch_count; index++) {
+        if (strcmp(coalescer->batches[index].channel_id, channel_id) == 0) {
+            batch = &coalescer->batches[index];
+            break;
+        }
+    }
+
+    uint64_t now = clock_now_ms();
+    if (!batch) {
+        if (coalescer->batch_count == REPLY_BATCH_SLOTS)
+            goto send_now;
+        index = coalescer->batch_count++;
+        batch = &coalescer->batches[index];
+        memcpy(batch->channel_id, channel_id, channel_id_length + 1);
+        batch->count = 0;
+        batch->first_ms = now;
+    }
+
+    batch->links[batch->count] = *links;
+    batch->traces[batch->count] = *trace;
+    batch->count++;
+    batch->flush_ms = now + (uint64_t)reply_window_ms;
+    if (batch->flush_ms > batch->first_ms + (uint64_t)reply_max_delay_ms)
+        batch->flush_ms = batch->first_ms + (uint64_t)reply_max_delay_ms;
+
+    if (batch->count == MAX_MESSAGE_EMBEDS)
+        reply_batch_flush(worker, coalescer, index);
+    return;
+
+send_now:
+    send_music_links(worker, channel_id, links, trace, 1);
+}
+
+// A reply holds the lookup slots of the messages it answers until it is
+// posted or dropped, so a backed up REST queue sheds new links at admission
+static void on_reply_done(MuseWorker *worker, int32_t trace_count) {
+    (void)worker;
+    for (int32_t i = 0; i < trace_count; i++) {
+        admission_release_lookup(&admission);
+    }
+}
+
+static int64_t on_worker_tick(MuseWorker *worker, uint64_t now_ms) {
+    ReplyCoalescer *coalescer = &reply_coalescers[worker->index];
+    int64_t wait_ms = POLL_TIMEOUT_MS;
+
+    for (int32_t i = 0; i < coalescer->batch_count;) {
+        ReplyBatch *batch = &coalescer->batches[i];
+        if (now_ms >= batch->flush_ms) {
+            // The last batch moved into slot i
+            reply_batch_flush(worker, coalescer, i);
+            continue;
+        }
+        if ((int64_t)(batch->flush_ms - now_ms) < wait_ms)
+            wait_ms = (int64_t)(batch->flush_ms - now_ms);
+        i++;
+    }
+
+    return wait_ms;
+}
+
+static void reply_coalescers_destroy(void) {
+    for (int32_t w = 0; w < MAX_WORKERS; w++) {
+        ReplyCoalescer *coalescer = &reply_coalescers[w];
+        for (int32_t i = 0; i < coalescer->batch_count; i++) {
+            for (int32_t j = 0; j < coalescer->batches[i].count; j++) {
+                music_links_free(&coalescer->batches[i].links[j]);
+                admission_release_lookup(&admission);
+            }
+        }
+        coalescer->batch_count = 0;
+    }
+}
+
+// For contexts whose reply went out, which now holds the lookup slot
+static void music_link_context_dispose(MusicLinkContext *ctx) {
+    alloc_free(ctx->channel_id);
+    alloc_free(ctx->music_url);
+    alloc_free(ctx);
+}
+
+static void music_link_context_free(MusicLinkContext *ctx) {
+    admission_release_lookup(&admission);
+    music_link_context_dispose(ctx);
+}
+
+static bool music_links_parse_body(const uint8_t *data, size_t length,
+                                   MusicLinks *out_links) {
+    AllocTag previous_tag = alloc_scope_enter(ALLOC_LINKS);
+    cJSON *json = cJSON_ParseWithLength((const char *)data, length);
+    if (!json) {
+        const char *error_ptr = cJSON_GetErrorPtr();
+        if (error_ptr) {
+            log_error(LOG_LINKS, "Failed to parse music links JSON: %s",
+                      error_ptr);
+        }
+        alloc_scope_exit(previous_tag);
+        return false;
+    }
+
+    parse_music_links_response(json, out_links);
+    cJSON_Delete(json);
+    alloc_scope_exit(previous_tag);
+    return true;
+}
+
+// Runs on the HTTP loop with the links a pipeline thread parsed
+static void deliver_music_links(void *context, void *arg) {
+    MuseWorker *worker = (MuseWorker *)context;
+    MusicLinkContext *ctx = (MusicLinkContext *)arg;
+
+    reply_music_links(worker, ctx->channel_id, &ctx->links, &ctx->trace);
+    music_link_context_dispose(ctx);
+}
+
+static void songlink_job_task(void *context, void *arg) {
+    SonglinkJob *job = (SonglinkJob *)arg;
+    MusicLinkContext *ctx = job->ctx;
+    uint64_t started_us =
+        pipeline_stage_begin(&songlink_stage, job->submitted_us);
+    (void)context;
+
+    if (!music_links_parse_body(job->data, job->length, &ctx->links)) {
+        music_link_context_free(ctx);
+        goto done;
+    }
+    trace_mark(&ctx->trace, TRACE_PARSED);
+
+    link_cache_put(&link_cache, ctx->music_url, &ctx->links);
+    if (!bot_post_http_task(ctx->worker, deliver_music_links, ctx)) {
+        log_warn(LOG_LINKS, "HTTP loop %d is saturated, dropping reply",
+                 ctx->worker->index);
+        music_links_free(&ctx->links);
+        music_link_context_free(ctx);
+    }
+
+done:
+    alloc_free(job);
+    pipeline_stage_end(&songlink_stage, started_us);
+}
+
+void on_music_link_fetched(HTTPResponse *res, void *user_data) {
+    MusicLinkContext *ctx = (MusicLinkContext *)user_data;
+
+    trace_mark(&ctx->trace, TRACE_FETCHED);
+    if (res->result != CURLE_OK) {
+        log_error(LOG_LINKS, "Failed to fetch music links: %s",
+                  curl_easy_strerror(res->result));
+        music_link_context_free(ctx);
+        return;
+    }
+    // Error bodies (429s, 5xx) parse as JSON too, they must not be cached
+    if (res->status < 200 || res->status >= 300) {
+        log_error(LOG_LINKS, "Songlink lookup failed with status %lld",
+                  (long long)res->status);
+        music_link_context_free(ctx);
+        return;
+    }
+
+    if (use_pipeline) {
+        SonglinkJob *job =
+            alloc_malloc(ALLOC_LINKS, sizeof(*job) + res->length);
+        if (!job) {
+            fprintf(stderr, "error: out of memory");
+            exit(1);
+        }
+        job->ctx = ctx;
+        job->submitted_us = clock_now_us();
+        job->length = res->length;
+        memcpy(job->data, res->data, res->length);
+
+        if (bot_pipeline_submit(ctx->worker, channel_key(ctx->channel_id),
+                                songlink_job_task, job))
+            return;
+        alloc_free(job);
+    }
+
+    MusicLinks links = {0};
+    if (!music_links_parse_body(res->data, res->length, &links)) {
+        music_link_context_free(ctx);
+        return;
+    }
+    trace_mark(&ctx->trace, TRACE_PARSED);
+
+    link_cache_put(&link_cache, ctx->music_url, &links);
+    reply_music_links(ctx->worker, ctx->channel_id, &links, &ctx->trace);
+
+    music_link_context_dispose(ctx);
+}
+
+// Runs on the HTTP loop, takes ownership of the context
+static void resolve_music_link(void *context, void *arg) {
+    MuseWorker *worker = (MuseWorker *)context;
+    MusicLinkContext *ctx = (MusicLinkContext *)arg;
+    MusicLinks links = {0};
+
+    if (link_cache_get(&link_cache, ctx->music_url, &links)) {
+        trace_mark(&ctx->trace, TRACE_FETCHED);
+        trace_mark(&ctx->trace, TRACE_PARSED);
+        reply_music_links(worker, ctx->channel_id, &links, &ctx->trace);
+        music_link_context_dispose(ctx);
+        return;
+    }
 
-    music_links_free(&links);
-    free(ctx->channel_id);
-    free(ctx);
+    fetch_music_links(&worker->http_ts, ctx->music_url, on_music_link_fetched,
+                      ctx);
 }
 
-void on_bot_message_create(MuseBot *bot, const char *event_name,
+void on_bot_message_create(MuseShard *shard, const char *event_name,
                            const cJSON *data_json) {
+    MuseBot *bot = shard->bot;
     (void)event_name;
 
     const cJSON *author_json =
@@ -130,7 +463,8 @@ void on_bot_message_create(MuseBot *bot, const char *event_name,
         return;
 
     const char *author_id = author_id_json->valuestring;
-    if (strcmp(author_id, bot->user_id) == 0) {
+    const char *user_id = bot_user_id(bot);
+    if (user_id && strcmp(author_id, user_id) == 0) {
         return;
     }
 
@@ -138,6 +472,8 @@ void on_bot_message_create(MuseBot *bot, const char *event_name,
         cJSON_GetObjectItemCaseSensitive(data_json, "content");
     const cJSON *channel_id_json =
         cJSON_GetObjectItemCaseSensitive(data_json, "channel_id");
+    const cJSON *message_id_json =
+        cJSON_GetObjectItemCaseSensitive(data_json, "id");
 
     if (!cJSON_IsString(content_json) || !cJSON_IsString(channel_id_json))
         return;
@@ -145,39 +481,85 @@ void on_bot_message_create(MuseBot *bot, const char *event_name,
     const char *content = content_json->valuestring;
     const char *channel_id = channel_id_json->valuestring;
 
-    char *music_url = NULL;
-    if (is_music_link(content, &music_url)) {
-        printf("Detected music link '%s' in channel %s by user %s\n", music_url,
-               channel_id, author_id_json->valuestring);
-        MusicLinkContext *ctx =
-            (MusicLinkContext *)malloc(sizeof(MusicLinkContext));
-        ctx->bot = bot;
-        ctx->channel_id = strdup(channel_id);
-        fetch_music_links(bot->ts, music_url, on_music_link_fetched, ctx);
-        free(music_url);
+    const char *match;
+    size_t match_length;
+    if (!find_music_link(content, &match, &match_length))
+        return;
+
+    // Shed before copying anything out of the event
+    AdmissionResult admitted =
+        admission_check_message(&admission, channel_id, author_id);
+    if (admitted == ADMISSION_ACCEPT)
+        admitted = admission_acquire_lookup(&admission);
+    if (admitted != ADMISSION_ACCEPT) {
+        log_debug(LOG_LINKS, "Shed music link in channel %s by user %s (%d)",
+                  channel_id, author_id, admitted);
+        return;
+    }
+
+    MusicLinkContext *ctx = (MusicLinkContext *)alloc_malloc(
+        ALLOC_LINKS, sizeof(MusicLinkContext));
+    ctx->worker = shard->worker;
+    ctx->channel_id = alloc_strdup(ALLOC_LINKS, channel_id);
+    ctx->music_url = music_link_dup(match, match_length);
+    ctx->links = (MusicLinks){0};
+    trace_start(&ctx->trace,
+                cJSON_IsString(message_id_json) ? message_id_json->valuestring
+                                                : NULL,
+                bot_dispatch_received_us());
+    trace_mark(&ctx->trace, TRACE_MATCHED);
+    log_debug(LOG_LINKS, "Detected music link '%s' in channel %s by user %s",
+              ctx->music_url, channel_id, author_id);
+
+    // The lookup and the reply run on the HTTP loop, off the gateway's
+    if (!bot_post_http_task(shard->worker, resolve_music_link, ctx)) {
+        log_warn(LOG_LINKS, "HTTP loop %d is saturated, dropping music link",
+                 shard->worker->index);
+        music_link_context_free(ctx);
     }
 }
 
-void on_message(MuseTransport *ts, const uint8_t *data, size_t length) {
-    MuseBot *bot = (MuseBot *)ts->user_data;
+// 0 if the variable is unset
+static int32_t getenv_int(const char *name) {
+    const char *value = getenv(name);
+    return value != NULL ? atoi(value) : 0;
+}
 
-    GatewayEventPayload payload = {0};
-    if (!gateway_event_parse((uint8_t *)data, length, &payload)) {
-        fprintf(stderr, "Failed to parse gateway event payload\n");
-        return;
+// Parses a comma separated CPU list such as "0,2,4,6"
+static int32_t parse_cpu_list(const char *list, int32_t *out_cpus) {
+    int32_t count = 0;
+
+    while (list && *list && count < MAX_WORKERS) {
+        char *end;
+        long cpu = strtol(list, &end, 10);
+        if (end == list)
+            break;
+        out_cpus[count++] = (int32_t)cpu;
+        list = *end == ',' ? end + 1 : end;
     }
 
-    bot_handle_gateway_event(bot, &payload);
-
-    gateway_event_cleanup(&payload);
+    return count;
 }
 
 static volatile sig_atomic_t keep_running = 1;
 
+// Tracks how long the replay has been idle in idle_since_ms, 0 while busy
+static bool replay_settled(MuseBot *bot, uint64_t *idle_since_ms) {
+    uint64_t now = clock_now_ms();
+
+    if (!replay_idle() || !bot_is_idle(bot)) {
+        *idle_since_ms = 0;
+        return false;
+    }
+    if (*idle_since_ms == 0)
+        *idle_since_ms = now;
+    return now - *idle_since_ms >= REPLAY_SETTLE_MS;
+}
+
 void handle_signal(int sig) {
     (void)sig;
+    // Logging isn't async-signal-safe, main reports the shutdown
     keep_running = 0;
-    printf("\nSignal received. Shutting down gracefully...\n");
 }
 
 int main() {
@@ -185,33 +567,162 @@ int main() {
     signal(SIGTERM, handle_signal);
 
     if (getenv("TOKEN") == NULL) {
-        fprintf(stderr, "Error: TOKEN environment variable not set.\n");
+        log_error(LOG_MAIN, "Error: TOKEN environment variable not set.");
         return 1;
     }
 
+    if (getenv("LOG_LEVEL") != NULL) {
+        log_configure(getenv("LOG_LEVEL"));
+    }
+    log_init();
+    alloc_init();
+
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+    // Replaying and recording the same run would only copy the recording
+    bool replaying = false;
+    // Simulated runs replay the recording's timing on a virtual clock, only
+    // a replay is fully driven by it since curl's own timers are real
+    bool simulating = getenv("SIMULATE") != NULL;
+    if (simulating && getenv("REPLAY_FILE") == NULL) {
+        log_error(LOG_MAIN, "Error: SIMULATE requires REPLAY_FILE.");
+        return 1;
+    }
+    if (simulating) {
+        clock_virtual_enable(clock_real_now_us());
+    }
+    if (getenv("REPLAY_FILE") != NULL) {
+        replaying = replay_load(getenv("REPLAY_FILE"),
+                                simulating ||
+                                    getenv("REPLAY_REAL_TIME") != NULL);
+        if (!replaying)
+            return 1;
+    } else if (getenv("RECORD_FILE") != NULL) {
+        if (!recording_start(getenv("RECORD_FILE")))
+            return 1;
+    }
+    link_cache_init(&link_cache, LINK_CACHE_TTL_MS);
+    admission_init(&admission);
+    // Unset knobs read as 0, which keeps the default
+    admission_set_limits(&admission, getenv_int("ADMISSION_CHANNEL_PER_MINUTE"),
+                         getenv_int("ADMISSION_AUTHOR_PER_MINUTE"),
+                         getenv_int("ADMISSION_MAX_PENDING_LOOKUPS"));
+
     MuseTransport ts = {0};
     MuseBot bot = {0};
-    BotEventCallbacks callbacks = {
-        .on_ready = NULL,
-        .on_message_create = on_bot_message_create,
-    };
-    bot_init(&bot, &ts, getenv("TOKEN"), DISCORD_BOT_INTENTS, callbacks);
-    bot_set_gateway_url(&bot, GATEWAY_URL);
+    bot_init(&bot, &ts, getenv("TOKEN"), DISCORD_BOT_INTENTS);
+    bot_set_gateway_url(&bot, getenv("GATEWAY_URL") != NULL
+                                  ? getenv("GATEWAY_URL")
+                                  : GATEWAY_URL);
+    // Local stand-ins, see tools/loadtest.py
+    if (getenv("API_BASE_URL") != NULL) {
+        bot_set_api_base_url(&bot, getenv("API_BASE_URL"));
+    }
+    if (getenv("SONGLINK_API_URL") != NULL) {
+        links_set_api_url(getenv("SONGLINK_API_URL"));
+    }
+    if (getenv("SHARD_COUNT") != NULL) {
+        bot_set_shard_count(&bot, atoi(getenv("SHARD_COUNT")));
+    }
+    if (getenv("REST_GLOBAL_LIMIT") != NULL) {
+        bot_set_rest_global_limit(&bot, atoi(getenv("REST_GLOBAL_LIMIT")));
+    }
+    if (getenv("SESSION_FILE") != NULL) {
+        bot_set_session_file(&bot, getenv("SESSION_FILE"));
+    }
+    if (getenv("STALL_BUDGET_US") != NULL) {
+        stall_set_budget_us(strtoull(getenv("STALL_BUDGET_US"), NULL, 10));
+    }
+    if (getenv("TRACE_SAMPLE_EVERY") != NULL) {
+        trace_set_sample_every((uint32_t)atoi(getenv("TRACE_SAMPLE_EVERY")));
+    }
+    if (getenv("PIPELINE_THREADS") != NULL) {
+        int32_t pipeline_threads = atoi(getenv("PIPELINE_THREADS"));
+        bot_set_pipeline_threads(&bot, pipeline_threads);
+        use_pipeline = pipeline_threads > 0;
+    }
+    if (getenv("WORKER_COUNT") != NULL) {
+        int32_t cpus[MAX_WORKERS];
+        int32_t cpu_count = parse_cpu_list(getenv("WORKER_CPUS"), cpus);
+        bot_set_workers(&bot, atoi(getenv("WORKER_COUNT")), cpus, cpu_count);
+    }
+    bot_register_dispatch_handler(&bot, "MESSAGE_CREATE",
+                                  on_bot_message_create);
+    bot_set_rest_done_handler(&bot, on_reply_done);
+    if (getenv("REPLY_COALESCE_MS") != NULL) {
+        reply_window_ms = atoi(getenv("REPLY_COALESCE_MS"));
+        reply_max_delay_ms = reply_window_ms;
+        if (getenv("REPLY_COALESCE_MAX_MS") != NULL) {
+            reply_max_delay_ms = atoi(getenv("REPLY_COALESCE_MAX_MS"));
+        }
+        if (reply_max_delay_ms < reply_window_ms)
+            reply_max_delay_ms = reply_window_ms;
+        bot_set_worker_tick_handler(&bot, on_worker_tick);
+    }
 
-    WSCallbacks cbs = {
-        .on_connect = on_connect,
-        .on_disconnect = on_disconnect,
-        .on_message = on_message,
-    };
-    transport_init(&ts, USER_AGENT, cbs, &bot);
+    transport_init(&ts, USER_AGENT, &bot);
+    transport_set_ca_file(&ts, getenv("TLS_CA_FILE"));
+
+    // Served from the main loop, which polls ts in every worker mode
+    MetricsServer metrics_server;
+    bool metrics_serving = false;
+    if (getenv("METRICS_PORT") != NULL) {
+        const char *host = getenv("METRICS_HOST") != NULL
+                               ? getenv("METRICS_HOST")
+                               : METRICS_DEFAULT_HOST;
+        metrics_serving =
+            metrics_server_start(&metrics_server, &ts, host,
+                                 (uint16_t)atoi(getenv("METRICS_PORT")));
+    }
 
+    uint64_t started_ms = clock_now_ms();
+    uint64_t started_real_us = clock_real_now_us();
+    uint64_t replay_idle_since_ms = 0;
+    clock_virtual_join();
     while (keep_running && bot.is_running) {
         bot_tick(&bot);
+        if (replaying && replay_settled(&bot, &replay_idle_since_ms))
+            break;
+    }
+    clock_virtual_leave();
+    if (replaying) {
+        uint64_t ended_ms =
+            replay_idle_since_ms ? replay_idle_since_ms : clock_now_ms();
+        uint64_t elapsed_ms = ended_ms - started_ms;
+        uint64_t frames = replay_frames_delivered();
+        if (simulating) {
+            // The settle wait passed in virtual time, so real time needs no
+            // correction for it
+            uint64_t real_ms = (clock_real_now_us() - started_real_us) / 1000;
+            log_info(LOG_MAIN,
+                     "Simulated %llu frame(s) over %.1f s in %llu ms (%.0fx)",
+                     (unsigned long long)frames, (double)elapsed_ms / 1000,
+                     (unsigned long long)real_ms,
+                     real_ms > 0 ? (double)elapsed_ms / (double)real_ms : 0.0);
+        } else {
+            log_info(LOG_MAIN, "Replayed %llu frame(s) in %llu ms (%.0f/s)",
+                     (unsigned long long)frames,
+                     (unsigned long long)elapsed_ms,
+                     elapsed_ms > 0
+                         ? (double)frames * 1000 / (double)elapsed_ms
+                         : 0.0);
+        }
     }
 
-    printf("Exiting...\n");
+    if (!keep_running) {
+        log_info(LOG_MAIN, "Signal received. Shutting down gracefully...");
+    }
+    log_info(LOG_MAIN, "Exiting...");
     bot_destroy(&bot);
+    reply_coalescers_destroy();
+    if (metrics_serving)
+        metrics_server_stop(&metrics_server);
     transport_destroy(&ts);
+    link_cache_destroy(&link_cache);
+    admission_destroy(&admission);
+    recording_stop();
+    replay_unload();
+    curl_global_cleanup();
+    log_shutdown();
 
     return 0;
 }
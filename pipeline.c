@@ -0,0 +1,248 @@
+#include "pipeline.h"
+#include "clock.h"
+#include "log.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+static Metric pipeline_queue_depth = METRIC_GAUGE_INIT(
+    "muse_pipeline_queue_depth", "Jobs waiting for a pipeline thread");
+static Metric pipeline_rejected_total = METRIC_COUNTER_INIT(
+    "muse_pipeline_rejected_total",
+    "Jobs a full pipeline queue turned away");
+static Metric pipeline_backlog_depth = METRIC_GAUGE_INIT(
+    "muse_pipeline_backlog_depth",
+    "Jobs event loops hold back until their pipeline queue has room");
+
+static void *pipeline_thread_main(void *arg) {
+    PipelineThread *thread = (PipelineThread *)arg;
+    Pipeline *pipeline = thread->pipeline;
+    TaskFn fn;
+    void *task_arg;
+
+    for (;;) {
+        if (sem_wait(&thread->ready) != 0) {
+            if (errno == EINTR)
+                continue;
+            log_error(LOG_MAIN, "Pipeline thread %d: sem_wait failed",
+                      thread->index);
+            break;
+        }
+        if (!atomic_load(&pipeline->running))
+            break;
+        if (task_queue_pop(&thread->queue, &fn, &task_arg)) {
+            metric_add(&pipeline_queue_depth, -1);
+            fn(thread, task_arg);
+            clock_virtual_release();
+        }
+    }
+
+    return NULL;
+}
+
+void pipeline_init(Pipeline *pipeline, int32_t thread_count,
+                   size_t queue_size, void *user_data) {
+    pipeline->threads =
+        calloc((size_t)thread_count, sizeof(*pipeline->threads));
+    if (!pipeline->threads) {
+        fprintf(stderr, "error: out of memory");
+        exit(1);
+    }
+    pipeline->thread_count = thread_count;
+    pipeline->user_data = user_data;
+    metrics_register(&pipeline_queue_depth);
+    metrics_register(&pipeline_rejected_total);
+    metrics_register(&pipeline_backlog_depth);
+
+    atomic_store(&pipeline->running, true);
+    for (int32_t i = 0; i < thread_count; i++) {
+        PipelineThread *thread = &pipeline->threads[i];
+        thread->pipeline = pipeline;
+        thread->index = i;
+        task_queue_init(&thread->queue, queue_size);
+        sem_init(&thread->ready, 0, 0);
+
+        if (pthread_create(&thread->thread, NULL, pipeline_thread_main,
+                           thread) != 0) {
+            log_error(LOG_MAIN, "Failed to start pipeline thread %d", i);
+            continue;
+        }
+        thread->has_thread = true;
+    }
+}
+
+bool pipeline_submit(Pipeline *pipeline, uint64_t key, TaskFn fn, void *arg) {
+    if (pipeline->thread_count == 0)
+        return false;
+
+    PipelineThread *thread =
+        &pipeline->threads[key % (uint64_t)pipeline->thread_count];
+    // Virtual time waits for the job, which may still post a result
+    clock_virtual_hold();
+    // A thread that failed to start would never run it
+    if (!thread->has_thread || !task_queue_push(&thread->queue, fn, arg)) {
+        clock_virtual_release();
+        metric_add(&pipeline_rejected_total, 1);
+        return false;
+    }
+
+    metric_add(&pipeline_queue_depth, 1);
+    sem_post(&thread->ready);
+    return true;
+}
+
+static void backlog_append(Pipeline *pipeline, PipelineBacklog *backlog,
+                           int32_t index, TaskFn fn, void *arg) {
+    if (!backlog->heads) {
+        backlog->heads =
+            calloc((size_t)pipeline->thread_count, sizeof(*backlog->heads));
+        backlog->tails =
+            calloc((size_t)pipeline->thread_count, sizeof(*backlog->tails));
+    }
+    PipelineBacklogEntry *entry = malloc(sizeof(*entry));
+    if (!backlog->heads || !backlog->tails || !entry) {
+        fprintf(stderr, "error: out of memory");
+        exit(1);
+    }
+    entry->fn = fn;
+    entry->arg = arg;
+    entry->next = NULL;
+
+    if (backlog->tails[index]) {
+        backlog->tails[index]->next = entry;
+    } else {
+        backlog->heads[index] = entry;
+    }
+    backlog->tails[index] = entry;
+    atomic_fetch_add(&backlog->count, 1);
+    metric_add(&pipeline_backlog_depth, 1);
+}
+
+// Unlinks the thread's oldest entry and returns it
+static PipelineBacklogEntry *backlog_pop(PipelineBacklog *backlog,
+                                         int32_t index) {
+    PipelineBacklogEntry *entry = backlog->heads[index];
+    backlog->heads[index] = entry->next;
+    if (!entry->next)
+        backlog->tails[index] = NULL;
+    atomic_fetch_sub(&backlog->count, 1);
+    metric_add(&pipeline_backlog_depth, -1);
+    return entry;
+}
+
+bool pipeline_submit_ordered(Pipeline *pipeline, PipelineBacklog *backlog,
+                             uint64_t key, TaskFn fn, void *arg) {
+    if (pipeline->thread_count == 0)
+        return false;
+
+    int32_t index = (int32_t)(key % (uint64_t)pipeline->thread_count);
+    // Behind older jobs even once the thread is stopped, pipeline_backlog_run
+    // gets to them in order
+    if (backlog->heads && backlog->heads[index]) {
+        backlog_append(pipeline, backlog, index, fn, arg);
+        return true;
+    }
+    if (!pipeline->threads[index].has_thread)
+        return false;
+
+    if (!pipeline_submit(pipeline, key, fn, arg))
+        backlog_append(pipeline, backlog, index, fn, arg);
+    return true;
+}
+
+bool pipeline_backlog_flush(Pipeline *pipeline, PipelineBacklog *backlog) {
+    if (atomic_load(&backlog->count) == 0)
+        return true;
+
+    for (int32_t i = 0; i < pipeline->thread_count; i++) {
+        while (backlog->heads[i]) {
+            PipelineBacklogEntry *entry = backlog->heads[i];
+            if (!pipeline_submit(pipeline, (uint64_t)i, entry->fn, entry->arg))
+                break;
+            free(backlog_pop(backlog, i));
+        }
+    }
+    return atomic_load(&backlog->count) == 0;
+}
+
+int32_t pipeline_backlog_run(Pipeline *pipeline, PipelineBacklog *backlog) {
+    int32_t count = 0;
+
+    if (!backlog->heads)
+        return 0;
+
+    for (int32_t i = 0; i < pipeline->thread_count; i++) {
+        while (backlog->heads[i]) {
+            PipelineBacklogEntry *entry = backlog_pop(backlog, i);
+            entry->fn(&pipeline->threads[i], entry->arg);
+            free(entry);
+            count++;
+        }
+    }
+    return count;
+}
+
+void pipeline_backlog_destroy(PipelineBacklog *backlog) {
+    free(backlog->heads);
+    free(backlog->tails);
+    backlog->heads = NULL;
+    backlog->tails = NULL;
+}
+
+uint64_t pipeline_stage_begin(PipelineStage *stage, uint64_t submitted_us) {
+    uint64_t now = clock_now_us();
+    metric_observe(&stage->wait_us, (int64_t)(now - submitted_us));
+    return now;
+}
+
+void pipeline_stage_end(PipelineStage *stage, uint64_t started_us) {
+    metric_observe(&stage->run_us, (int64_t)(clock_now_us() - started_us));
+}
+
+void pipeline_stop(Pipeline *pipeline) {
+    if (!atomic_exchange(&pipeline->running, false))
+        return;
+
+    for (int32_t i = 0; i < pipeline->thread_count; i++) {
+        PipelineThread *thread = &pipeline->threads[i];
+        if (!thread->has_thread)
+            continue;
+        sem_post(&thread->ready);
+        pthread_join(thread->thread, NULL);
+        thread->has_thread = false;
+    }
+}
+
+int32_t pipeline_drain(Pipeline *pipeline) {
+    int32_t count = 0;
+    TaskFn fn;
+    void *arg;
+
+    for (int32_t i = 0; i < pipeline->thread_count; i++) {
+        PipelineThread *thread = &pipeline->threads[i];
+        while (task_queue_pop(&thread->queue, &fn, &arg)) {
+            metric_add(&pipeline_queue_depth, -1);
+            fn(thread, arg);
+            clock_virtual_release();
+            count++;
+        }
+    }
+
+    return count;
+}
+
+void pipeline_destroy(Pipeline *pipeline) {
+    pipeline_stop(pipeline);
+    pipeline_drain(pipeline);
+
+    for (int32_t i = 0; i < pipeline->thread_count; i++) {
+        PipelineThread *thread = &pipeline->threads[i];
+        task_queue_destroy(&thread->queue);
+        sem_destroy(&thread->ready);
+        json_writer_free(&thread->writer);
+    }
+    free(pipeline->threads);
+    pipeline->threads = NULL;
+    pipeline->thread_count = 0;
+}
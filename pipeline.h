@@ -0,0 +1,102 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "json_writer.h"
+#include "metrics.h"
+#include "task_queue.h"
+
+typedef struct Pipeline Pipeline;
+
+typedef struct {
+    Pipeline *pipeline;
+    int32_t index;
+    pthread_t thread;
+    bool has_thread;
+    // Pushed by the event loops, popped only by this thread
+    TaskQueue queue;
+    // Counts pushed tasks, the thread sleeps on it while its queue is empty
+    sem_t ready;
+    // Reused by tasks that serialize on this thread
+    JSONWriter writer;
+} PipelineThread;
+
+// Threads for the CPU-bound stages (parsing, serialization), so event loops
+// only move bytes. A task runs on thread key % thread_count, tasks submitted
+// with the same key run in submission order.
+typedef struct Pipeline {
+    PipelineThread *threads;
+    int32_t thread_count;
+    atomic_bool running;
+    void *user_data;
+} Pipeline;
+
+typedef struct PipelineBacklogEntry {
+    TaskFn fn;
+    void *arg;
+    struct PipelineBacklogEntry *next;
+} PipelineBacklogEntry;
+
+// Jobs one event loop submitted while their thread's queue was full, kept
+// per thread in submission order until the queue has room. Owned by that
+// loop, zero-initialized.
+typedef struct {
+    PipelineBacklogEntry **heads;
+    PipelineBacklogEntry **tails;
+    // Read by other threads to tell whether the loop is idle
+    atomic_int count;
+} PipelineBacklog;
+
+// Queue wait and run time of one kind of job
+typedef struct {
+    Metric wait_us;
+    Metric run_us;
+} PipelineStage;
+
+#define PIPELINE_STAGE_INIT(prefix, description)                               \
+    {METRIC_HISTOGRAM_INIT(prefix "_wait_us",                                  \
+                           "Microseconds " description                         \
+                           " jobs waited for a pipeline thread",               \
+                           METRICS_LATENCY_US_BOUNDS),                         \
+     METRIC_HISTOGRAM_INIT(prefix "_run_us",                                   \
+                           "Microseconds a pipeline thread spent on a "        \
+                           description " job",                                 \
+                           METRICS_LATENCY_US_BOUNDS)}
+
+// queue_size must be a power of two. Starts the threads.
+void pipeline_init(Pipeline *pipeline, int32_t thread_count,
+                   size_t queue_size, void *user_data);
+// fn receives the PipelineThread running it as its context. Returns false if
+// the thread's queue is full.
+bool pipeline_submit(Pipeline *pipeline, uint64_t key, TaskFn fn, void *arg);
+// pipeline_submit that never lets a job overtake the ones before it: a job
+// the queue can't take, or that has older jobs in backlog for its thread,
+// waits in backlog for pipeline_backlog_flush. Returns false only if the
+// thread isn't running, the caller then does the work itself.
+bool pipeline_submit_ordered(Pipeline *pipeline, PipelineBacklog *backlog,
+                             uint64_t key, TaskFn fn, void *arg);
+// Moves what fits of backlog onto the queues, in order. Call it from the
+// owning loop every tick, returns true once backlog is empty.
+bool pipeline_backlog_flush(Pipeline *pipeline, PipelineBacklog *backlog);
+// Runs backlog on the caller's thread, returns how many ran. Only once the
+// pipeline is stopped and drained.
+int32_t pipeline_backlog_run(Pipeline *pipeline, PipelineBacklog *backlog);
+// Backlog must be empty
+void pipeline_backlog_destroy(PipelineBacklog *backlog);
+// Call as a job starts with the clock_now_us it was submitted at, returns
+// the start time to pass to pipeline_stage_end
+uint64_t pipeline_stage_begin(PipelineStage *stage, uint64_t submitted_us);
+void pipeline_stage_end(PipelineStage *stage, uint64_t started_us);
+// Joins the threads, tasks still queued stay there
+void pipeline_stop(Pipeline *pipeline);
+// Runs the queued tasks on the caller's thread, returns how many ran. Only
+// once the pipeline is stopped.
+int32_t pipeline_drain(Pipeline *pipeline);
+void pipeline_destroy(Pipeline *pipeline);
+
+#endif // PIPELINE_H
@@ -0,0 +1,412 @@
+#include "recording.h"
+#include "clock.h"
+#include "hash.h"
+#include "log.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static pthread_mutex_t capture_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *capture_file;
+static uint64_t capture_started_us;
+static atomic_bool capture_enabled;
+
+typedef struct {
+    ReplayFrame *frames;
+    size_t count;
+    size_t capacity;
+    size_t cursor;
+} ReplayStream;
+
+typedef struct {
+    uint8_t *file;
+    size_t file_length;
+    bool real_time;
+    ReplayStream *streams;
+    uint32_t stream_count;
+    // Open-addressed by URL hash, a NULL url marks an empty slot
+    ReplayFixture *fixtures;
+    size_t fixture_mask;
+    uint64_t first_at_us;
+    // Set by the first replay_next_frame
+    atomic_uint_fast64_t started_us;
+    atomic_uint_fast64_t frames_left;
+    atomic_uint_fast64_t frames_delivered;
+    atomic_int pending_responses;
+} Replay;
+
+static Replay replay;
+static atomic_bool replay_loaded;
+
+static void put_u32(uint8_t *out, uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+        out[i] = (uint8_t)(value >> (8 * i));
+    }
+}
+
+static void put_u64(uint8_t *out, uint64_t value) {
+    for (int i = 0; i < 8; i++) {
+        out[i] = (uint8_t)(value >> (8 * i));
+    }
+}
+
+static uint32_t get_u32(const uint8_t *in) {
+    uint32_t value = 0;
+    for (int i = 3; i >= 0; i--) {
+        value = (value << 8) | in[i];
+    }
+    return value;
+}
+
+static uint64_t get_u64(const uint8_t *in) {
+    uint64_t value = 0;
+    for (int i = 7; i >= 0; i--) {
+        value = (value << 8) | in[i];
+    }
+    return value;
+}
+
+bool recording_start(const char *path) {
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        log_error(LOG_MAIN, "Failed to open recording %s", path);
+        return false;
+    }
+    if (fwrite(RECORDING_MAGIC, 1, RECORDING_MAGIC_SIZE, file) !=
+        RECORDING_MAGIC_SIZE) {
+        log_error(LOG_MAIN, "Failed to write recording %s", path);
+        fclose(file);
+        return false;
+    }
+
+    pthread_mutex_lock(&capture_lock);
+    capture_file = file;
+    capture_started_us = clock_now_us();
+    pthread_mutex_unlock(&capture_lock);
+    atomic_store(&capture_enabled, true);
+    log_info(LOG_MAIN, "Recording gateway and HTTP traffic to %s", path);
+    return true;
+}
+
+void recording_stop(void) {
+    atomic_store(&capture_enabled, false);
+    pthread_mutex_lock(&capture_lock);
+    if (capture_file) {
+        fclose(capture_file);
+        capture_file = NULL;
+    }
+    pthread_mutex_unlock(&capture_lock);
+}
+
+bool recording_enabled(void) {
+    return atomic_load_explicit(&capture_enabled, memory_order_relaxed);
+}
+
+// prefix is the start of the payload, data follows it
+static void recording_write(RecordType type, const uint8_t *prefix,
+                            size_t prefix_length, const uint8_t *data,
+                            size_t length) {
+    uint8_t header[RECORDING_HEADER_SIZE];
+
+    if (prefix_length + length > UINT32_MAX)
+        return;
+
+    pthread_mutex_lock(&capture_lock);
+    if (!capture_file)
+        goto done;
+
+    put_u64(header, clock_now_us() - capture_started_us);
+    put_u32(header + 8, (uint32_t)type);
+    put_u32(header + 12, (uint32_t)(prefix_length + length));
+    if (fwrite(header, 1, sizeof(header), capture_file) != sizeof(header) ||
+        fwrite(prefix, 1, prefix_length, capture_file) != prefix_length ||
+        (length > 0 &&
+         fwrite(data, 1, length, capture_file) != length)) {
+        log_error(LOG_MAIN, "Failed to write recording, stopping it");
+        fclose(capture_file);
+        capture_file = NULL;
+        atomic_store(&capture_enabled, false);
+    }
+
+done:
+    pthread_mutex_unlock(&capture_lock);
+}
+
+void recording_write_ws_frame(uint32_t stream, const uint8_t *data,
+                              size_t length) {
+    uint8_t prefix[4];
+
+    put_u32(prefix, stream);
+    recording_write(RECORD_WS_FRAME, prefix, sizeof(prefix), data, length);
+}
+
+void recording_write_http_response(const char *url, int64_t status,
+                                   const uint8_t *body, size_t length) {
+    size_t url_length = strlen(url);
+    uint8_t *prefix = malloc(8 + url_length);
+    if (!prefix) {
+        fprintf(stderr, "error: out of memory");
+        exit(1);
+    }
+
+    put_u32(prefix, (uint32_t)status);
+    put_u32(prefix + 4, (uint32_t)url_length);
+    memcpy(prefix + 8, url, url_length);
+    recording_write(RECORD_HTTP_RESPONSE, prefix, 8 + url_length, body,
+                    length);
+    free(prefix);
+}
+
+static void replay_add_frame(uint32_t stream, uint64_t at_us,
+                             const uint8_t *data, size_t length) {
+    if (stream >= replay.stream_count) {
+        ReplayStream *streams =
+            realloc(replay.streams, (stream + 1) * sizeof(*streams));
+        if (!streams) {
+            fprintf(stderr, "error: out of memory");
+            exit(1);
+        }
+        memset(streams + replay.stream_count, 0,
+               (stream + 1 - replay.stream_count) * sizeof(*streams));
+        replay.streams = streams;
+        replay.stream_count = stream + 1;
+    }
+
+    ReplayStream *s = &replay.streams[stream];
+    if (s->count == s->capacity) {
+        size_t capacity = s->capacity ? s->capacity * 2 : 256;
+        ReplayFrame *frames = realloc(s->frames, capacity * sizeof(*frames));
+        if (!frames) {
+            fprintf(stderr, "error: out of memory");
+            exit(1);
+        }
+        s->frames = frames;
+        s->capacity = capacity;
+    }
+    s->frames[s->count++] = (ReplayFrame){at_us, data, length};
+}
+
+static ReplayFixture *replay_fixture_slot(uint64_t hash, const char *url,
+                                          size_t url_length) {
+    for (size_t i = 0; i <= replay.fixture_mask; i++) {
+        ReplayFixture *slot =
+            &replay.fixtures[(hash + i) & replay.fixture_mask];
+        if (!slot->url ||
+            (slot->url_hash == hash && slot->url_length == url_length &&
+             memcmp(slot->url, url, url_length) == 0))
+            return slot;
+    }
+    return NULL;
+}
+
+// Validates the records and returns how many responses there are, -1 if
+// the file is malformed
+static int64_t replay_scan(bool index) {
+    size_t offset = RECORDING_MAGIC_SIZE;
+    int64_t responses = 0;
+
+    while (offset < replay.file_length) {
+        if (replay.file_length - offset < RECORDING_HEADER_SIZE)
+            return -1;
+        const uint8_t *header = replay.file + offset;
+        uint64_t at_us = get_u64(header);
+        uint32_t type = get_u32(header + 8);
+        uint32_t length = get_u32(header + 12);
+        const uint8_t *payload = header + RECORDING_HEADER_SIZE;
+        offset += RECORDING_HEADER_SIZE;
+        if (replay.file_length - offset < length)
+            return -1;
+        offset += length;
+
+        if (type == RECORD_WS_FRAME) {
+            if (length < 4 || get_u32(payload) >= RECORDING_MAX_STREAMS)
+                return -1;
+            if (index) {
+                replay_add_frame(get_u32(payload), at_us, payload + 4,
+                                 length - 4);
+            }
+        } else if (type == RECORD_HTTP_RESPONSE) {
+            if (length < 8 || get_u32(payload + 4) > length - 8)
+                return -1;
+            responses++;
+            if (!index)
+                continue;
+            const char *url = (const char *)payload + 8;
+            size_t url_length = get_u32(payload + 4);
+            uint64_t hash = hash_fnv1a(FNV_OFFSET_BASIS, url, url_length);
+            ReplayFixture *slot = replay_fixture_slot(hash, url, url_length);
+            // Later responses for a URL replace earlier ones
+            *slot = (ReplayFixture){
+                .url_hash = hash,
+                .url = url,
+                .url_length = url_length,
+                .status = (int32_t)get_u32(payload),
+                .body = payload + 8 + url_length,
+                .length = length - 8 - url_length,
+            };
+        }
+    }
+    return responses;
+}
+
+bool replay_load(const char *path, bool real_time) {
+    FILE *file = fopen(path, "rb");
+    long size;
+
+    if (!file) {
+        log_error(LOG_MAIN, "Failed to open replay %s", path);
+        return false;
+    }
+    if (fseek(file, 0, SEEK_END) != 0 || (size = ftell(file)) < 0 ||
+        fseek(file, 0, SEEK_SET) != 0) {
+        log_error(LOG_MAIN, "Failed to read replay %s", path);
+        fclose(file);
+        return false;
+    }
+
+    memset(&replay, 0, sizeof(replay));
+    replay.file = malloc((size_t)size + 1);
+    if (!replay.file) {
+        fprintf(stderr, "error: out of memory");
+        exit(1);
+    }
+    replay.file_length = fread(replay.file, 1, (size_t)size, file);
+    fclose(file);
+
+    if (replay.file_length < RECORDING_MAGIC_SIZE ||
+        memcmp(replay.file, RECORDING_MAGIC, RECORDING_MAGIC_SIZE) != 0) {
+        log_error(LOG_MAIN, "%s is not a muse recording", path);
+        goto fail;
+    }
+
+    int64_t responses = replay_scan(false);
+    if (responses < 0) {
+        log_error(LOG_MAIN, "Replay %s is truncated or corrupt", path);
+        goto fail;
+    }
+    size_t capacity = 16;
+    while (capacity < (size_t)responses * 2) {
+        capacity *= 2;
+    }
+    replay.fixtures = calloc(capacity, sizeof(*replay.fixtures));
+    if (!replay.fixtures) {
+        fprintf(stderr, "error: out of memory");
+        exit(1);
+    }
+    replay.fixture_mask = capacity - 1;
+    replay_scan(true);
+
+    uint64_t frames = 0;
+    replay.first_at_us = UINT64_MAX;
+    for (uint32_t i = 0; i < replay.stream_count; i++) {
+        frames += replay.streams[i].count;
+        if (replay.streams[i].count > 0 &&
+            replay.streams[i].frames[0].at_us < replay.first_at_us)
+            replay.first_at_us = replay.streams[i].frames[0].at_us;
+    }
+    replay.real_time = real_time;
+    atomic_store(&replay.frames_left, frames);
+    atomic_store(&replay_loaded, true);
+    log_info(LOG_MAIN,
+             "Replaying %llu frame(s) on %u stream(s) and %lld response(s) "
+             "from %s%s",
+             (unsigned long long)frames, replay.stream_count,
+             (long long)responses, path, real_time ? " in real time" : "");
+    return true;
+
+fail:
+    free(replay.file);
+    replay.file = NULL;
+    return false;
+}
+
+void replay_unload(void) {
+    if (!atomic_exchange(&replay_loaded, false))
+        return;
+    for (uint32_t i = 0; i < replay.stream_count; i++) {
+        free(replay.streams[i].frames);
+    }
+    free(replay.streams);
+    free(replay.fixtures);
+    free(replay.file);
+    memset(&replay, 0, sizeof(replay));
+}
+
+bool replay_enabled(void) {
+    return atomic_load_explicit(&replay_loaded, memory_order_relaxed);
+}
+
+// Microseconds of the recording the replay has reached
+static uint64_t replay_position_us(void) {
+    uint64_t now = clock_now_us();
+    uint64_t started = 0;
+
+    if (!atomic_compare_exchange_strong(&replay.started_us, &started, now))
+        return now - started + replay.first_at_us;
+    return replay.first_at_us;
+}
+
+const ReplayFrame *replay_next_frame(uint32_t stream) {
+    if (stream >= replay.stream_count)
+        return NULL;
+
+    ReplayStream *s = &replay.streams[stream];
+    if (s->cursor == s->count)
+        return NULL;
+    const ReplayFrame *frame = &s->frames[s->cursor];
+    if (replay.real_time && frame->at_us > replay_position_us())
+        return NULL;
+
+    s->cursor++;
+    atomic_fetch_sub(&replay.frames_left, 1);
+    atomic_fetch_add_explicit(&replay.frames_delivered, 1,
+                              memory_order_relaxed);
+    return frame;
+}
+
+int64_t replay_next_due_us(void) {
+    if (atomic_load(&replay.frames_left) == 0)
+        return -1;
+    if (!replay.real_time)
+        return 0;
+
+    // Cursors may move on other threads, this is only a hint for the wait
+    uint64_t next = UINT64_MAX;
+    for (uint32_t i = 0; i < replay.stream_count; i++) {
+        ReplayStream *s = &replay.streams[i];
+        size_t cursor = s->cursor;
+        if (cursor < s->count && s->frames[cursor].at_us < next)
+            next = s->frames[cursor].at_us;
+    }
+    uint64_t position = replay_position_us();
+    return next > position ? (int64_t)(next - position) : 0;
+}
+
+const ReplayFixture *replay_find_fixture(const char *url) {
+    size_t url_length = strlen(url);
+    uint64_t hash = hash_fnv1a(FNV_OFFSET_BASIS, url, url_length);
+    ReplayFixture *slot = replay_fixture_slot(hash, url, url_length);
+
+    return slot && slot->url ? slot : NULL;
+}
+
+void replay_response_queued(void) {
+    atomic_fetch_add(&replay.pending_responses, 1);
+}
+
+void replay_response_delivered(void) {
+    atomic_fetch_sub(&replay.pending_responses, 1);
+}
+
+bool replay_idle(void) {
+    return atomic_load(&replay.frames_left) == 0 &&
+           atomic_load(&replay.pending_responses) == 0;
+}
+
+uint64_t replay_frames_delivered(void) {
+    return atomic_load_explicit(&replay.frames_delivered,
+                                memory_order_relaxed);
+}
@@ -0,0 +1,70 @@
+#ifndef RECORDING_H
+#define RECORDING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// A traffic log is RECORDING_MAGIC followed by records. Each record is a
+// 16 byte little-endian header (microseconds since the recording started,
+// type, payload length) and its payload.
+#define RECORDING_MAGIC ("MUSEREC1")
+#define RECORDING_MAGIC_SIZE (8)
+#define RECORDING_HEADER_SIZE (16)
+// Websockets get stream ids in the order they are initialized
+#define RECORDING_MAX_STREAMS (1024)
+
+typedef enum {
+    // Payload: stream id (u32), then the message
+    RECORD_WS_FRAME = 1,
+    // Payload: status (u32), URL length (u32), URL, then the body
+    RECORD_HTTP_RESPONSE = 2,
+} RecordType;
+
+// Capture, callable from any thread once started
+bool recording_start(const char *path);
+void recording_stop(void);
+bool recording_enabled(void);
+void recording_write_ws_frame(uint32_t stream, const uint8_t *data,
+                              size_t length);
+void recording_write_http_response(const char *url, int64_t status,
+                                   const uint8_t *body, size_t length);
+
+typedef struct {
+    uint64_t at_us;
+    const uint8_t *data;
+    size_t length;
+} ReplayFrame;
+
+// The last response recorded for a URL
+typedef struct {
+    uint64_t url_hash;
+    const char *url;
+    size_t url_length;
+    int64_t status;
+    const uint8_t *body;
+    size_t length;
+} ReplayFixture;
+
+// Replay. Frames are delivered as fast as they are consumed, or with
+// real_time at their recorded pace.
+bool replay_load(const char *path, bool real_time);
+void replay_unload(void);
+bool replay_enabled(void);
+// The stream's next frame if it is due, NULL otherwise. Each stream must be
+// consumed from one thread.
+const ReplayFrame *replay_next_frame(uint32_t stream);
+// Microseconds until the next frame of any stream is due, 0 if one is due
+// now, -1 once every frame was delivered
+int64_t replay_next_due_us(void);
+// NULL if the URL was never recorded
+const ReplayFixture *replay_find_fixture(const char *url);
+// Fixture responses queued but not yet delivered, across transports
+void replay_response_queued(void);
+void replay_response_delivered(void);
+// Every frame was delivered and no response is pending
+bool replay_idle(void);
+// Frames delivered so far
+uint64_t replay_frames_delivered(void);
+
+#endif // RECORDING_H
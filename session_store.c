@@ -0,0 +1,112 @@
+#include "session_store.h"
+#include "log.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <unistd.h> // for fsync(2)
+#else
+#define _WIN32_LEAN_AND_MEAN
+#include <io.h>
+#include <windows.h>
+#endif
+
+// Bumped whenever the line format changes, older files are ignored
+#define SESSION_STORE_HEADER ("muse-session 1\n")
+
+bool session_store_save(const char *path, const SessionRecord *records,
+                        int32_t count) {
+    char tmp_path[512];
+    bool success = false;
+    FILE *file = NULL;
+
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >=
+        (int)sizeof(tmp_path)) {
+        log_error(LOG_GATEWAY, "Session file path too long: %s", path);
+        return false;
+    }
+
+    file = fopen(tmp_path, "w");
+    if (!file) {
+        log_error(LOG_GATEWAY, "Failed to open session file %s: %s", tmp_path,
+                  strerror(errno));
+        return false;
+    }
+
+    if (fputs(SESSION_STORE_HEADER, file) == EOF)
+        goto cleanup;
+
+    for (int32_t i = 0; i < count; i++) {
+        const SessionRecord *record = &records[i];
+        if (record->session_id[0] == '\0')
+            continue;
+        if (fprintf(file, "%d %d %d %s %s\n", record->shard_id,
+                    record->shard_count, record->seq, record->session_id,
+                    record->resume_url) < 0)
+            goto cleanup;
+    }
+
+    // The rename must not become visible before the data
+    if (fflush(file) != 0)
+        goto cleanup;
+#ifndef _WIN32
+    if (fsync(fileno(file)) != 0)
+        goto cleanup;
+#else
+    if (_commit(_fileno(file)) != 0)
+        goto cleanup;
+#endif
+    success = true;
+
+cleanup:
+    if (fclose(file) != 0)
+        success = false;
+
+    if (success) {
+#ifndef _WIN32
+        success = rename(tmp_path, path) == 0;
+#else
+        success = MoveFileExA(tmp_path, path, MOVEFILE_REPLACE_EXISTING);
+#endif
+    }
+
+    if (!success) {
+        log_error(LOG_GATEWAY, "Failed to write session file %s", path);
+        remove(tmp_path);
+    }
+    return success;
+}
+
+int32_t session_store_load(const char *path, SessionRecord *records,
+                           int32_t max_records) {
+    char line[512];
+    int32_t count = 0;
+
+    FILE *file = fopen(path, "r");
+    if (!file)
+        return 0;
+
+    if (!fgets(line, sizeof(line), file) ||
+        strcmp(line, SESSION_STORE_HEADER) != 0) {
+        log_warn(LOG_GATEWAY, "Ignoring session file %s with unknown format",
+                 path);
+        fclose(file);
+        return 0;
+    }
+
+    while (count < max_records && fgets(line, sizeof(line), file)) {
+        SessionRecord *record = &records[count];
+        // Widths are SESSION_STORE_MAX_SESSION_ID - 1 and
+        // SESSION_STORE_MAX_URL - 1
+        if (sscanf(line, "%d %d %d %127s %255s", &record->shard_id,
+                   &record->shard_count, &record->seq, record->session_id,
+                   record->resume_url) == 5) {
+            count++;
+        }
+    }
+
+    fclose(file);
+    return count;
+}
@@ -0,0 +1,27 @@
+#ifndef SESSION_STORE_H
+#define SESSION_STORE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define SESSION_STORE_MAX_SESSION_ID (128)
+#define SESSION_STORE_MAX_URL (256)
+
+// What a shard needs to RESUME instead of IDENTIFY
+typedef struct {
+    int32_t shard_id;
+    int32_t shard_count;
+    int32_t seq;
+    char session_id[SESSION_STORE_MAX_SESSION_ID];
+    char resume_url[SESSION_STORE_MAX_URL];
+} SessionRecord;
+
+// Writes every record with a session to a temporary file and renames it
+// over path, so readers see either the old or the new file
+bool session_store_save(const char *path, const SessionRecord *records,
+                        int32_t count);
+// Returns the number of records read, 0 if the file is missing or invalid
+int32_t session_store_load(const char *path, SessionRecord *records,
+                           int32_t max_records);
+
+#endif // SESSION_STORE_H
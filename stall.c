@@ -0,0 +1,97 @@
+#include "stall.h"
+#include "clock.h"
+#include "log.h"
+#include "metrics.h"
+
+#include <stdatomic.h>
+#include <stdlib.h>
+
+#ifdef __GLIBC__
+#include <execinfo.h>
+#endif
+
+#define STALL_BACKTRACE_DEPTH (32)
+// A stalled loop tends to stall repeatedly, one backtrace per interval is
+// enough to find it
+#define STALL_BACKTRACE_INTERVAL_MS (1000)
+
+static Metric loop_busy_us = METRIC_HISTOGRAM_INIT(
+    "muse_loop_busy_us",
+    "Microseconds an event loop iteration spent working after its wait",
+    METRICS_LATENCY_US_BOUNDS);
+static Metric loop_stalls_total = METRIC_COUNTER_INIT(
+    "muse_loop_stalls_total", "Event loop callbacks that exceeded the budget");
+
+static atomic_uint_fast64_t budget_us;
+static atomic_uint_fast64_t last_backtrace_ms;
+
+void stall_set_budget_us(uint64_t budget) {
+    atomic_store_explicit(&budget_us, budget, memory_order_relaxed);
+    if (budget > 0) {
+        metrics_register(&loop_busy_us);
+        metrics_register(&loop_stalls_total);
+    }
+}
+
+uint64_t stall_begin(void) {
+    if (atomic_load_explicit(&budget_us, memory_order_relaxed) == 0)
+        return 0;
+    return clock_now_us();
+}
+
+// Kept out of line so the frames to skip are always the same two
+__attribute__((noinline)) static void stall_log_backtrace(void) {
+#ifdef __GLIBC__
+    void *frames[STALL_BACKTRACE_DEPTH];
+    uint64_t now = clock_now_ms();
+    uint64_t last =
+        atomic_load_explicit(&last_backtrace_ms, memory_order_relaxed);
+
+    if (last != 0 && now - last < STALL_BACKTRACE_INTERVAL_MS)
+        return;
+    if (!atomic_compare_exchange_strong(&last_backtrace_ms, &last, now))
+        return;
+
+    int depth = backtrace(frames, STALL_BACKTRACE_DEPTH);
+    char **symbols = backtrace_symbols(frames, depth);
+    if (!symbols)
+        return;
+    // Frames 0 and 1 are this function and stall_end
+    for (int i = 2; i < depth; i++) {
+        log_warn(LOG_MAIN, "  #%d %s", i - 2, symbols[i]);
+    }
+    free(symbols);
+#endif
+}
+
+void stall_end(uint64_t started_us, const char *kind, StallCallback callback) {
+    if (started_us == 0)
+        return;
+
+    uint64_t elapsed_us = clock_now_us() - started_us;
+    uint64_t budget = atomic_load_explicit(&budget_us, memory_order_relaxed);
+    if (budget == 0 || elapsed_us <= budget)
+        return;
+
+    metric_add(&loop_stalls_total, 1);
+#ifdef __GLIBC__
+    // Static functions show as an offset into the binary, for addr2line
+    void *address = *(void **)&callback;
+    char **symbol = backtrace_symbols(&address, 1);
+    log_warn(LOG_MAIN, "Stall: %s callback %s ran %llu us, budget %llu us",
+             kind, symbol ? symbol[0] : "?", (unsigned long long)elapsed_us,
+             (unsigned long long)budget);
+    free(symbol);
+#else
+    log_warn(LOG_MAIN, "Stall: %s callback %p ran %llu us, budget %llu us",
+             kind, *(void **)&callback, (unsigned long long)elapsed_us,
+             (unsigned long long)budget);
+#endif
+    stall_log_backtrace();
+}
+
+void stall_end_iteration(uint64_t started_us) {
+    if (started_us == 0)
+        return;
+    metric_observe(&loop_busy_us, (int64_t)(clock_now_us() - started_us));
+}
@@ -0,0 +1,28 @@
+#ifndef STALL_H
+#define STALL_H
+
+#include <stdint.h>
+
+// Any callback type, only used to name the callback in the log
+typedef void (*StallCallback)(void);
+
+// Event loop callbacks that run longer than the budget are logged with their
+// address and a backtrace of the loop that called them. 0, the default,
+// disables the detector and its clock reads.
+void stall_set_budget_us(uint64_t budget_us);
+// Returns 0 while disabled
+uint64_t stall_begin(void);
+void stall_end(uint64_t started_us, const char *kind, StallCallback callback);
+// Observes one loop iteration, from the end of its wait to the end of its
+// work, started_us from stall_begin
+void stall_end_iteration(uint64_t started_us);
+
+// Calls fn(...) and checks it against the budget
+#define STALL_CALL(kind, fn, ...)                                              \
+    do {                                                                       \
+        uint64_t stall_started_us = stall_begin();                             \
+        (fn)(__VA_ARGS__);                                                     \
+        stall_end(stall_started_us, (kind), (StallCallback)(fn));              \
+    } while (0)
+
+#endif // STALL_H
@@ -0,0 +1,89 @@
+#include "task_queue.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+void task_queue_init(TaskQueue *queue, size_t capacity) {
+    queue->slots = calloc(capacity, sizeof(*queue->slots));
+    if (!queue->slots) {
+        fprintf(stderr, "error: out of memory");
+        exit(1);
+    }
+
+    queue->mask = capacity - 1;
+    for (size_t i = 0; i < capacity; i++) {
+        atomic_init(&queue->slots[i].seq, i);
+    }
+    atomic_init(&queue->head, 0);
+    atomic_init(&queue->tail, 0);
+}
+
+bool task_queue_push(TaskQueue *queue, TaskFn fn, void *arg) {
+    size_t pos = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    TaskSlot *slot;
+
+    for (;;) {
+        slot = &queue->slots[pos & queue->mask];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(
+                    &queue->head, &pos, pos + 1, memory_order_relaxed,
+                    memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            // A consumer hasn't freed this slot yet
+            return false;
+        } else {
+            pos = atomic_load_explicit(&queue->head, memory_order_relaxed);
+        }
+    }
+
+    slot->fn = fn;
+    slot->arg = arg;
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+    return true;
+}
+
+bool task_queue_pop(TaskQueue *queue, TaskFn *out_fn, void **out_arg) {
+    size_t pos = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    TaskSlot *slot;
+
+    for (;;) {
+        slot = &queue->slots[pos & queue->mask];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(
+                    &queue->tail, &pos, pos + 1, memory_order_relaxed,
+                    memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            return false;
+        } else {
+            pos = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+        }
+    }
+
+    *out_fn = slot->fn;
+    *out_arg = slot->arg;
+    // Free for the producer one lap ahead
+    atomic_store_explicit(&slot->seq, pos + queue->mask + 1,
+                          memory_order_release);
+    return true;
+}
+
+size_t task_queue_depth(TaskQueue *queue) {
+    size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    return head > tail ? head - tail : 0;
+}
+
+void task_queue_destroy(TaskQueue *queue) {
+    free(queue->slots);
+    queue->slots = NULL;
+    queue->mask = 0;
+}
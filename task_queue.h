@@ -0,0 +1,39 @@
+#ifndef TASK_QUEUE_H
+#define TASK_QUEUE_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Called with the consumer's context (e.g. the worker running the task) and
+// the argument it was pushed with
+typedef void (*TaskFn)(void *context, void *arg);
+
+typedef struct {
+    // Vyukov's bounded MPMC sequence: equals the slot's position when free,
+    // position + 1 once a task is published
+    atomic_size_t seq;
+    TaskFn fn;
+    void *arg;
+} TaskSlot;
+
+// Bounded lock-free queue of tasks, any thread may push or pop. Nothing is
+// allocated after task_queue_init.
+typedef struct {
+    TaskSlot *slots;
+    size_t mask;
+    atomic_size_t head;
+    atomic_size_t tail;
+} TaskQueue;
+
+// capacity must be a power of two
+void task_queue_init(TaskQueue *queue, size_t capacity);
+// Returns false if the queue is full
+bool task_queue_push(TaskQueue *queue, TaskFn fn, void *arg);
+// Returns false if the queue is empty
+bool task_queue_pop(TaskQueue *queue, TaskFn *out_fn, void **out_arg);
+// Approximate while other threads push or pop
+size_t task_queue_depth(TaskQueue *queue);
+void task_queue_destroy(TaskQueue *queue);
+
+#endif // TASK_QUEUE_H
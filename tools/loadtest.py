@@ -0,0 +1,721 @@
+#!/usr/bin/env python3
+"""Load test muse against local stand-ins for Discord and Songlink.
+
+Serves, over TLS with a throwaway self-signed certificate:
+  - a gateway speaking HELLO, heartbeat ACKs, IDENTIFY/READY, RESUME/RESUMED
+    and RECONNECT, which sends synthetic MESSAGE_CREATE events at a fixed
+    rate, a share of them containing a music link
+  - GET /api/v10/gateway/bot and POST /api/v10/channels/{id}/messages
+  - GET /v1-alpha.1/links, the Songlink lookup
+with configurable latency, 429s and failures on both HTTP stand-ins.
+
+Each link message carries a unique track id, which the Songlink stand-in
+echoes into the links muse replies with, so a reply is matched to the
+message that caused it. Reply latency is measured from the MESSAGE_CREATE
+write to the POST carrying the reply.
+
+muse's own limits still apply: replies are held to Discord's global 50
+REST requests per second (REPLY_COALESCE_MS batches several per request),
+and admission caps replies per channel and per author, which --channels
+and --authors spread the load over. --lift-limits raises all of them
+through muse's REST_GLOBAL_LIMIT and ADMISSION_* variables, so the
+stand-ins measure muse itself.
+
+Run a build under test:
+    tools/loadtest.py --muse ./muse --rate 500 --duration 30
+or start the servers alone and point muse at them with the environment
+variables printed at startup. Standard library only, needs the openssl
+command line tool unless --cert and --key are given.
+"""
+
+import argparse
+import asyncio
+import base64
+import hashlib
+import json
+import os
+import random
+import re
+import shutil
+import signal
+import ssl
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+import urllib.parse
+
+DISCORD_EPOCH_MS = 1420070400000
+WS_GUID = b"258EAFA5-E914-47DA-95CA-C5AB0DC11B65"
+
+OP_DISPATCH = 0
+OP_HEARTBEAT = 1
+OP_IDENTIFY = 2
+OP_RESUME = 6
+OP_RECONNECT = 7
+OP_INVALID_SESSION = 9
+OP_HELLO = 10
+OP_HEARTBEAT_ACK = 11
+
+# muse's limits under --lift-limits, far above what one host can drive
+LIFTED_LIMITS = {
+    "REST_GLOBAL_LIMIT": "1000000",
+    "ADMISSION_CHANNEL_PER_MINUTE": "1000000",
+    "ADMISSION_AUTHOR_PER_MINUTE": "1000000",
+    "ADMISSION_MAX_PENDING_LOOKUPS": "1000000",
+}
+
+TRACK_RE = re.compile(r"/track/(T[0-9]+)")
+
+LINK_TEMPLATES = [
+    "check this out https://open.spotify.com/track/{id} so good",
+    "https://open.spotify.com/track/{id}",
+    "new favourite: https://open.spotify.com/track/{id}?si=abc123",
+]
+CHATTER = [
+    "good morning everyone",
+    "did anyone see the game last night",
+    "lol",
+    "brb getting coffee, back in five minutes or so",
+    "https://example.com/not/a/music/link",
+]
+
+
+def make_certificate(directory):
+    if not shutil.which("openssl"):
+        sys.exit("error: openssl not found, pass --cert and --key")
+    cert = os.path.join(directory, "cert.pem")
+    key = os.path.join(directory, "key.pem")
+    subprocess.run(
+        ["openssl", "req", "-x509", "-newkey", "rsa:2048", "-nodes",
+         "-keyout", key, "-out", cert, "-days", "1", "-subj", "/CN=localhost",
+         "-addext", "subjectAltName=IP:127.0.0.1,DNS:localhost"],
+        check=True, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    return cert, key
+
+
+def tracked(handler, tasks):
+    """Wraps a connection handler so shutdown can cancel its tasks."""
+    async def run(reader, writer):
+        task = asyncio.current_task()
+        tasks.add(task)
+        try:
+            await handler(reader, writer)
+        except asyncio.CancelledError:
+            # Ended by shutdown. Returning normally keeps asyncio from
+            # logging the cancellation.
+            pass
+        finally:
+            tasks.discard(task)
+    return run
+
+
+def percentile(sorted_values, q):
+    if not sorted_values:
+        return None
+    index = min(len(sorted_values) - 1, int(q * len(sorted_values)))
+    return sorted_values[index]
+
+
+class Stats:
+    def __init__(self):
+        self.messages_sent = 0
+        self.link_messages_sent = 0
+        self.replies = 0
+        self.replied_links = 0
+        self.unmatched_links = 0
+        self.latencies_ms = []
+        self.songlink_requests = 0
+        self.rest_requests = 0
+        self.served_429 = 0
+        self.served_errors = 0
+        self.identifies = 0
+        self.resumes = 0
+        self.reconnects_sent = 0
+        # Track id -> monotonic send time, removed once replied to
+        self.pending = {}
+        # Replies to messages sent before it are left out of the results
+        self.window_started = None
+
+    def unanswered(self):
+        return sum(1 for sent_at in self.pending.values()
+                   if sent_at >= self.window_started)
+
+    def start_window(self, now):
+        self.window_started = now
+        self.messages_sent = 0
+        self.link_messages_sent = 0
+        self.replies = 0
+        self.replied_links = 0
+        self.unmatched_links = 0
+        self.latencies_ms = []
+
+
+class WebSocket:
+    """Server side of RFC 6455, text frames only."""
+
+    def __init__(self, reader, writer):
+        self.reader = reader
+        self.writer = writer
+        self.closed = False
+
+    async def handshake(self):
+        request = await self.reader.readuntil(b"\r\n\r\n")
+        key = None
+        for line in request.split(b"\r\n")[1:]:
+            name, _, value = line.partition(b":")
+            if name.strip().lower() == b"sec-websocket-key":
+                key = value.strip()
+        if key is None:
+            self.writer.write(b"HTTP/1.1 400 Bad Request\r\n\r\n")
+            return False
+        accept = base64.b64encode(hashlib.sha1(key + WS_GUID).digest())
+        self.writer.write(
+            b"HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\n"
+            b"Connection: Upgrade\r\nSec-WebSocket-Accept: " + accept +
+            b"\r\n\r\n")
+        await self.writer.drain()
+        return True
+
+    def send_frame(self, opcode, payload):
+        if self.closed:
+            return
+        length = len(payload)
+        if length < 126:
+            header = struct.pack("!BB", 0x80 | opcode, length)
+        elif length < 65536:
+            header = struct.pack("!BBH", 0x80 | opcode, 126, length)
+        else:
+            header = struct.pack("!BBQ", 0x80 | opcode, 127, length)
+        self.writer.write(header + payload)
+
+    def send_json(self, obj):
+        self.send_frame(0x1, json.dumps(obj, separators=(",", ":")).encode())
+
+    def close(self, code=1000):
+        self.send_frame(0x8, struct.pack("!H", code))
+        self.closed = True
+
+    async def recv(self):
+        """Returns the next text message, None once the peer closes."""
+        message = b""
+        while True:
+            head = await self.reader.readexactly(2)
+            opcode = head[0] & 0x0F
+            length = head[1] & 0x7F
+            if length == 126:
+                length, = struct.unpack("!H",
+                                        await self.reader.readexactly(2))
+            elif length == 127:
+                length, = struct.unpack("!Q",
+                                        await self.reader.readexactly(8))
+            mask = await self.reader.readexactly(4) if head[1] & 0x80 else None
+            data = bytearray(await self.reader.readexactly(length))
+            if mask:
+                for i in range(length):
+                    data[i] ^= mask[i & 3]
+            if opcode == 0x8:
+                if not self.closed:
+                    self.send_frame(0x8, bytes(data[:2]))
+                    self.closed = True
+                return None
+            if opcode == 0x9:
+                self.send_frame(0xA, bytes(data))
+                continue
+            if opcode == 0xA:
+                continue
+            message += data
+            if head[0] & 0x80:
+                return message
+
+
+class GatewaySession:
+    def __init__(self, session_id):
+        self.session_id = session_id
+        self.seq = 0
+        self.shard = (0, 1)
+        self.ws = None
+
+
+class Gateway:
+    def __init__(self, args, stats, url):
+        self.args = args
+        self.stats = stats
+        self.url = url
+        self.sessions = {}
+        # Sessions with a live, identified or resumed connection
+        self.ready = []
+        self.next_session = 0
+        self.next_message = 0
+
+    async def handle(self, reader, writer):
+        ws = WebSocket(reader, writer)
+        session = None
+        try:
+            if not await ws.handshake():
+                return
+            ws.send_json({"op": OP_HELLO, "s": None, "t": None,
+                          "d": {"heartbeat_interval":
+                                self.args.heartbeat_interval_ms}})
+            while True:
+                raw = await ws.recv()
+                if raw is None:
+                    break
+                event = json.loads(raw)
+                op = event.get("op")
+                if op == OP_HEARTBEAT:
+                    ws.send_json({"op": OP_HEARTBEAT_ACK, "s": None,
+                                  "t": None, "d": None})
+                elif op == OP_IDENTIFY:
+                    session = self.identify(ws, event.get("d") or {})
+                elif op == OP_RESUME:
+                    session = self.resume(ws, event.get("d") or {})
+                await writer.drain()
+        except (asyncio.IncompleteReadError, ConnectionError, ssl.SSLError):
+            pass
+        finally:
+            if session is not None and session.ws is ws:
+                session.ws = None
+                if session in self.ready:
+                    self.ready.remove(session)
+            writer.close()
+
+    def identify(self, ws, data):
+        self.stats.identifies += 1
+        self.next_session += 1
+        session = GatewaySession("session-%d" % self.next_session)
+        shard = data.get("shard") or [0, 1]
+        session.shard = (shard[0], shard[1])
+        session.ws = ws
+        self.sessions[session.session_id] = session
+        session.seq += 1
+        ws.send_json({"op": OP_DISPATCH, "t": "READY", "s": session.seq,
+                      "d": {"v": 10, "session_id": session.session_id,
+                            "resume_gateway_url": self.url,
+                            "user": {"id": "1", "username": "muse",
+                                     "bot": True},
+                            "shard": list(session.shard),
+                            "guilds": []}})
+        self.ready.append(session)
+        return session
+
+    def resume(self, ws, data):
+        session = self.sessions.get(data.get("session_id"))
+        if session is None:
+            ws.send_json({"op": OP_INVALID_SESSION, "s": None, "t": None,
+                          "d": False})
+            return None
+        self.stats.resumes += 1
+        if session.ws is not None and session.ws is not ws:
+            session.ws.close(4000)
+        session.ws = ws
+        # Events missed while disconnected aren't replayed, the synthetic
+        # stream just continues
+        session.seq += 1
+        ws.send_json({"op": OP_DISPATCH, "t": "RESUMED", "s": session.seq,
+                      "d": None})
+        if session not in self.ready:
+            self.ready.append(session)
+        return session
+
+    def message_create(self, session):
+        self.next_message += 1
+        n = self.next_message
+        now_ms = int(time.time() * 1000)
+        message_id = ((now_ms - DISCORD_EPOCH_MS) << 22) | (n & 0x3FFFFF)
+        is_link = random.random() < self.args.link_ratio
+        if is_link:
+            track = "T%d" % n
+            content = random.choice(LINK_TEMPLATES).format(id=track)
+            self.stats.pending[track] = time.monotonic()
+            self.stats.link_messages_sent += 1
+        else:
+            content = random.choice(CHATTER)
+        channel = n % self.args.channels + 1
+        session.seq += 1
+        session.ws.send_json({
+            "op": OP_DISPATCH, "t": "MESSAGE_CREATE", "s": session.seq,
+            "d": {"id": str(message_id), "channel_id": str(channel),
+                  "guild_id": "100", "content": content, "type": 0,
+                  "timestamp": time.strftime("%Y-%m-%dT%H:%M:%S+00:00",
+                                             time.gmtime()),
+                  "author": {"id": str(1000 + n % self.args.authors),
+                             "username": "user", "bot": False}}})
+        self.stats.messages_sent += 1
+
+    async def generate(self):
+        started = time.monotonic()
+        sent = 0
+        last_reconnect = started
+        while True:
+            await asyncio.sleep(0.002)
+            now = time.monotonic()
+            if self.args.reconnect_every > 0 and self.ready and \
+                    now - last_reconnect >= self.args.reconnect_every:
+                last_reconnect = now
+                session = random.choice(self.ready)
+                self.ready.remove(session)
+                session.ws.send_json({"op": OP_RECONNECT, "s": None,
+                                      "t": None, "d": None})
+                self.stats.reconnects_sent += 1
+            due = int((now - started) * self.args.rate) - sent
+            if not self.ready:
+                # Nothing to send on, don't build a backlog meanwhile
+                sent += due
+                continue
+            for _ in range(due):
+                session = self.ready[sent % len(self.ready)]
+                self.message_create(session)
+                sent += 1
+            for session in self.ready:
+                try:
+                    await session.ws.writer.drain()
+                except ConnectionError:
+                    pass
+
+
+class HttpStandIn:
+    """HTTP/1.1 with keep-alive, for the REST API and Songlink."""
+
+    def __init__(self, args, stats, gateway_url):
+        self.args = args
+        self.stats = stats
+        self.gateway_url = gateway_url
+
+    async def handle(self, reader, writer):
+        try:
+            while True:
+                head = await reader.readuntil(b"\r\n\r\n")
+                lines = head.decode("latin-1").split("\r\n")
+                method, target, _ = lines[0].split(" ", 2)
+                headers = {}
+                for line in lines[1:]:
+                    if ":" in line:
+                        name, value = line.split(":", 1)
+                        headers[name.strip().lower()] = value.strip()
+                if headers.get("expect", "").lower() == "100-continue":
+                    writer.write(b"HTTP/1.1 100 Continue\r\n\r\n")
+                length = int(headers.get("content-length", "0"))
+                body = await reader.readexactly(length) if length else b""
+                status, extra, payload = await self.route(method, target,
+                                                          body)
+                self.respond(writer, status, extra, payload)
+                await writer.drain()
+        except (asyncio.IncompleteReadError, ConnectionError, ssl.SSLError,
+                ValueError):
+            pass
+        finally:
+            writer.close()
+
+    def respond(self, writer, status, extra, payload):
+        reasons = {200: "OK", 404: "Not Found", 429: "Too Many Requests",
+                   500: "Internal Server Error"}
+        data = json.dumps(payload).encode()
+        lines = ["HTTP/1.1 %d %s" % (status, reasons.get(status, "Status")),
+                 "Content-Type: application/json",
+                 "Content-Length: %d" % len(data)]
+        lines += ["%s: %s" % item for item in extra.items()]
+        writer.write(("\r\n".join(lines) + "\r\n\r\n").encode() + data)
+
+    async def delay(self, latency_ms):
+        jitter = self.args.jitter_ms
+        ms = max(0.0, latency_ms + random.uniform(-jitter, jitter))
+        if ms > 0:
+            await asyncio.sleep(ms / 1000)
+
+    def fault(self, ratio_429, ratio_error):
+        roll = random.random()
+        if roll < ratio_429:
+            self.stats.served_429 += 1
+            retry_after = self.args.retry_after_ms / 1000
+            return 429, {"Retry-After": "%g" % retry_after}, {
+                "message": "You are being rate limited.",
+                "retry_after": retry_after, "global": False}
+        if roll < ratio_429 + ratio_error:
+            self.stats.served_errors += 1
+            return 500, {}, {"message": "Internal Server Error", "code": 0}
+        return None
+
+    async def route(self, method, target, body):
+        url = urllib.parse.urlsplit(target)
+        path = url.path
+        if method == "GET" and path.endswith("/gateway/bot"):
+            return 200, {}, {
+                "url": self.gateway_url, "shards": self.args.shards,
+                "session_start_limit": {"total": 1000, "remaining": 1000,
+                                        "reset_after": 0,
+                                        "max_concurrency": 16}}
+        if method == "POST" and re.search(r"/channels/[0-9]+/messages$",
+                                          path):
+            return await self.create_message(path, body)
+        if method == "GET" and path.endswith("/links"):
+            query = urllib.parse.parse_qs(url.query)
+            return await self.songlink(query.get("url", [""])[0])
+        return 404, {}, {"message": "404: Not Found", "code": 0}
+
+    async def create_message(self, path, body):
+        self.stats.rest_requests += 1
+        await self.delay(self.args.rest_latency_ms)
+        fault = self.fault(self.args.rest_429_ratio,
+                           self.args.rest_error_ratio)
+        if fault:
+            return fault
+        now = time.monotonic()
+        message = json.loads(body or b"{}")
+        self.stats.replies += 1
+        for embed in message.get("embeds", []):
+            track = None
+            for field in embed.get("fields", []):
+                match = TRACK_RE.search(field.get("value", ""))
+                if match:
+                    track = match.group(1)
+                    break
+            sent_at = self.stats.pending.pop(track, None)
+            if sent_at is None:
+                self.stats.unmatched_links += 1
+                continue
+            window_started = self.stats.window_started
+            if window_started is None or sent_at < window_started:
+                continue
+            self.stats.replied_links += 1
+            self.stats.latencies_ms.append((now - sent_at) * 1000)
+        channel = path.rsplit("/", 2)[-2]
+        return 200, {"X-RateLimit-Limit": "5",
+                     "X-RateLimit-Remaining": "4",
+                     "X-RateLimit-Reset-After": "1",
+                     "X-RateLimit-Bucket": "stand-in"}, {
+            "id": str(((int(time.time() * 1000) - DISCORD_EPOCH_MS) << 22)),
+            "channel_id": channel, "content": message.get("content", "")}
+
+    async def songlink(self, music_url):
+        self.stats.songlink_requests += 1
+        await self.delay(self.args.songlink_latency_ms)
+        fault = self.fault(self.args.songlink_429_ratio,
+                           self.args.songlink_error_ratio)
+        if fault:
+            return fault
+        match = TRACK_RE.search(music_url)
+        track = match.group(1) if match else "unknown"
+        entity = "SPOTIFY_SONG::" + track
+        return 200, {}, {
+            "entityUniqueId": entity,
+            "pageUrl": "https://song.link/s/" + track,
+            "entitiesByUniqueId": {entity: {
+                "id": track, "type": "song", "title": "Track " + track,
+                "artistName": "Stand-in",
+                "thumbnailUrl": "https://i.scdn.co/image/" + track}},
+            "linksByPlatform": {
+                "spotify": {"url": "https://open.spotify.com/track/" + track,
+                            "entityUniqueId": entity},
+                "youtube": {"url": "https://www.youtube.com/watch?v=" + track,
+                            "entityUniqueId": entity},
+                "appleMusic": {"url": "https://music.apple.com/us/song/"
+                               "stand-in/" + track,
+                               "entityUniqueId": entity}}}
+
+
+def summary(stats, window):
+    latencies = sorted(stats.latencies_ms)
+    result = {
+        "duration_s": round(window, 3),
+        "offered_msgs_per_s": round(stats.messages_sent / window, 1),
+        "link_msgs_per_s": round(stats.link_messages_sent / window, 1),
+        "replied_links_per_s": round(stats.replied_links / window, 1),
+        "messages_sent": stats.messages_sent,
+        "link_messages_sent": stats.link_messages_sent,
+        "replied_links": stats.replied_links,
+        "reply_posts": stats.replies,
+        "unmatched_links": stats.unmatched_links,
+        "unanswered_links": stats.unanswered(),
+        "latency_ms": {
+            name: (round(percentile(latencies, q), 2) if latencies else None)
+            for name, q in (("p50", 0.5), ("p90", 0.9), ("p99", 0.99),
+                            ("p999", 0.999))},
+        "served_429": stats.served_429,
+        "served_errors": stats.served_errors,
+        "songlink_requests": stats.songlink_requests,
+        "rest_requests": stats.rest_requests,
+        "identifies": stats.identifies,
+        "resumes": stats.resumes,
+        "reconnects_sent": stats.reconnects_sent,
+    }
+    if latencies:
+        result["latency_ms"]["max"] = round(latencies[-1], 2)
+    return result
+
+
+async def run(args):
+    stats = Stats()
+    workdir = tempfile.mkdtemp(prefix="muse-loadtest-")
+    if args.cert and args.key:
+        cert, key = args.cert, args.key
+    else:
+        cert, key = make_certificate(workdir)
+    context = ssl.create_default_context(ssl.Purpose.CLIENT_AUTH)
+    context.load_cert_chain(cert, key)
+
+    gateway_url = "wss://%s:%d" % (args.host, args.gateway_port)
+    http_url = "https://%s:%d" % (args.host, args.http_port)
+    gateway = Gateway(args, stats, gateway_url)
+    http = HttpStandIn(args, stats, gateway_url)
+    connections = set()
+    gateway_server = await asyncio.start_server(
+        tracked(gateway.handle, connections), args.host, args.gateway_port,
+        ssl=context)
+    http_server = await asyncio.start_server(
+        tracked(http.handle, connections), args.host, args.http_port,
+        ssl=context)
+
+    env = {
+        "TOKEN": "loadtest",
+        "GATEWAY_URL": gateway_url,
+        "API_BASE_URL": http_url + "/api/v10",
+        "SONGLINK_API_URL": http_url + "/v1-alpha.1/links?url=",
+        "TLS_CA_FILE": cert,
+    }
+    muse = None
+    if args.muse:
+        muse_env = dict(os.environ)
+        muse_env.update(env)
+        if args.shards:
+            muse_env.setdefault("SHARD_COUNT", str(args.shards))
+        if args.lift_limits:
+            for name, value in LIFTED_LIMITS.items():
+                muse_env.setdefault(name, value)
+        muse = await asyncio.create_subprocess_exec(
+            args.muse, env=muse_env,
+            stdout=subprocess.DEVNULL if args.quiet else None,
+            stderr=subprocess.DEVNULL if args.quiet else None)
+    else:
+        print("Run muse with:", file=sys.stderr)
+        for name, value in env.items():
+            print("  %s=%s" % (name, value), file=sys.stderr)
+
+    generator = asyncio.ensure_future(gateway.generate())
+    started = time.monotonic()
+    window_started = started
+    last_report = started
+    last_counts = (0, 0)
+    stop = asyncio.Event()
+    loop = asyncio.get_running_loop()
+    for signum in (signal.SIGINT, signal.SIGTERM):
+        loop.add_signal_handler(signum, stop.set)
+
+    try:
+        while not stop.is_set():
+            try:
+                await asyncio.wait_for(stop.wait(), 1.0)
+            except asyncio.TimeoutError:
+                pass
+            if muse is not None and muse.returncode is not None:
+                print("error: muse exited with %d" % muse.returncode,
+                      file=sys.stderr)
+                break
+            now = time.monotonic()
+            if stats.window_started is None and \
+                    now - started >= args.warmup:
+                stats.start_window(now)
+                window_started = now
+                last_report = now
+                last_counts = (0, 0)
+            measuring = stats.window_started is not None
+            if measuring and now - last_report >= args.report_every:
+                interval = now - last_report
+                sent = stats.messages_sent - last_counts[0]
+                replied = stats.replied_links - last_counts[1]
+                print("%6.1fs  sent %7.1f/s  replied %7.1f/s  pending %d" %
+                      (now - window_started, sent / interval,
+                       replied / interval, stats.unanswered()),
+                      file=sys.stderr)
+                last_report = now
+                last_counts = (stats.messages_sent, stats.replied_links)
+            if args.duration and measuring and \
+                    now - window_started >= args.duration:
+                break
+    finally:
+        if stats.window_started is None:
+            stats.start_window(window_started)
+        window = max(time.monotonic() - window_started, 1e-9)
+        if muse is not None and muse.returncode is None:
+            muse.send_signal(signal.SIGINT)
+            try:
+                await asyncio.wait_for(muse.wait(), 5)
+            except asyncio.TimeoutError:
+                muse.kill()
+        gateway_server.close()
+        http_server.close()
+        pending = list(connections) + [generator]
+        for task in pending:
+            task.cancel()
+        await asyncio.gather(*pending, return_exceptions=True)
+        shutil.rmtree(workdir, ignore_errors=True)
+
+    result = summary(stats, window)
+    if args.json:
+        print(json.dumps(result, indent=2))
+    else:
+        latency = result["latency_ms"]
+        print("offered %.1f msg/s (%.1f with links), replied %.1f links/s" %
+              (result["offered_msgs_per_s"], result["link_msgs_per_s"],
+               result["replied_links_per_s"]))
+        print("reply latency ms: p50 %s  p90 %s  p99 %s  p999 %s  max %s" %
+              (latency["p50"], latency["p90"], latency["p99"],
+               latency["p999"], latency.get("max")))
+        print("unanswered %d, served 429s %d, served errors %d, "
+              "resumes %d" % (result["unanswered_links"],
+                              result["served_429"], result["served_errors"],
+                              result["resumes"]))
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description=__doc__.split("\n\n")[0],
+        formatter_class=argparse.ArgumentDefaultsHelpFormatter)
+    parser.add_argument("--muse", help="binary to start against the "
+                        "stand-ins, without it the servers run alone")
+    parser.add_argument("--host", default="127.0.0.1")
+    parser.add_argument("--gateway-port", type=int, default=9443)
+    parser.add_argument("--http-port", type=int, default=9444)
+    parser.add_argument("--cert", help="PEM certificate, generated if unset")
+    parser.add_argument("--key", help="PEM private key for --cert")
+    parser.add_argument("--rate", type=float, default=100,
+                        help="MESSAGE_CREATE events per second, all shards")
+    parser.add_argument("--link-ratio", type=float, default=0.5,
+                        help="share of messages with a music link")
+    # muse admits a few replies per minute per channel and per author, the
+    # rate is spread over enough of both to stay under that
+    parser.add_argument("--channels", type=int, default=1000)
+    parser.add_argument("--authors", type=int, default=5000)
+    parser.add_argument("--lift-limits", action="store_true",
+                        help="lift muse's global REST limit and admission "
+                        "caps, variables already set take precedence")
+    parser.add_argument("--shards", type=int, default=1,
+                        help="shard count GET /gateway/bot recommends")
+    parser.add_argument("--heartbeat-interval-ms", type=int, default=41250)
+    parser.add_argument("--reconnect-every", type=float, default=0,
+                        help="seconds between RECONNECTs, 0 for none")
+    parser.add_argument("--rest-latency-ms", type=float, default=20)
+    parser.add_argument("--songlink-latency-ms", type=float, default=50)
+    parser.add_argument("--jitter-ms", type=float, default=5,
+                        help="uniform +/- jitter on both latencies")
+    parser.add_argument("--rest-429-ratio", type=float, default=0)
+    parser.add_argument("--rest-error-ratio", type=float, default=0)
+    parser.add_argument("--songlink-429-ratio", type=float, default=0)
+    parser.add_argument("--songlink-error-ratio", type=float, default=0)
+    parser.add_argument("--retry-after-ms", type=float, default=100)
+    parser.add_argument("--warmup", type=float, default=3,
+                        help="seconds excluded from the results")
+    parser.add_argument("--duration", type=float, default=30,
+                        help="measured seconds, 0 runs until interrupted")
+    parser.add_argument("--report-every", type=float, default=5)
+    parser.add_argument("--json", action="store_true",
+                        help="print the results as JSON")
+    parser.add_argument("--quiet", action="store_true",
+                        help="discard muse's output")
+    args = parser.parse_args()
+    asyncio.run(run(args))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,246 @@
+#!/usr/bin/env python3
+"""Synthesize a traffic log for REPLAY_FILE from the benchmark corpora.
+
+Writes a recording in muse's RECORD_FILE format: a gateway session (HELLO,
+READY, then MESSAGE_CREATE and other dispatches built from
+bench/corpus/gateway.jsonl and messages.txt) and the HTTP responses the bot
+asks for (GET /gateway/bot, a Songlink lookup per distinct track and the
+reply POSTs). Music links get distinct track ids so lookups miss the link
+cache, and channels and authors are spread out so admission lets most
+replies through.
+
+Records are a millisecond apart unless --spacing-ms spreads them out, which
+only REPLAY_REAL_TIME and SIMULATE honour; SIMULATE=1 replays hours of
+spaced traffic, heartbeats included, in seconds. --reconnect-every drops
+the session now and then (RECONNECT, a RECONNECT during the resume, or a
+non-resumable INVALID_SESSION) and --burst sends that many link messages at
+the same instant and --rate-limited-channels answers replies in some
+channels with 429s, which tools/simulate.py uses to check backoff and the
+REST rate limits.
+
+Usage: tools/mkreplay.py [--messages N] [--spacing-ms MS] corpus_dir out.rec
+"""
+
+import argparse
+import json
+import random
+import re
+import struct
+import urllib.parse
+
+MAGIC = b"MUSEREC1"
+RECORD_WS_FRAME = 1
+RECORD_HTTP_RESPONSE = 2
+DISCORD_EPOCH_MS = 1420070400000
+API_BASE_URL = "https://discord.com/api/v10"
+SONGLINK_API_URL = "https://api.song.link/v1-alpha.1/links?url="
+HEARTBEAT_INTERVAL_MS = 41250
+# muse ignores ACKs it isn't waiting for, so they come often enough to
+# answer heartbeats sent at any point of the interval, well within
+# HEARTBEAT_ACK_GRACE_MS
+ACK_INTERVAL_US = 2000000
+# Replays carry no headers, so these 429s leave the bucket's limit unknown
+RETRY_AFTER_S = 2.5
+
+LINK_RE = re.compile(r"https://open\.spotify\.com/track/[A-Za-z0-9]+|"
+                     r"https://(www\.)?youtube\.com/watch\?v=[A-Za-z0-9_-]+|"
+                     r"https://youtu\.be/[A-Za-z0-9_-]+|"
+                     r"https://music\.youtube\.com/watch\?v=[A-Za-z0-9_-]+|"
+                     r"spotify:track:[A-Za-z0-9]+|"
+                     r"https://music\.apple\.com/\S+|"
+                     r"https://open\.spotify\.com/(album|playlist)/\S+")
+SPOTIFY_TRACK_RE = re.compile(r"(?<=/track/)[A-Za-z0-9]{22}")
+
+
+class Recording:
+    def __init__(self, path, spacing_us):
+        self.out = open(path, "wb")
+        self.out.write(MAGIC)
+        self.spacing_us = spacing_us
+        self.at_us = 0
+
+    def record(self, record_type, payload, spacing_us=None):
+        self.at_us += self.spacing_us if spacing_us is None else spacing_us
+        self.out.write(struct.pack("<QII", self.at_us, record_type,
+                                   len(payload)) + payload)
+
+    def ws_frame(self, obj, stream=0, spacing_us=None):
+        data = json.dumps(obj, separators=(",", ":")).encode()
+        self.record(RECORD_WS_FRAME, struct.pack("<I", stream) + data,
+                    spacing_us)
+
+    def http_response(self, url, status, body, spacing_us=None):
+        encoded = url.encode()
+        self.record(RECORD_HTTP_RESPONSE,
+                    struct.pack("<II", status, len(encoded)) + encoded +
+                    body, spacing_us)
+
+    def close(self):
+        self.out.close()
+
+
+def read_lines(path):
+    with open(path, encoding="utf-8") as f:
+        return [line.rstrip("\r\n") for line in f if line.strip()]
+
+
+def snowflake(n):
+    return str(((1760000000000 - DISCORD_EPOCH_MS) << 22) + n)
+
+
+def hello():
+    return {"op": 10, "s": None, "t": None,
+            "d": {"heartbeat_interval": HEARTBEAT_INTERVAL_MS}}
+
+
+def ready(session_id):
+    return {"op": 0, "t": "READY", "s": 1,
+            "d": {"v": 10, "session_id": session_id,
+                  "resume_gateway_url": "wss://gateway.discord.gg",
+                  "user": {"id": "1", "username": "muse", "bot": True}}}
+
+
+RECONNECT = {"op": 7, "s": None, "t": None, "d": None}
+
+
+def drop_session(rec, kind, seq, sessions):
+    """Emits one way of losing the connection and the frames of the next
+    one, returns the sequence number to go on with."""
+    if kind == 0:
+        # Resumed at once
+        for frame in (RECONNECT, hello()):
+            rec.ws_frame(frame)
+        rec.ws_frame({"op": 0, "t": "RESUMED", "s": seq, "d": {}})
+        return seq + 1
+    if kind == 1:
+        # The second attempt backs off
+        for frame in (RECONNECT, hello(), RECONNECT, hello()):
+            rec.ws_frame(frame)
+        rec.ws_frame({"op": 0, "t": "RESUMED", "s": seq, "d": {}})
+        return seq + 1
+    # A new session after a backoff
+    rec.ws_frame({"op": 9, "s": None, "t": None, "d": False})
+    rec.ws_frame(hello())
+    rec.ws_frame(ready("replay-%d" % sessions))
+    return 2
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    parser.add_argument("--messages", type=int, default=20000)
+    parser.add_argument("--tracks", type=int, default=2000,
+                        help="distinct music links, each looked up once")
+    parser.add_argument("--channels", type=int, default=2000)
+    parser.add_argument("--seed", type=int, default=47)
+    parser.add_argument("--spacing-ms", type=float, default=1,
+                        help="time between records")
+    parser.add_argument("--reconnect-every", type=float, default=0,
+                        help="seconds between dropped sessions, 0 for none")
+    parser.add_argument("--burst", type=int, default=0,
+                        help="link messages sent at once halfway through")
+    parser.add_argument("--rate-limited-channels", type=int, default=0,
+                        help="channels, the last ones, whose replies get 429s "
+                        "without rate limit headers")
+    parser.add_argument("corpus_dir")
+    parser.add_argument("output")
+    args = parser.parse_args()
+    rng = random.Random(args.seed)
+
+    messages = read_lines(args.corpus_dir + "/messages.txt")
+    frames = [json.loads(line)
+              for line in read_lines(args.corpus_dir + "/gateway.jsonl")]
+    songlink = read_lines(args.corpus_dir + "/songlink.jsonl")
+    template = next(f for f in frames if f.get("t") == "MESSAGE_CREATE")
+    others = [f for f in frames if f.get("op") == 0 and
+              f.get("t") != "MESSAGE_CREATE"]
+    chatter = [m for m in messages if not LINK_RE.search(m)]
+    with_links = [m for m in messages if LINK_RE.search(m)]
+
+    rec = Recording(args.output, int(args.spacing_ms * 1000))
+    rec.http_response(API_BASE_URL + "/gateway/bot", 200, json.dumps({
+        "url": "wss://gateway.discord.gg", "shards": 1,
+        "session_start_limit": {"total": 1000, "remaining": 1000,
+                                "reset_after": 0,
+                                "max_concurrency": 1}}).encode())
+    for channel in range(args.channels):
+        channel_id = snowflake(channel)
+        url = "%s/channels/%s/messages" % (API_BASE_URL, channel_id)
+        if channel >= args.channels - args.rate_limited_channels:
+            rec.http_response(url, 429, json.dumps({
+                "message": "You are being rate limited.",
+                "retry_after": RETRY_AFTER_S, "global": False}).encode())
+            continue
+        rec.http_response(url, 200, json.dumps({
+            "id": snowflake(10 ** 6 + channel),
+            "channel_id": channel_id}).encode())
+
+    def link_message(track, spacing_us=None):
+        music_url = "https://open.spotify.com/track/" + track
+        content = LINK_RE.sub(music_url, rng.choice(with_links), count=1)
+        if music_url not in looked_up:
+            looked_up.add(music_url)
+            body = SPOTIFY_TRACK_RE.sub(track, rng.choice(songlink))
+            # muse looks up the link as matched, without the scheme
+            matched = music_url[len("https://"):]
+            rec.http_response(
+                SONGLINK_API_URL + urllib.parse.quote(matched, safe=""),
+                200, body.encode(), spacing_us)
+        return content
+
+    def message_create(n, content, channel, seq, spacing_us=None):
+        data = dict(template["d"])
+        data.update({"id": snowflake(n), "content": content,
+                     "channel_id": snowflake(channel),
+                     "author": dict(template["d"]["author"],
+                                    id=snowflake(10 ** 7 + n))})
+        rec.ws_frame({"op": 0, "t": "MESSAGE_CREATE", "s": seq, "d": data},
+                     spacing_us=spacing_us)
+
+    looked_up = set()
+    rec.ws_frame(hello())
+    rec.ws_frame(ready("replay"))
+    seq = 2
+    sessions = 1
+    next_ack_us = rec.at_us + ACK_INTERVAL_US
+    reconnect_us = int(args.reconnect_every * 1000000)
+    next_reconnect_us = rec.at_us + reconnect_us
+    for n in range(args.messages):
+        # For the heartbeats a spaced out replay lives long enough to send,
+        # at the time of the last record so they don't stretch the replay
+        if rec.at_us >= next_ack_us:
+            rec.ws_frame({"op": 11, "s": None, "t": None, "d": None},
+                         spacing_us=0)
+            next_ack_us = rec.at_us + ACK_INTERVAL_US
+
+        if reconnect_us and rec.at_us >= next_reconnect_us:
+            seq = drop_session(rec, sessions % 3, seq, sessions)
+            sessions += 1
+            next_reconnect_us = rec.at_us + reconnect_us
+
+        if args.burst and n == args.messages // 2:
+            # Lookups first and at the same instant, their records would
+            # spread the burst out
+            contents = [link_message("b%021d" % i, 0)
+                        for i in range(args.burst)]
+            for i, content in enumerate(contents):
+                message_create(10 ** 6 + i, content, i % args.channels, seq,
+                               spacing_us=0 if i else None)
+                seq += 1
+
+        if others and n % 10 == 9:
+            frame = dict(rng.choice(others), s=seq)
+            rec.ws_frame(frame)
+            seq += 1
+            continue
+
+        if rng.random() < 0.3:
+            content = link_message("%022d" % (n % args.tracks))
+        else:
+            content = rng.choice(chatter)
+        message_create(n, content, n % args.channels, seq)
+        seq += 1
+    rec.close()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,90 @@
+#!/bin/sh
+# Profile-guided, link-time optimized release build, run by `make release-pgo`
+# with CC, CFLAGS, LDFLAGS, SRC and OUT from the Makefile.
+#
+# 1. Builds the plain release binary, the baseline
+# 2. Builds an instrumented binary and trains it on a replay, in the inline,
+#    pipeline and multi-worker modes
+# 3. Rebuilds with the profile and LTO into $OUT
+# 4. Replays the workload PGO_RUNS times on both and reports the speedup of
+#    the median times
+#
+# The workload is synthesized from bench/corpus unless PGO_REPLAY names a
+# RECORD_FILE capture.
+
+set -eu
+
+PGO_DIR=${PGO_DIR:-.pgo}
+PGO_RUNS=${PGO_RUNS:-9}
+RELEASE_FLAGS="-O2 -DNDEBUG"
+
+rm -rf "$PGO_DIR"
+mkdir -p "$PGO_DIR/profile"
+PROFILE_DIR=$(cd "$PGO_DIR/profile" && pwd)
+
+REPLAY=${PGO_REPLAY:-}
+if [ -z "$REPLAY" ]; then
+    REPLAY="$PGO_DIR/training.rec"
+    echo "Synthesizing the training replay"
+    python3 tools/mkreplay.py bench/corpus "$REPLAY"
+fi
+
+# gcc names profiles after the output file, so the instrumented and the
+# optimized build must be written to the same path
+build() {
+    # shellcheck disable=SC2086
+    $CC $CFLAGS $RELEASE_FLAGS "$@" $SRC -o "$PGO_DIR/muse" $LDFLAGS
+}
+
+# Prints how long binary took to replay the workload, in milliseconds
+replay() {
+    binary=$1
+    shift
+    env "$@" TOKEN=pgo LOG_LEVEL=info REPLAY_FILE="$REPLAY" "$binary" \
+        2>/dev/null |
+        sed -n 's/.*Replayed [0-9]* frame(s) in \([0-9]*\) ms.*/\1/p'
+}
+
+median() {
+    sort -n "$1" | awk '{ ms[NR] = $1 } END { print ms[int((NR + 1) / 2)] }'
+}
+
+echo "Building release"
+build
+cp "$PGO_DIR/muse" "$PGO_DIR/muse-release"
+
+echo "Building instrumented"
+build -fprofile-generate -fprofile-update=atomic \
+    -fprofile-dir="$PROFILE_DIR"
+
+echo "Training"
+for mode in "" PIPELINE_THREADS=2 WORKER_COUNT=2; do
+    # shellcheck disable=SC2086
+    ms=$(replay "$PGO_DIR/muse" $mode)
+    echo "  ${mode:-inline}: ${ms:-?} ms"
+done
+
+echo "Building with the profile and LTO"
+build -fprofile-use -fprofile-partial-training -fprofile-dir="$PROFILE_DIR" \
+    -Wno-missing-profile -flto=auto
+cp "$PGO_DIR/muse" "$OUT"
+
+# Alternating runs, so drift on the machine hits both builds alike
+echo "Comparing over $PGO_RUNS replays each"
+: >"$PGO_DIR/release.ms"
+: >"$PGO_DIR/pgo.ms"
+i=0
+while [ "$i" -lt "$PGO_RUNS" ]; do
+    replay "$PGO_DIR/muse-release" >>"$PGO_DIR/release.ms"
+    replay "$PGO_DIR/muse" >>"$PGO_DIR/pgo.ms"
+    i=$((i + 1))
+done
+release_ms=$(median "$PGO_DIR/release.ms")
+pgo_ms=$(median "$PGO_DIR/pgo.ms")
+
+awk -v release="$release_ms" -v pgo="$pgo_ms" 'BEGIN {
+    printf "release: %d ms, release-pgo: %d ms", release, pgo
+    if (pgo > 0)
+        printf ", speedup %.2fx", release / pgo
+    printf "\n"
+}'
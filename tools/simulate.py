@@ -0,0 +1,299 @@
+#!/usr/bin/env python3
+"""Check muse's timers against hours of traffic replayed on a virtual clock.
+
+Synthesizes a capture with tools/mkreplay.py (spaced out messages, dropped
+sessions and a burst of replies), replays it with SIMULATE=1 and reads the
+event times back from the log, which a simulation stamps with virtual time.
+Fails unless:
+  - heartbeats go out every heartbeat interval of their connection
+  - every reconnect waits what it announced, within its backoff ceiling
+  - REST sends stay within the global limit per window, and the burst
+    fills one
+  - replies answered with 429s that carry no rate limit headers are retried
+    after retry_after until they are dropped
+  - a link is looked up again only once its cache entry is past the TTL
+
+Limits are read from the headers, so they follow the code. Environment
+variables such as WORKER_COUNT or PIPELINE_THREADS pass through to muse.
+
+Usage: tools/simulate.py [--muse ./muse] [--keep capture.rec]
+"""
+
+import argparse
+import datetime
+import os
+import re
+import subprocess
+import sys
+import tempfile
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+
+LINE_RE = re.compile(r"^(\S+)Z (\w+) +(\w+): (.*)$")
+HELLO_RE = re.compile(r"Shard (\d+): Received HELLO, heartbeat interval: "
+                      r"(\d+) ms")
+HEARTBEAT_RE = re.compile(r"Shard (\d+): Sent HEARTBEAT")
+CLOSED_RE = re.compile(r"Shard (\d+): WebSocket closed with (-?\d+) "
+                       r"\(.*\), reconnecting in (\d+) ms")
+RECONNECTING_RE = re.compile(r"Shard (\d+): Transport down\. Reconnecting")
+ESTABLISHED_RE = re.compile(r"Shard (\d+): (READY|RESUMED)")
+ZOMBIE_RE = re.compile(r"Shard (\d+): Heartbeat not acknowledged")
+REST_SEND_RE = re.compile(r"Sending REST POST to (\S+)")
+REST_RETRY_RE = re.compile(r"REST request to (\S+) rate limited, retrying "
+                           r"in (\d+) ms")
+REST_DROPPED_RE = re.compile(r"REST request to (\S+) dropped after")
+DETECTED_RE = re.compile(r"Detected music link '([^']*)'")
+LOOKUP_RE = re.compile(r"Looking up '([^']*)'")
+DEFINE_RE = re.compile(r"^#define (\w+) \(([0-9L *+]+)\)", re.M)
+
+
+def read_defines(*headers):
+    defines = {}
+    for header in headers:
+        with open(os.path.join(ROOT, header), encoding="utf-8") as f:
+            for name, value in DEFINE_RE.findall(f.read()):
+                defines[name] = eval(value.replace("L", ""), {}, {})
+    return defines
+
+
+def parse_log(text):
+    """Returns (ms, message) per log line, ms on the virtual clock."""
+    events = []
+    for line in text.splitlines():
+        match = LINE_RE.match(line)
+        if not match:
+            continue
+        stamp = datetime.datetime.strptime(match.group(1),
+                                           "%Y-%m-%dT%H:%M:%S.%f")
+        ms = int(stamp.replace(tzinfo=datetime.timezone.utc).timestamp() *
+                 1000 + 0.5)
+        events.append((ms, match.group(4)))
+    # Stable, lines logged in the same millisecond keep their order
+    events.sort(key=lambda event: event[0])
+    return events
+
+
+class Checks:
+    def __init__(self, defines):
+        self.defines = defines
+        # A timer fires on the first loop tick at or after its deadline
+        self.slack_ms = defines["POLL_TIMEOUT_MS"] + 10
+        self.failed = False
+
+    def report(self, name, ok, detail):
+        print("%-4s %-10s %s" % ("ok" if ok else "FAIL", name, detail))
+        self.failed |= not ok
+
+    def heartbeats(self, events):
+        interval = {}
+        last_sent = {}
+        gaps = []
+        bad = []
+        for ms, message in events:
+            match = HELLO_RE.search(message)
+            if match:
+                interval[match.group(1)] = int(match.group(2))
+                last_sent.pop(match.group(1), None)
+                continue
+            match = CLOSED_RE.search(message)
+            if match:
+                last_sent.pop(match.group(1), None)
+                continue
+            match = HEARTBEAT_RE.search(message)
+            if not match:
+                continue
+            shard = match.group(1)
+            if shard in last_sent:
+                gap = ms - last_sent[shard]
+                gaps.append(gap)
+                if not 0 <= gap - interval[shard] <= self.slack_ms:
+                    bad.append((ms, gap))
+            last_sent[shard] = ms
+        zombies = sum(1 for _, message in events if ZOMBIE_RE.search(message))
+        self.report("heartbeat", gaps and not bad and not zombies,
+                    "%d intervals, %d off (%s), %d missed ACKs" %
+                    (len(gaps), len(bad), bad[:3], zombies))
+
+    def backoff(self, events):
+        base = self.defines["RECONNECT_BACKOFF_BASE_MS"]
+        ceiling = self.defines["RECONNECT_BACKOFF_MAX_MS"]
+        attempts = {}
+        pending = {}
+        waits = []
+        bad = []
+        for ms, message in events:
+            match = ESTABLISHED_RE.search(message)
+            if match:
+                attempts[match.group(1)] = 0
+                continue
+            match = CLOSED_RE.search(message)
+            if match:
+                shard = match.group(1)
+                attempt = attempts.get(shard, 0)
+                wait = int(match.group(3))
+                limit = min(ceiling, base << attempt) if attempt < 16 \
+                    else ceiling
+                if wait > limit:
+                    bad.append((ms, "waits %d ms on attempt %d" %
+                                (wait, attempt)))
+                attempts[shard] = attempt + 1
+                pending[shard] = (ms + wait, attempt)
+                continue
+            match = RECONNECTING_RE.search(message)
+            if match and match.group(1) in pending:
+                due, attempt = pending.pop(match.group(1))
+                waits.append((attempt, ms - due))
+                if not 0 <= ms - due <= self.slack_ms:
+                    bad.append((ms, "reconnected %d ms off" % (ms - due)))
+        retried = sum(1 for attempt, _ in waits if attempt > 0)
+        self.report("backoff", waits and retried and not bad and not pending,
+                    "%d reconnects, %d after a failed attempt, %d off (%s)" %
+                    (len(waits), retried, len(bad), bad[:3]))
+
+    def rest_window(self, events):
+        limit = self.defines["REST_GLOBAL_LIMIT_PER_SEC"]
+        window_ms = None
+        count = 0
+        fullest = 0
+        sends = 0
+        for ms, message in events:
+            if not REST_SEND_RE.search(message):
+                continue
+            sends += 1
+            if window_ms is None or ms - window_ms >= 1000:
+                window_ms = ms
+                count = 0
+            count += 1
+            fullest = max(fullest, count)
+        self.report("rest", sends and fullest == limit,
+                    "%d sends, at most %d of %d per window" %
+                    (sends, fullest, limit))
+
+    def rest_retries(self, events):
+        pending = {}
+        retries = drops = 0
+        bad = []
+        for ms, message in events:
+            match = REST_RETRY_RE.search(message)
+            if match:
+                pending[match.group(1)] = ms + int(match.group(2))
+                retries += 1
+                continue
+            match = REST_DROPPED_RE.search(message)
+            if match:
+                drops += 1
+                continue
+            match = REST_SEND_RE.search(message)
+            if match and match.group(1) in pending:
+                due = pending.pop(match.group(1))
+                if not 0 <= ms - due <= self.slack_ms:
+                    bad.append((ms, match.group(1), ms - due))
+        # The replay may end while the last retries wait
+        ended = events[-1][0]
+        lost = [url for url, due in pending.items() if due + self.slack_ms <
+                ended]
+        self.report("retry", retries and drops and not bad and not lost,
+                    "%d retries, %d dropped, %d off (%s), %d never sent" %
+                    (retries, drops, len(bad), bad[:3], len(lost)))
+
+    def link_cache(self, events):
+        ttl = self.defines["LINK_CACHE_TTL_MS"]
+        looked_up = {}
+        waiting = {}
+        hits = expired = 0
+        bad = []
+
+        def settle(url):
+            # A detection not followed by a lookup was answered from cache
+            detected, expect = waiting.pop(url)
+            if expect:
+                bad.append((detected, url, "not looked up"))
+
+        for ms, message in events:
+            match = DETECTED_RE.search(message)
+            if match:
+                url = match.group(1)
+                if url in waiting:
+                    settle(url)
+                last = looked_up.get(url)
+                age = None if last is None else ms - last
+                expect = age is None or age >= ttl
+                if age is not None and abs(age - ttl) <= self.slack_ms:
+                    expect = None
+                waiting[url] = (ms, expect)
+                if expect is False:
+                    hits += 1
+                continue
+            match = LOOKUP_RE.search(message)
+            if match:
+                url = match.group(1)
+                detected, expect = waiting.pop(url, (ms, None))
+                if expect is False:
+                    bad.append((ms, url, "looked up %d ms after the last" %
+                                (ms - looked_up[url])))
+                if url in looked_up and expect:
+                    expired += 1
+                looked_up[url] = ms
+        for url in list(waiting):
+            settle(url)
+        self.report("cache", hits and expired and not bad,
+                    "%d links, %d cache hits, %d looked up again after the "
+                    "TTL, %d wrong (%s)" %
+                    (len(looked_up), hits, expired, len(bad), bad[:3]))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    parser.add_argument("--muse", default=os.path.join(ROOT, "muse"))
+    parser.add_argument("--messages", type=int, default=12000)
+    parser.add_argument("--spacing-ms", type=float, default=2000)
+    parser.add_argument("--tracks", type=int, default=50)
+    parser.add_argument("--reconnect-every", type=float, default=1800)
+    parser.add_argument("--burst", type=int, default=80)
+    parser.add_argument("--rate-limited-channels", type=int, default=20)
+    parser.add_argument("--timeout", type=float, default=300,
+                        help="real seconds the simulation may take")
+    parser.add_argument("--keep", help="write the capture here")
+    args = parser.parse_args()
+
+    defines = read_defines("bot.h", "links.h")
+    with tempfile.TemporaryDirectory() as tmp:
+        capture = args.keep or os.path.join(tmp, "simulate.rec")
+        subprocess.run([sys.executable,
+                        os.path.join(ROOT, "tools", "mkreplay.py"),
+                        "--messages", str(args.messages),
+                        "--spacing-ms", str(args.spacing_ms),
+                        "--tracks", str(args.tracks),
+                        "--reconnect-every", str(args.reconnect_every),
+                        "--burst", str(args.burst),
+                        "--rate-limited-channels",
+                        str(args.rate_limited_channels),
+                        os.path.join(ROOT, "bench", "corpus"), capture],
+                       check=True)
+        env = dict(os.environ, SIMULATE="1", REPLAY_FILE=capture,
+                   TOKEN=os.environ.get("TOKEN", "simulate"),
+                   LOG_LEVEL="debug")
+        # Warnings go to stderr, parse_log merges the two by time
+        result = subprocess.run([args.muse], env=env, capture_output=True,
+                                text=True, timeout=args.timeout)
+
+    events = parse_log(result.stdout + result.stderr)
+    summary = [m for _, m in events if m.startswith("Simulated ")]
+    if result.returncode != 0 or not summary:
+        sys.stdout.write(result.stdout[-4000:] + result.stderr[-4000:])
+        print("FAIL muse exited with %d before finishing the replay" %
+              result.returncode)
+        sys.exit(1)
+    print(summary[0])
+
+    checks = Checks(defines)
+    checks.heartbeats(events)
+    checks.backoff(events)
+    checks.rest_window(events)
+    checks.rest_retries(events)
+    checks.link_cache(events)
+    sys.exit(1 if checks.failed else 0)
+
+
+if __name__ == "__main__":
+    main()
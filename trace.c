@@ -0,0 +1,133 @@
+#include "trace.h"
+#include "clock.h"
+#include "log.h"
+#include "metrics.h"
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// https://discord.com/developers/docs/reference#snowflakes
+#define DISCORD_EPOCH_MS (1420070400000ULL)
+
+static const char *stage_names[TRACE_STAGE_COUNT] = {
+    "received", "matched", "fetched", "parsed",
+    "serialized", "sent", "posted",
+};
+
+// Indexed by the stage that ends the span
+static Metric stage_us[TRACE_STAGE_COUNT] = {
+    [TRACE_MATCHED] = METRIC_SUMMARY_INIT(
+        "muse_trace_match_us",
+        "Microseconds from a gateway frame to its music link match",
+        METRICS_SPAN_US_BOUNDS),
+    [TRACE_FETCHED] = METRIC_SUMMARY_INIT(
+        "muse_trace_fetch_us",
+        "Microseconds from a match to its Songlink or cache answer",
+        METRICS_SPAN_US_BOUNDS),
+    [TRACE_PARSED] = METRIC_SUMMARY_INIT(
+        "muse_trace_parse_us",
+        "Microseconds from a Songlink answer to its parsed links",
+        METRICS_SPAN_US_BOUNDS),
+    [TRACE_SERIALIZED] = METRIC_SUMMARY_INIT(
+        "muse_trace_serialize_us",
+        "Microseconds from parsed links to the serialized reply, "
+        "coalescing included",
+        METRICS_SPAN_US_BOUNDS),
+    [TRACE_SENT] = METRIC_SUMMARY_INIT(
+        "muse_trace_send_us",
+        "Microseconds from a serialized reply to its POST, rate limiting "
+        "included",
+        METRICS_SPAN_US_BOUNDS),
+    [TRACE_POSTED] = METRIC_SUMMARY_INIT(
+        "muse_trace_post_us",
+        "Microseconds from a reply's POST to Discord's response",
+        METRICS_SPAN_US_BOUNDS),
+};
+static Metric trace_total_us = METRIC_SUMMARY_INIT(
+    "muse_trace_total_us",
+    "Microseconds from a gateway frame to its posted reply",
+    METRICS_SPAN_US_BOUNDS);
+static Metric trace_origin_us = METRIC_SUMMARY_INIT(
+    "muse_trace_origin_us",
+    "Microseconds from a message's snowflake time to its posted reply, "
+    "subject to clock skew with Discord",
+    METRICS_SPAN_US_BOUNDS);
+
+static atomic_uint sample_every;
+static atomic_uint sample_counter;
+
+static uint64_t unix_now_ms(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+void trace_set_sample_every(uint32_t every) {
+    atomic_store_explicit(&sample_every, every, memory_order_relaxed);
+}
+
+void trace_start(TraceContext *trace, const char *message_id,
+                 uint64_t received_us) {
+    uint32_t every =
+        atomic_load_explicit(&sample_every, memory_order_relaxed);
+
+    *trace = (TraceContext){0};
+    trace->message_id = message_id ? strtoull(message_id, NULL, 10) : 0;
+    if (trace->message_id != 0)
+        trace->origin_unix_ms = (trace->message_id >> 22) + DISCORD_EPOCH_MS;
+    trace->stage_us[TRACE_RECEIVED] = received_us;
+    if (every > 0) {
+        uint32_t n = atomic_fetch_add_explicit(&sample_counter, 1,
+                                               memory_order_relaxed);
+        trace->sampled = n % every == 0;
+    }
+}
+
+void trace_mark(TraceContext *trace, TraceStage stage) {
+    trace->stage_us[stage] = clock_now_us();
+}
+
+void trace_finish(TraceContext *trace) {
+    char line[LOG_MAX_MESSAGE];
+    int length = 0;
+    uint64_t previous_us = trace->stage_us[TRACE_RECEIVED];
+
+    if (previous_us == 0)
+        return;
+
+    for (int32_t i = TRACE_RECEIVED + 1; i < TRACE_STAGE_COUNT; i++) {
+        uint64_t at_us = trace->stage_us[i];
+        if (at_us == 0)
+            continue;
+        metric_observe(&stage_us[i], (int64_t)(at_us - previous_us));
+        if (trace->sampled && length >= 0 && (size_t)length < sizeof(line)) {
+            length += snprintf(line + length, sizeof(line) - (size_t)length,
+                               " %s=+%lluus", stage_names[i],
+                               (unsigned long long)(at_us - previous_us));
+        }
+        previous_us = at_us;
+    }
+
+    uint64_t posted_us = trace->stage_us[TRACE_POSTED];
+    if (posted_us == 0)
+        goto log;
+    metric_observe(&trace_total_us,
+                   (int64_t)(posted_us - trace->stage_us[TRACE_RECEIVED]));
+    if (trace->origin_unix_ms != 0) {
+        uint64_t now_ms = unix_now_ms();
+        // Our clock may be behind Discord's
+        if (now_ms > trace->origin_unix_ms) {
+            metric_observe(&trace_origin_us,
+                           (int64_t)(now_ms - trace->origin_unix_ms) * 1000);
+        }
+    }
+
+log:
+    if (trace->sampled) {
+        log_info(LOG_LINKS, "Trace of message %llu:%s",
+                 (unsigned long long)trace->message_id,
+                 length > 0 ? line : " no stages");
+    }
+}
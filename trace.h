@@ -0,0 +1,47 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Stages of a music link reply, in the order they happen
+typedef enum {
+    // The frame was read off the gateway websocket
+    TRACE_RECEIVED,
+    // The MESSAGE_CREATE handler found a link
+    TRACE_MATCHED,
+    // Songlink answered, or the cache did
+    TRACE_FETCHED,
+    // The answer is parsed and waits for the reply
+    TRACE_PARSED,
+    // The reply body is serialized, after any coalescing window
+    TRACE_SERIALIZED,
+    // The POST went out, after the rate limiter
+    TRACE_SENT,
+    // Discord accepted the reply
+    TRACE_POSTED,
+    TRACE_STAGE_COUNT,
+} TraceStage;
+
+// Follows one message from its gateway frame to the posted reply. Copied by
+// value between the contexts it passes through.
+typedef struct {
+    uint64_t message_id;
+    // Discord's creation time of the message from its snowflake, Unix ms
+    uint64_t origin_unix_ms;
+    // clock_now_us at each stage, 0 until it is reached
+    uint64_t stage_us[TRACE_STAGE_COUNT];
+    // Logged in full by trace_finish
+    bool sampled;
+} TraceContext;
+
+// Logs 1 in every sample_every finished traces, 0 logs none
+void trace_set_sample_every(uint32_t sample_every);
+// received_us is when the frame carrying the message was read
+void trace_start(TraceContext *trace, const char *message_id,
+                 uint64_t received_us);
+void trace_mark(TraceContext *trace, TraceStage stage);
+// Observes the time spent between consecutive stages that were reached
+void trace_finish(TraceContext *trace);
+
+#endif // TRACE_H
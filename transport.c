@@ -1,38 +1,32 @@
 #include "transport.h"
+#include "alloc.h"
+#include "buffer.h"
+#include "clock.h"
+#include "log.h"
+#include "metrics.h"
+#include "recording.h"
+#include "stall.h"
 
 #include <errno.h>
+#include <stdatomic.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/epoll.h>
-
-#define BUFFER_DEFAULT_CAPACITY (16384)
-
-#define buffer_append(buffer, chunk, chunk_size)                               \
-    do {                                                                       \
-        if ((buffer)->length + chunk_size > (buffer)->capacity) {              \
-            size_t new_capacity = (buffer)->capacity == 0                      \
-                                      ? BUFFER_DEFAULT_CAPACITY                \
-                                      : (buffer)->capacity;                    \
-            while ((buffer)->length + chunk_size > new_capacity) {             \
-                new_capacity *= 2;                                             \
-            }                                                                  \
-            uint8_t *ptr = realloc((buffer)->data, new_capacity);              \
-            if (!ptr) {                                                        \
-                fprintf(stderr, "error: out of memory");                       \
-                exit(1);                                                       \
-            }                                                                  \
-            (buffer)->data = ptr;                                              \
-            (buffer)->capacity = new_capacity;                                 \
-        }                                                                      \
-        memcpy(&((buffer)->data[(buffer)->length]), chunk, chunk_size);        \
-        (buffer)->length += chunk_size;                                        \
-    } while (0);
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
 
 #define CURLOPT_CONNECT_ONLY_HEADERS (2L)
 
-typedef struct {
+struct SocketContext {
     curl_socket_t sockfd;
-} SocketContext;
+    // Set for a websocket's socket, which we poll instead of curl
+    MuseWebSocket *ws;
+    // Set for sockets watched with transport_watch_socket
+    SocketCallback on_ready;
+    void *user_data;
+};
 
 typedef struct {
     uint8_t *data;
@@ -42,8 +36,100 @@ typedef struct {
     HTTPCallback on_done;
     void *user_data;
     uint8_t *request_body;
+    // Kept while recording, responses are recorded under the requested URL
+    char *url;
 } RequestContext;
 
+// A request answered from a replay's fixtures instead of the network
+typedef struct ReplayResponse {
+    struct ReplayResponse *next;
+    const ReplayFixture *fixture;
+    HTTPCallback on_done;
+    void *user_data;
+} ReplayResponse;
+
+// Frames delivered to each replayed websocket per poll, so responses and
+// timers still run between them
+#define REPLAY_FRAMES_PER_POLL (64)
+
+static atomic_uint next_stream;
+
+static Metric http_in_flight = METRIC_GAUGE_INIT(
+    "muse_http_requests_in_flight", "HTTP requests started but not done");
+static Metric http_requests_total = METRIC_COUNTER_INIT(
+    "muse_http_requests_total", "HTTP requests completed, including failures");
+static Metric http_failures_total = METRIC_COUNTER_INIT(
+    "muse_http_failures_total", "HTTP requests that failed without a response");
+static Metric http_bytes_sent_total = METRIC_COUNTER_INIT(
+    "muse_http_bytes_sent_total", "HTTP request bytes sent, headers included");
+static Metric http_bytes_received_total =
+    METRIC_COUNTER_INIT("muse_http_bytes_received_total",
+                        "HTTP response bytes received, headers included");
+static Metric http_dns_ms = METRIC_HISTOGRAM_INIT(
+    "muse_http_dns_ms", "Name resolution time of new HTTP connections",
+    METRICS_LATENCY_MS_BOUNDS);
+static Metric http_connect_ms = METRIC_HISTOGRAM_INIT(
+    "muse_http_connect_ms", "TCP connect time of new HTTP connections",
+    METRICS_LATENCY_MS_BOUNDS);
+static Metric http_tls_ms = METRIC_HISTOGRAM_INIT(
+    "muse_http_tls_ms", "TLS handshake time of new HTTP connections",
+    METRICS_LATENCY_MS_BOUNDS);
+static Metric http_ttfb_ms = METRIC_HISTOGRAM_INIT(
+    "muse_http_ttfb_ms",
+    "Time from sending an HTTP request to the first response byte",
+    METRICS_LATENCY_MS_BOUNDS);
+static Metric http_total_ms = METRIC_HISTOGRAM_INIT(
+    "muse_http_total_ms", "Total HTTP request time, redirects included",
+    METRICS_LATENCY_MS_BOUNDS);
+static Metric ws_bytes_sent_total = METRIC_COUNTER_INIT(
+    "muse_ws_bytes_sent_total", "WebSocket payload bytes sent");
+static Metric ws_bytes_received_total = METRIC_COUNTER_INIT(
+    "muse_ws_bytes_received_total", "WebSocket payload bytes received");
+
+// Phases of a request from curl's cumulative timers, in microseconds
+// https://curl.se/libcurl/c/curl_easy_getinfo.html#TIMES
+static void http_record_response(CURL *easy, CURLcode result) {
+    curl_off_t namelookup = 0, connect = 0, appconnect = 0, pretransfer = 0,
+               starttransfer = 0, total = 0, uploaded = 0, downloaded = 0;
+    long header_size = 0, request_size = 0, connects = 0;
+
+    curl_easy_getinfo(easy, CURLINFO_NAMELOOKUP_TIME_T, &namelookup);
+    curl_easy_getinfo(easy, CURLINFO_CONNECT_TIME_T, &connect);
+    curl_easy_getinfo(easy, CURLINFO_APPCONNECT_TIME_T, &appconnect);
+    curl_easy_getinfo(easy, CURLINFO_PRETRANSFER_TIME_T, &pretransfer);
+    curl_easy_getinfo(easy, CURLINFO_STARTTRANSFER_TIME_T, &starttransfer);
+    curl_easy_getinfo(easy, CURLINFO_TOTAL_TIME_T, &total);
+    curl_easy_getinfo(easy, CURLINFO_SIZE_UPLOAD_T, &uploaded);
+    curl_easy_getinfo(easy, CURLINFO_SIZE_DOWNLOAD_T, &downloaded);
+    curl_easy_getinfo(easy, CURLINFO_HEADER_SIZE, &header_size);
+    curl_easy_getinfo(easy, CURLINFO_REQUEST_SIZE, &request_size);
+    curl_easy_getinfo(easy, CURLINFO_NUM_CONNECTS, &connects);
+
+    metric_add(&http_in_flight, -1);
+    metric_add(&http_requests_total, 1);
+    if (result != CURLE_OK)
+        metric_add(&http_failures_total, 1);
+    metric_add(&http_bytes_sent_total, (int64_t)(request_size + uploaded));
+    metric_add(&http_bytes_received_total,
+               (int64_t)(header_size + downloaded));
+
+    // A reused connection has no connect phases
+    if (connects > 0 && connect > 0) {
+        metric_observe(&http_dns_ms, (int64_t)(namelookup / 1000));
+        metric_observe(&http_connect_ms,
+                       (int64_t)((connect - namelookup) / 1000));
+        if (appconnect > 0) {
+            metric_observe(&http_tls_ms,
+                           (int64_t)((appconnect - connect) / 1000));
+        }
+    }
+    if (starttransfer > 0) {
+        metric_observe(&http_ttfb_ms,
+                       (int64_t)((starttransfer - pretransfer) / 1000));
+    }
+    metric_observe(&http_total_ms, (int64_t)(total / 1000));
+}
+
 static int timer_callback(CURLM *multi, long timeout_ms, void *userp) {
     (void)multi;
 
@@ -63,13 +149,13 @@ int socket_callback(CURL *curl, curl_socket_t socket, int action, void *userp,
     if (action == CURL_POLL_REMOVE) {
         if (ctx) {
             epoll_ctl(ts->epfd, EPOLL_CTL_DEL, socket, NULL);
-            free(ctx);
+            alloc_free(ctx);
         }
         return 0;
     }
 
     if (!ctx) {
-        ctx = calloc(1, sizeof(*ctx));
+        ctx = alloc_calloc(ALLOC_TRANSPORT, 1, sizeof(*ctx));
         ctx->sockfd = socket;
         curl_multi_assign(ts->multi, socket, ctx);
     }
@@ -89,9 +175,94 @@ int socket_callback(CURL *curl, curl_socket_t socket, int action, void *userp,
 static void request_free(RequestContext *ctx) {
     if (ctx->headers)
         curl_slist_free_all(ctx->headers);
-    free(ctx->data);
-    free(ctx->request_body);
-    free(ctx);
+    alloc_free(ctx->data);
+    alloc_free(ctx->url);
+    alloc_free(ctx->request_body);
+    alloc_free(ctx);
+}
+
+static MuseWebSocket *find_websocket(MuseTransport *ts, CURL *easy) {
+    for (MuseWebSocket *ws = ts->websockets; ws; ws = ws->next) {
+        if (ws->easy == easy)
+            return ws;
+    }
+    return NULL;
+}
+
+// Frames that arrive after the handshake wake the poll like any other
+// socket, they would otherwise wait for the poll timeout
+static void ws_watch_socket(MuseWebSocket *ws) {
+    curl_socket_t sockfd;
+
+    if (curl_easy_getinfo(ws->easy, CURLINFO_ACTIVESOCKET, &sockfd) !=
+            CURLE_OK ||
+        sockfd == CURL_SOCKET_BAD)
+        return;
+
+    SocketContext *ctx = alloc_calloc(ALLOC_TRANSPORT, 1, sizeof(*ctx));
+    if (!ctx) {
+        fprintf(stderr, "error: out of memory");
+        exit(1);
+    }
+    ctx->sockfd = sockfd;
+    ctx->ws = ws;
+
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = ctx};
+    if (epoll_ctl(ws->ts->epfd, EPOLL_CTL_ADD, sockfd, &ev) == -1 &&
+        errno == EEXIST) {
+        epoll_ctl(ws->ts->epfd, EPOLL_CTL_MOD, sockfd, &ev);
+    }
+    ws->poll_context = ctx;
+}
+
+// Before curl closes the socket
+static void ws_unwatch_socket(MuseWebSocket *ws) {
+    SocketContext *ctx = (SocketContext *)ws->poll_context;
+    if (!ctx)
+        return;
+
+    epoll_ctl(ws->ts->epfd, EPOLL_CTL_DEL, ctx->sockfd, NULL);
+    alloc_free(ctx);
+    ws->poll_context = NULL;
+}
+
+// Tears the connection down without sending a close frame
+static void ws_disconnect(MuseWebSocket *ws, int32_t code,
+                          const char *reason) {
+    ws_unwatch_socket(ws);
+    if (ws->easy) {
+        curl_multi_remove_handle(ws->ts->multi, ws->easy);
+        curl_easy_cleanup(ws->easy);
+        ws->easy = NULL;
+    }
+    ws->replaying = false;
+    ws->handshake_done = false;
+    ws->on_connect_fired = false;
+    ws->current_message.length = 0;
+
+    if (ws->callbacks.on_disconnect) {
+        STALL_CALL("ws disconnect", ws->callbacks.on_disconnect, ws, code,
+                   reason ? reason : "");
+    }
+}
+
+static void ws_send_close_frame(MuseWebSocket *ws, int32_t code,
+                                const char *reason) {
+    uint8_t payload[2 + WS_MAX_CLOSE_REASON];
+    size_t length = 2;
+    size_t sent;
+
+    payload[0] = (uint8_t)(code >> 8);
+    payload[1] = (uint8_t)code;
+    if (reason) {
+        size_t reason_length = strlen(reason);
+        if (reason_length > WS_MAX_CLOSE_REASON)
+            reason_length = WS_MAX_CLOSE_REASON;
+        memcpy(payload + 2, reason, reason_length);
+        length += reason_length;
+    }
+
+    curl_ws_send(ws->easy, payload, length, &sent, 0, CURLWS_CLOSE);
 }
 
 static void handle_multi_messages(MuseTransport *ts) {
@@ -100,15 +271,18 @@ static void handle_multi_messages(MuseTransport *ts) {
 
     while ((msg = curl_multi_info_read(ts->multi, &pending))) {
         if (msg->msg == CURLMSG_DONE) {
+            MuseWebSocket *ws = find_websocket(ts, msg->easy_handle);
 
             // Handle websocket
-            if (msg->easy_handle == ts->ws_easy) {
+            if (ws) {
                 if (msg->data.result == CURLE_OK) {
-                    ts->ws_handshake_done = true;
+                    ws->handshake_done = true;
+                    ws_watch_socket(ws);
                 } else {
-                    fprintf(stderr, "WebSocket Disconnected/Error: %d\n",
-                            msg->data.result);
-                    transport_ws_close(ts);
+                    log_warn(LOG_TRANSPORT, "WebSocket Disconnected/Error: %d",
+                             msg->data.result);
+                    ws_disconnect(ws, WS_CLOSE_ABNORMAL,
+                                  curl_easy_strerror(msg->data.result));
                 }
             }
 
@@ -117,17 +291,24 @@ static void handle_multi_messages(MuseTransport *ts) {
                 RequestContext *ctx = NULL;
                 curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &ctx);
 
+                http_record_response(msg->easy_handle, msg->data.result);
+
                 if (ctx) {
                     HTTPResponse res = {0};
                     res.result = msg->data.result;
                     res.data = ctx->data;
                     res.length = ctx->length;
+                    res.easy = msg->easy_handle;
 
                     curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE,
                                       &res.status);
+                    if (ctx->url && res.result == CURLE_OK) {
+                        recording_write_http_response(ctx->url, res.status,
+                                                      res.data, res.length);
+                    }
 
                     if (ctx->on_done) {
-                        ctx->on_done(&res, ctx->user_data);
+                        STALL_CALL("http", ctx->on_done, &res, ctx->user_data);
                     }
 
                     request_free(ctx);
@@ -140,158 +321,395 @@ static void handle_multi_messages(MuseTransport *ts) {
     }
 }
 
-void transport_init(MuseTransport *ts, const char *user_agent, WSCallbacks cbs,
+void transport_init(MuseTransport *ts, const char *user_agent,
                     void *user_data) {
     ts->multi = curl_multi_init();
     ts->epfd = epoll_create1(0);
     ts->user_agent = user_agent;
-    ts->ws_callbacks = cbs;
+    ts->ca_file = NULL;
     ts->user_data = user_data;
+    ts->websockets = NULL;
+    ts->replay_responses = NULL;
+    atomic_init(&ts->virtual_woken, false);
+    // No timer until curl sets one, an idle transport sleeps the full poll
+    ts->timeout_ms = -1;
 
     curl_multi_setopt(ts->multi, CURLMOPT_SOCKETFUNCTION, socket_callback);
     curl_multi_setopt(ts->multi, CURLMOPT_SOCKETDATA, ts);
     curl_multi_setopt(ts->multi, CURLMOPT_TIMERFUNCTION, timer_callback);
     curl_multi_setopt(ts->multi, CURLMOPT_TIMERDATA, ts);
+
+#ifdef __linux__
+    // Registered with a NULL context, which no curl socket has
+    ts->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (ts->wake_fd >= 0) {
+        struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+        epoll_ctl(ts->epfd, EPOLL_CTL_ADD, ts->wake_fd, &ev);
+    }
+#endif
+}
+
+void transport_set_ca_file(MuseTransport *ts, const char *path) {
+    ts->ca_file = path;
 }
 
-bool transport_is_ws_open(MuseTransport *ts) { return ts->ws_easy != NULL; }
+void transport_wake(MuseTransport *ts) {
+    if (clock_is_virtual())
+        clock_virtual_wake(&ts->virtual_woken);
+#ifdef __linux__
+    if (ts->wake_fd >= 0) {
+        uint64_t one = 1;
+        ssize_t written = write(ts->wake_fd, &one, sizeof(one));
+        (void)written;
+    }
+#else
+    (void)ts;
+#endif
+}
+
+void transport_ws_init(MuseWebSocket *ws, MuseTransport *ts, WSCallbacks cbs,
+                       void *user_data) {
+    memset(ws, 0, sizeof(*ws));
+    ws->ts = ts;
+    ws->callbacks = cbs;
+    ws->user_data = user_data;
+    ws->stream = atomic_fetch_add(&next_stream, 1);
+
+    ws->next = ts->websockets;
+    ts->websockets = ws;
+}
+
+bool transport_is_ws_open(MuseWebSocket *ws) {
+    return ws->easy != NULL || ws->replaying;
+}
+
+// Echoes the server's close code as RFC 6455 asks, then reports it
+static void handle_close_frame(MuseWebSocket *ws, const uint8_t *payload,
+                               size_t length) {
+    char reason[WS_MAX_CLOSE_REASON + 1];
+    int32_t code = WS_CLOSE_NO_STATUS;
+    size_t reason_length = 0;
+
+    if (length >= 2) {
+        code = (int32_t)((payload[0] << 8) | payload[1]);
+        reason_length = length - 2;
+        if (reason_length > WS_MAX_CLOSE_REASON)
+            reason_length = WS_MAX_CLOSE_REASON;
+        memcpy(reason, payload + 2, reason_length);
+        ws_send_close_frame(ws, code, NULL);
+    } else {
+        ws_send_close_frame(ws, WS_CLOSE_NORMAL, NULL);
+    }
+    reason[reason_length] = '\0';
+
+    ws_disconnect(ws, code, reason);
+}
 
-static void drain_ws_messages(MuseTransport *ts) {
+static void drain_ws_messages(MuseWebSocket *ws) {
     size_t rlen;
     const struct curl_ws_frame *meta;
     char chunk[4096];
 
-    for (;;) {
+    while (ws->easy) {
         CURLcode res =
-            curl_ws_recv(ts->ws_easy, chunk, sizeof(chunk), &rlen, &meta);
+            curl_ws_recv(ws->easy, chunk, sizeof(chunk), &rlen, &meta);
 
         if (res == CURLE_AGAIN) {
             break;
         }
 
         if (res != CURLE_OK) {
-            transport_ws_close(ts);
+            ws_disconnect(ws, WS_CLOSE_ABNORMAL, curl_easy_strerror(res));
             break;
         }
 
+        metric_add(&ws_bytes_received_total, (int64_t)rlen);
         bool is_data = (meta->flags & (CURLWS_TEXT | CURLWS_BINARY));
         bool is_cont = (meta->flags & CURLWS_CONT);
 
+        // Control frames are never fragmented and fit in one chunk
+        if (meta->flags & CURLWS_CLOSE) {
+            handle_close_frame(ws, (const uint8_t *)chunk, rlen);
+            break;
+        }
+#ifdef CURLWS_NOAUTOPONG
+        if (meta->flags & CURLWS_PING) {
+            size_t sent;
+            curl_ws_send(ws->easy, chunk, rlen, &sent, 0, CURLWS_PONG);
+            continue;
+        }
+#endif
+
         if (is_data && rlen > 0) {
-            buffer_append(&ts->current_message, chunk, rlen);
-        } else {
-            // TODO: Handle pings/pongs/close frames
+            buffer_append_tagged(&ws->current_message, chunk, rlen,
+                                 ALLOC_TRANSPORT);
         }
 
         // https://curl.se/libcurl/c/curl_ws_meta.html#CURLWSCONT
         if (is_data && !is_cont && meta->bytesleft == 0) {
-            if (ts->ws_callbacks.on_message && ts->current_message.length > 0) {
-                ts->ws_callbacks.on_message(ts, ts->current_message.data,
-                                            ts->current_message.length);
+            if (recording_enabled()) {
+                recording_write_ws_frame(ws->stream, ws->current_message.data,
+                                         ws->current_message.length);
             }
-            ts->current_message.length = 0;
+            if (ws->callbacks.on_message && ws->current_message.length > 0) {
+                STALL_CALL("ws message", ws->callbacks.on_message, ws,
+                           ws->current_message.data,
+                           ws->current_message.length);
+            }
+            ws->current_message.length = 0;
+        }
+    }
+}
+
+static void replay_ws_messages(MuseWebSocket *ws) {
+    for (int32_t i = 0; i < REPLAY_FRAMES_PER_POLL && ws->replaying; i++) {
+        const ReplayFrame *frame = replay_next_frame(ws->stream);
+        if (!frame)
+            break;
+        if (ws->callbacks.on_message && frame->length > 0) {
+            STALL_CALL("ws message", ws->callbacks.on_message, ws, frame->data,
+                       frame->length);
+        }
+    }
+}
+
+static void replay_http_request(MuseTransport *ts, const char *url,
+                                HTTPCallback on_done, void *user_data) {
+    ReplayResponse *response =
+        alloc_malloc(ALLOC_TRANSPORT, sizeof(*response));
+    if (!response) {
+        fprintf(stderr, "error: out of memory");
+        exit(1);
+    }
+    response->fixture = replay_find_fixture(url);
+    response->on_done = on_done;
+    response->user_data = user_data;
+    if (!response->fixture)
+        log_warn(LOG_TRANSPORT, "Replay has no response for %s", url);
+
+    // Answered in order
+    ReplayResponse **link = &ts->replay_responses;
+    while (*link) {
+        link = &(*link)->next;
+    }
+    response->next = NULL;
+    *link = response;
+    replay_response_queued();
+}
+
+static void replay_http_responses(MuseTransport *ts) {
+    // Callbacks may queue more requests, those wait for the next poll
+    ReplayResponse *response = ts->replay_responses;
+    ts->replay_responses = NULL;
+
+    while (response) {
+        ReplayResponse *next = response->next;
+        HTTPResponse res = {.result = CURLE_COULDNT_CONNECT};
+        if (response->fixture) {
+            res.result = CURLE_OK;
+            res.status = response->fixture->status;
+            res.data = (uint8_t *)response->fixture->body;
+            res.length = response->fixture->length;
+        }
+        if (response->on_done) {
+            STALL_CALL("http", response->on_done, &res, response->user_data);
+        }
+        alloc_free(response);
+        replay_response_delivered();
+        response = next;
+    }
+}
+
+// No wait while a replay has frames or responses to deliver, and at most a
+// millisecond otherwise so a replay's timing isn't skewed by idle polls. A
+// virtual clock instead jumps straight to the next frame.
+static int64_t replay_wait_ms(MuseTransport *ts, int64_t wait_ms) {
+    if (ts->replay_responses)
+        return 0;
+
+    for (MuseWebSocket *ws = ts->websockets; ws; ws = ws->next) {
+        if (!ws->replaying)
+            continue;
+        int64_t due_us = replay_next_due_us();
+        if (due_us == 0)
+            return 0;
+        if (due_us > 0 && clock_is_virtual()) {
+            int64_t due_ms = (due_us + 999) / 1000;
+            return due_ms < wait_ms ? due_ms : wait_ms;
         }
     }
+    if (clock_is_virtual())
+        return wait_ms;
+    return wait_ms < 1 ? wait_ms : 1;
 }
 
-void transport_poll(MuseTransport *ts, int64_t default_timeout_ms) {
+void transport_poll(MuseTransport *ts, int64_t max_timeout_ms) {
     int64_t wait_ms = ts->timeout_ms;
-    if (wait_ms < 0)
-        wait_ms = default_timeout_ms;
+    if (wait_ms < 0 || wait_ms > max_timeout_ms)
+        wait_ms = max_timeout_ms;
     if (wait_ms == 0)
         wait_ms = 1;
+    if (replay_enabled())
+        wait_ms = replay_wait_ms(ts, wait_ms);
 
     struct epoll_event events[16];
-    int num_fds = epoll_wait(
-        ts->epfd, events, sizeof(events) / sizeof(events[0]), (int32_t)wait_ms);
+    int max_events = sizeof(events) / sizeof(events[0]);
+    int num_fds;
+    if (clock_is_virtual()) {
+        // Sockets are real and checked without waiting, only time is slept
+        num_fds = epoll_wait(ts->epfd, events, max_events, 0);
+        if (num_fds == 0 && wait_ms > 0) {
+            clock_virtual_sleep_us((uint64_t)wait_ms * 1000,
+                                   &ts->virtual_woken);
+            num_fds = epoll_wait(ts->epfd, events, max_events, 0);
+        }
+    } else {
+        num_fds = epoll_wait(ts->epfd, events, max_events, (int32_t)wait_ms);
+    }
+    uint64_t iteration_started_us = stall_begin();
 
     if (num_fds > 0) { // Convert epoll events to curl actions
         for (int i = 0; i < num_fds; i++) {
             SocketContext *ctx = (SocketContext *)events[i].data.ptr;
+#ifdef __linux__
+            if (!ctx) {
+                uint64_t wakeups;
+                ssize_t got = read(ts->wake_fd, &wakeups, sizeof(wakeups));
+                (void)got;
+                continue;
+            }
+#endif
+            // Drained with the other websockets below
+            if (ctx->ws)
+                continue;
+            if (ctx->on_ready) {
+                int32_t ready =
+                    (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)
+                         ? TRANSPORT_SOCKET_READABLE
+                         : 0) |
+                    (events[i].events & EPOLLOUT ? TRANSPORT_SOCKET_WRITABLE
+                                                 : 0);
+                STALL_CALL("socket", ctx->on_ready, ctx->user_data, ready);
+                continue;
+            }
             int action = (events[i].events & EPOLLIN ? CURL_CSELECT_IN : 0) |
                          (events[i].events & EPOLLOUT ? CURL_CSELECT_OUT : 0);
-            curl_multi_socket_action(ts->multi, ctx->sockfd, action,
-                                     &ts->running_handles);
+            // TLS handshakes and decompression run in here
+            STALL_CALL("curl", curl_multi_socket_action, ts->multi,
+                       ctx->sockfd, action, &ts->running_handles);
         }
     } else { // epoll timeout handling
-        curl_multi_socket_action(ts->multi, CURL_SOCKET_TIMEOUT, 0,
-                                 &ts->running_handles);
+        STALL_CALL("curl", curl_multi_socket_action, ts->multi,
+                   CURL_SOCKET_TIMEOUT, 0, &ts->running_handles);
     }
 
     // Handle multi messages
     handle_multi_messages(ts);
-    curl_multi_socket_action(ts->multi, CURL_SOCKET_TIMEOUT, 0,
-                             &ts->running_handles);
+    if (ts->replay_responses)
+        replay_http_responses(ts);
+    STALL_CALL("curl", curl_multi_socket_action, ts->multi,
+               CURL_SOCKET_TIMEOUT, 0, &ts->running_handles);
+
+    for (MuseWebSocket *ws = ts->websockets; ws; ws = ws->next) {
+        // Fire websocket on connect once
+        if (ws->handshake_done && !ws->on_connect_fired) {
+            ws->on_connect_fired = true;
+            if (ws->callbacks.on_connect) {
+                STALL_CALL("ws connect", ws->callbacks.on_connect, ws);
+            }
+        }
 
-    // Fire websocket on connect once
-    if (ts->ws_handshake_done && !ts->ws_on_connect_fired) {
-        ts->ws_on_connect_fired = true;
-        if (ts->ws_callbacks.on_connect) {
-            ts->ws_callbacks.on_connect(ts);
+        // Drain websocket messages
+        if (ws->easy && ws->handshake_done) {
+            drain_ws_messages(ws);
+        } else if (ws->replaying) {
+            replay_ws_messages(ws);
         }
     }
 
-    // Drain websocket messages
-    if (ts->ws_easy && ts->ws_handshake_done) {
-        drain_ws_messages(ts);
-    }
+    stall_end_iteration(iteration_started_us);
 }
 
-void transport_ws_open(MuseTransport *ts, const char *url) {
-    if (ts->ws_easy) {
-        transport_ws_close(ts);
+void transport_ws_open(MuseWebSocket *ws, const char *url) {
+    MuseTransport *ts = ws->ts;
+
+    if (ws->easy) {
+        transport_ws_close(ws, WS_CLOSE_NORMAL, NULL);
+    }
+
+    // Connects at once, frames come from the replay's stream
+    if (replay_enabled()) {
+        ws->replaying = true;
+        ws->handshake_done = true;
+        return;
     }
 
     CURL *ws_easy = curl_easy_init();
     curl_easy_setopt(ws_easy, CURLOPT_URL, url);
     curl_easy_setopt(ws_easy, CURLOPT_USERAGENT, ts->user_agent);
+    if (ts->ca_file)
+        curl_easy_setopt(ws_easy, CURLOPT_CAINFO, ts->ca_file);
     curl_easy_setopt(ws_easy, CURLOPT_CONNECT_ONLY,
                      CURLOPT_CONNECT_ONLY_HEADERS);
+#ifdef CURLWS_NOAUTOPONG
+    // Pings are answered in drain_ws_messages with the same payload
+    curl_easy_setopt(ws_easy, CURLOPT_WS_OPTIONS, (long)CURLWS_NOAUTOPONG);
+#endif
     // Set to NULL to not confuse with request handles
     curl_easy_setopt(ws_easy, CURLOPT_PRIVATE, NULL);
 
     curl_multi_add_handle(ts->multi, ws_easy);
-    ts->ws_easy = ws_easy;
+    ws->easy = ws_easy;
 
     // Kickstart the connection process
     curl_multi_socket_action(ts->multi, CURL_SOCKET_TIMEOUT, 0,
                              &ts->running_handles);
 }
 
-void transport_ws_close(MuseTransport *t) {
-    if (t->ws_easy) {
-        curl_multi_remove_handle(t->multi, t->ws_easy);
-        curl_easy_cleanup(t->ws_easy);
-        t->ws_easy = NULL;
-    }
-    t->ws_handshake_done = false;
-    t->ws_on_connect_fired = false;
-    t->current_message.length = 0;
+void transport_ws_close(MuseWebSocket *ws, int32_t code, const char *reason) {
+    if (ws->easy && ws->handshake_done)
+        ws_send_close_frame(ws, code, reason);
 
-    if (t->ws_callbacks.on_disconnect)
-        t->ws_callbacks.on_disconnect(t);
+    ws_disconnect(ws, code, reason);
 }
 
-CURLcode transport_ws_send(MuseTransport *ts, const uint8_t *data,
+CURLcode transport_ws_send(MuseWebSocket *ws, const uint8_t *data,
                            size_t length) {
-    if (!ts->ws_handshake_done)
+    if (!ws->handshake_done)
         return CURLE_COULDNT_CONNECT;
-
-    size_t sent;
-    return curl_ws_send(ts->ws_easy, data, length, &sent, 0, CURLWS_TEXT);
+    // Sends go nowhere, the replay already holds the server's answers
+    if (ws->replaying)
+        return CURLE_OK;
+
+    size_t sent = 0;
+    CURLcode result = curl_ws_send(ws->easy, data, length, &sent, 0,
+                                   CURLWS_TEXT);
+    metric_add(&ws_bytes_sent_total, (int64_t)sent);
+    return result;
 }
 
-CURLcode transport_ws_send_json(MuseTransport *ts, const cJSON *data) {
-    char *json_str = cJSON_PrintUnformatted(data);
-    if (!json_str) {
-        return CURLE_FAILED_INIT;
+// Closes the connection without callbacks and unlinks it from the transport
+void transport_ws_destroy(MuseWebSocket *ws) {
+    MuseTransport *ts = ws->ts;
+
+    ws_unwatch_socket(ws);
+    if (ws->easy) {
+        curl_multi_remove_handle(ts->multi, ws->easy);
+        curl_easy_cleanup(ws->easy);
+        ws->easy = NULL;
     }
 
-    CURLcode res =
-        transport_ws_send(ts, (const uint8_t *)json_str, strlen(json_str));
-    free(json_str);
+    for (MuseWebSocket **link = &ts->websockets; *link;
+         link = &(*link)->next) {
+        if (*link == ws) {
+            *link = ws->next;
+            break;
+        }
+    }
 
-    return res;
+    alloc_free(ws->current_message.data);
+    ws->current_message.data = NULL;
+    ws->current_message.capacity = 0;
 }
 
 static size_t http_write_callback(void *data, size_t size, size_t nmemb,
@@ -299,7 +717,7 @@ static size_t http_write_callback(void *data, size_t size, size_t nmemb,
     size_t realsize = size * nmemb;
     RequestContext *ctx = (RequestContext *)userp;
 
-    buffer_append(ctx, data, realsize);
+    buffer_append_tagged(ctx, data, realsize, ALLOC_TRANSPORT);
     if (!ctx->data) {
         return 0;
     }
@@ -307,33 +725,87 @@ static size_t http_write_callback(void *data, size_t size, size_t nmemb,
     return realsize;
 }
 
-void transport_url_encode(const char *input, char *output, size_t output_size) {
-    CURL *curl = curl_easy_init();
-    if (curl) {
-        char *encoded = curl_easy_escape(curl, input, 0);
-        snprintf(output, output_size, "%s", encoded);
-        curl_free(encoded);
-        curl_easy_cleanup(curl);
+// RFC 3986 unreserved characters, the only ones curl_easy_escape keeps
+static const uint8_t url_unreserved[256] = {
+    ['-'] = 1, ['.'] = 1, ['0'] = 1, ['1'] = 1, ['2'] = 1, ['3'] = 1, ['4'] = 1,
+    ['5'] = 1, ['6'] = 1, ['7'] = 1, ['8'] = 1, ['9'] = 1, ['A'] = 1, ['B'] = 1,
+    ['C'] = 1, ['D'] = 1, ['E'] = 1, ['F'] = 1, ['G'] = 1, ['H'] = 1, ['I'] = 1,
+    ['J'] = 1, ['K'] = 1, ['L'] = 1, ['M'] = 1, ['N'] = 1, ['O'] = 1, ['P'] = 1,
+    ['Q'] = 1, ['R'] = 1, ['S'] = 1, ['T'] = 1, ['U'] = 1, ['V'] = 1, ['W'] = 1,
+    ['X'] = 1, ['Y'] = 1, ['Z'] = 1, ['_'] = 1, ['a'] = 1, ['b'] = 1, ['c'] = 1,
+    ['d'] = 1, ['e'] = 1, ['f'] = 1, ['g'] = 1, ['h'] = 1, ['i'] = 1, ['j'] = 1,
+    ['k'] = 1, ['l'] = 1, ['m'] = 1, ['n'] = 1, ['o'] = 1, ['p'] = 1, ['q'] = 1,
+    ['r'] = 1, ['s'] = 1, ['t'] = 1, ['u'] = 1, ['v'] = 1, ['w'] = 1, ['x'] = 1,
+    ['y'] = 1, ['z'] = 1, ['~'] = 1,
+};
+
+static const char url_hex_digits[] = "0123456789ABCDEF";
+
+bool transport_url_encode(const char *input, char *output, size_t output_size) {
+    size_t n = 0;
+
+    for (const uint8_t *p = (const uint8_t *)input; *p; p++) {
+        if (url_unreserved[*p]) {
+            if (n + 1 >= output_size)
+                goto overflow;
+            output[n++] = (char)*p;
+        } else {
+            if (n + 3 >= output_size)
+                goto overflow;
+            output[n++] = '%';
+            output[n++] = url_hex_digits[*p >> 4];
+            output[n++] = url_hex_digits[*p & 0x0f];
+        }
+    }
+    output[n] = '\0';
+    return true;
+
+overflow:
+    if (output_size > 0)
+        output[n] = '\0';
+    return false;
+}
+
+static struct curl_slist *copy_headers(struct curl_slist *headers,
+                                       const struct curl_slist *extra_headers) {
+    const struct curl_slist *hdr = extra_headers;
+    while (hdr) {
+        headers = curl_slist_append(headers, hdr->data);
+        hdr = hdr->next;
     }
+    return headers;
 }
 
 void transport_http_get(MuseTransport *ts, const char *url,
+                        const struct curl_slist *extra_headers,
                         HTTPCallback on_done, void *user_data) {
+    if (replay_enabled()) {
+        replay_http_request(ts, url, on_done, user_data);
+        return;
+    }
+
     CURL *easy = curl_easy_init();
-    RequestContext *ctx = calloc(1, sizeof(RequestContext));
+    RequestContext *ctx =
+        alloc_calloc(ALLOC_TRANSPORT, 1, sizeof(RequestContext));
     ctx->on_done = on_done;
     ctx->user_data = user_data;
+    if (recording_enabled())
+        ctx->url = alloc_strdup(ALLOC_TRANSPORT, url);
 
 #ifdef TRANSPORT_HTTP_GET_DEBUG
     curl_easy_setopt(easy, CURLOPT_VERBOSE, 1L);
 #endif
     curl_easy_setopt(easy, CURLOPT_URL, url);
+    curl_easy_setopt(easy, CURLOPT_HTTPHEADER, extra_headers);
     curl_easy_setopt(easy, CURLOPT_USERAGENT, ts->user_agent);
+    if (ts->ca_file)
+        curl_easy_setopt(easy, CURLOPT_CAINFO, ts->ca_file);
     curl_easy_setopt(easy, CURLOPT_FOLLOWLOCATION, 1L);
     curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, http_write_callback);
     curl_easy_setopt(easy, CURLOPT_WRITEDATA, ctx);
     curl_easy_setopt(easy, CURLOPT_PRIVATE, ctx);
 
+    metric_add(&http_in_flight, 1);
     curl_multi_add_handle(ts->multi, easy);
 }
 
@@ -342,30 +814,39 @@ void transport_http_post(MuseTransport *ts, const char *url,
                          const char *content_type,
                          const struct curl_slist *extra_headers,
                          HTTPCallback on_done, void *user_data) {
+    if (replay_enabled()) {
+        replay_http_request(ts, url, on_done, user_data);
+        return;
+    }
+
     CURL *easy = curl_easy_init();
-    RequestContext *ctx = calloc(1, sizeof(RequestContext));
+    RequestContext *ctx =
+        alloc_calloc(ALLOC_TRANSPORT, 1, sizeof(RequestContext));
     ctx->on_done = on_done;
     ctx->user_data = user_data;
+    if (recording_enabled())
+        ctx->url = alloc_strdup(ALLOC_TRANSPORT, url);
 
-    ctx->request_body = malloc(content_length);
+    ctx->request_body = alloc_malloc(ALLOC_TRANSPORT, content_length);
     memcpy(ctx->request_body, body, content_length);
 
-    char header[256];
-    snprintf(header, sizeof(header), "Content-Type: %s", content_type);
-    ctx->headers = curl_slist_append(NULL, header);
-
-    const struct curl_slist *hdr = extra_headers;
-    while (hdr) {
-        ctx->headers = curl_slist_append(ctx->headers, hdr->data);
-        hdr = hdr->next;
+    // Only a Content-Type needs a list of the request's own
+    if (content_type) {
+        char header[256];
+        snprintf(header, sizeof(header), "Content-Type: %s", content_type);
+        ctx->headers =
+            copy_headers(curl_slist_append(NULL, header), extra_headers);
     }
 
 #ifdef TRANSPORT_HTTP_POST_DEBUG
     curl_easy_setopt(easy, CURLOPT_VERBOSE, 1L);
 #endif
     curl_easy_setopt(easy, CURLOPT_URL, url);
-    curl_easy_setopt(easy, CURLOPT_HTTPHEADER, ctx->headers);
+    curl_easy_setopt(easy, CURLOPT_HTTPHEADER,
+                     ctx->headers ? ctx->headers : extra_headers);
     curl_easy_setopt(easy, CURLOPT_USERAGENT, ts->user_agent);
+    if (ts->ca_file)
+        curl_easy_setopt(easy, CURLOPT_CAINFO, ts->ca_file);
     curl_easy_setopt(easy, CURLOPT_POSTFIELDS, ctx->request_body);
     curl_easy_setopt(easy, CURLOPT_POSTFIELDSIZE, (long)content_length);
     curl_easy_setopt(easy, CURLOPT_FOLLOWLOCATION, 1L);
@@ -373,9 +854,62 @@ void transport_http_post(MuseTransport *ts, const char *url,
     curl_easy_setopt(easy, CURLOPT_WRITEDATA, ctx);
     curl_easy_setopt(easy, CURLOPT_PRIVATE, ctx);
 
+    metric_add(&http_in_flight, 1);
     curl_multi_add_handle(ts->multi, easy);
 }
 
+const char *transport_http_header(const HTTPResponse *res, const char *name) {
+    struct curl_header *header;
+
+    if (!res->easy || curl_easy_header(res->easy, name, 0, CURLH_HEADER, -1,
+                                       &header) != CURLHE_OK) {
+        return NULL;
+    }
+    return header->value;
+}
+
+static uint32_t watch_events(int32_t interest) {
+    return (interest & TRANSPORT_SOCKET_READABLE ? EPOLLIN : 0) |
+           (interest & TRANSPORT_SOCKET_WRITABLE ? EPOLLOUT : 0);
+}
+
+SocketContext *transport_watch_socket(MuseTransport *ts, curl_socket_t sockfd,
+                                      int32_t interest,
+                                      SocketCallback on_ready,
+                                      void *user_data) {
+    SocketContext *ctx = alloc_calloc(ALLOC_TRANSPORT, 1, sizeof(*ctx));
+    if (!ctx) {
+        fprintf(stderr, "error: out of memory");
+        exit(1);
+    }
+    ctx->sockfd = sockfd;
+    ctx->on_ready = on_ready;
+    ctx->user_data = user_data;
+
+    struct epoll_event ev = {.events = watch_events(interest), .data.ptr = ctx};
+    if (epoll_ctl(ts->epfd, EPOLL_CTL_ADD, sockfd, &ev) == -1) {
+        log_error(LOG_TRANSPORT, "Failed to watch socket: %s",
+                  strerror(errno));
+        alloc_free(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+void transport_watch_interest(MuseTransport *ts, SocketContext *watch,
+                              int32_t interest) {
+    struct epoll_event ev = {.events = watch_events(interest),
+                             .data.ptr = watch};
+    epoll_ctl(ts->epfd, EPOLL_CTL_MOD, watch->sockfd, &ev);
+}
+
+void transport_unwatch_socket(MuseTransport *ts, SocketContext *watch) {
+    if (!watch)
+        return;
+    epoll_ctl(ts->epfd, EPOLL_CTL_DEL, watch->sockfd, NULL);
+    alloc_free(watch);
+}
+
 void transport_destroy(MuseTransport *ts) {
     if (!ts)
         return;
@@ -384,7 +918,7 @@ void transport_destroy(MuseTransport *ts) {
     CURL **handles = curl_multi_get_handles(ts->multi);
     if (handles) {
         for (int i = 0; handles[i]; i++) {
-            if (handles[i] == ts->ws_easy)
+            if (find_websocket(ts, handles[i]))
                 continue;
 
             void *ptr;
@@ -393,6 +927,7 @@ void transport_destroy(MuseTransport *ts) {
             if (ptr) {
                 request_free((RequestContext *)ptr);
             }
+            metric_add(&http_in_flight, -1);
 
             curl_multi_remove_handle(ts->multi, handles[i]);
             curl_easy_cleanup(handles[i]);
@@ -400,14 +935,23 @@ void transport_destroy(MuseTransport *ts) {
         curl_free(handles);
     }
 
-    if (ts->ws_easy) {
-        curl_multi_remove_handle(ts->multi, ts->ws_easy);
-        curl_easy_cleanup(ts->ws_easy);
-        ts->ws_easy = NULL;
+    while (ts->replay_responses) {
+        ReplayResponse *next = ts->replay_responses->next;
+        alloc_free(ts->replay_responses);
+        replay_response_delivered();
+        ts->replay_responses = next;
+    }
+
+    while (ts->websockets) {
+        transport_ws_destroy(ts->websockets);
     }
 
     curl_multi_cleanup(ts->multi);
 
+#ifdef __linux__
+    if (ts->wake_fd >= 0)
+        close(ts->wake_fd);
+#endif
     if (ts->epfd) {
 #ifndef _WIN32
         close(ts->epfd);
@@ -415,6 +959,4 @@ void transport_destroy(MuseTransport *ts) {
         epoll_close(ts->epfd);
 #endif
     }
-
-    free(ts->current_message.data);
 }
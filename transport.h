@@ -1,8 +1,8 @@
 #ifndef TRANSPORT_H
 #define TRANSPORT_H
 
-#include <cjson/cJSON.h>
 #include <curl/curl.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 
@@ -14,11 +14,26 @@
 #endif
 
 typedef struct MuseTransport MuseTransport;
+typedef struct MuseWebSocket MuseWebSocket;
+// A descriptor in the transport's epoll set
+typedef struct SocketContext SocketContext;
+
+// https://datatracker.ietf.org/doc/html/rfc6455#section-7.4.1
+#define WS_CLOSE_NORMAL (1000)
+#define WS_CLOSE_GOING_AWAY (1001)
+// Reported, never sent: the close frame had no status code
+#define WS_CLOSE_NO_STATUS (1005)
+// Reported, never sent: the connection dropped without a close frame
+#define WS_CLOSE_ABNORMAL (1006)
+// Control frame payloads are at most 125 bytes, 2 of them the close code
+#define WS_MAX_CLOSE_REASON (123)
 
 typedef struct {
-    void (*on_connect)(struct MuseTransport *ts);
-    void (*on_disconnect)(struct MuseTransport *ts);
-    void (*on_message)(struct MuseTransport *ts, const uint8_t *data,
+    void (*on_connect)(struct MuseWebSocket *ws);
+    // The server's or our own close code and reason, reason is never NULL
+    void (*on_disconnect)(struct MuseWebSocket *ws, int32_t code,
+                          const char *reason);
+    void (*on_message)(struct MuseWebSocket *ws, const uint8_t *data,
                        size_t length);
 } WSCallbacks;
 
@@ -28,17 +43,51 @@ typedef struct {
     // status code is a long in curl
     int64_t status;
     CURLcode result;
+    // For transport_http_header
+    CURL *easy;
 } HTTPResponse;
 
 // NOTE: The data in the response is only valid within the callback
 typedef void (*HTTPCallback)(HTTPResponse *res, void *user_data);
 
+// Readiness flags for transport_watch_socket
+#define TRANSPORT_SOCKET_READABLE (1 << 0)
+#define TRANSPORT_SOCKET_WRITABLE (1 << 1)
+
+// May unwatch its own socket but no other, events for the rest of the poll
+// are already collected
+typedef void (*SocketCallback)(void *user_data, int32_t ready);
+
 typedef struct {
     uint8_t *data;
     size_t length;
     size_t capacity;
 } WSMessage;
 
+// One WebSocket connection, any number of which can share a transport
+typedef struct MuseWebSocket {
+    MuseTransport *ts;
+    CURL *easy;
+
+    bool handshake_done;
+    bool on_connect_fired;
+
+    void *user_data;
+
+    WSCallbacks callbacks;
+    WSMessage current_message;
+    // Our epoll registration once the handshake is done, curl stops polling
+    // connect-only handles at that point
+    void *poll_context;
+    // Identifies the connection in recordings, in initialization order
+    uint32_t stream;
+    // Open on a replayed stream instead of the network
+    bool replaying;
+
+    // Intrusive list of the transport's websockets
+    struct MuseWebSocket *next;
+} MuseWebSocket;
+
 typedef struct MuseTransport {
     CURLM *multi;
 #ifndef _WIN32
@@ -48,35 +97,72 @@ typedef struct MuseTransport {
 #endif
     int64_t timeout_ms;
     const char *user_agent;
-    CURL *ws_easy;
+    // NULL verifies peers against curl's default CA bundle
+    const char *ca_file;
     int running_handles;
 
-    bool ws_handshake_done;
-    bool ws_on_connect_fired;
-
     void *user_data;
+#ifdef __linux__
+    // eventfd in the epoll set, written by transport_wake
+    int wake_fd;
+#endif
+    // Ends a virtual-time sleep in transport_poll, set by transport_wake
+    atomic_bool virtual_woken;
 
-    WSCallbacks ws_callbacks;
-    WSMessage current_message;
+    MuseWebSocket *websockets;
+    // Responses served from a replay's fixtures on the next poll
+    struct ReplayResponse *replay_responses;
 } MuseTransport;
 
-void transport_init(MuseTransport *ts, const char *user_agent, WSCallbacks cbs,
+void transport_init(MuseTransport *ts, const char *user_agent,
                     void *user_data);
-bool transport_is_ws_open(MuseTransport *ts);
-void transport_poll(MuseTransport *ts, int64_t default_timeout_ms);
-void transport_ws_open(MuseTransport *ts, const char *url);
-void transport_ws_close(MuseTransport *t);
-CURLcode transport_ws_send(MuseTransport *ts, const uint8_t *data,
+// Trusts the certificates in path (PEM) instead of the default bundle, for
+// local stand-ins with self-signed certificates. NULL restores the default.
+void transport_set_ca_file(MuseTransport *ts, const char *path);
+// Waits for curl's next timeout, or at most max_timeout_ms
+void transport_poll(MuseTransport *ts, int64_t max_timeout_ms);
+// Makes a transport_poll waiting on another thread return early. Without
+// eventfd (outside Linux) the poll only ends at its timeout, unless the
+// clock is virtual.
+void transport_wake(MuseTransport *ts);
+void transport_ws_init(MuseWebSocket *ws, MuseTransport *ts, WSCallbacks cbs,
+                       void *user_data);
+bool transport_is_ws_open(MuseWebSocket *ws);
+void transport_ws_open(MuseWebSocket *ws, const char *url);
+// Sends a close frame with the code and reason (may be NULL) if the
+// handshake is done, then tears the connection down
+void transport_ws_close(MuseWebSocket *ws, int32_t code, const char *reason);
+CURLcode transport_ws_send(MuseWebSocket *ws, const uint8_t *data,
                            size_t length);
-CURLcode transport_ws_send_json(MuseTransport *ts, const cJSON *data);
-void transport_url_encode(const char *input, char *output, size_t output_size);
+void transport_ws_destroy(MuseWebSocket *ws);
+// Percent-encodes input like curl_easy_escape without allocating. False if
+// it doesn't fit, output is then truncated.
+bool transport_url_encode(const char *input, char *output, size_t output_size);
+// extra_headers isn't copied and must outlive the request, such as a list
+// built once at startup
 void transport_http_get(MuseTransport *ts, const char *url,
+                        const struct curl_slist *extra_headers,
                         HTTPCallback on_done, void *user_data);
+// With a NULL content_type, extra_headers carries it and is used as in
+// transport_http_get. Otherwise the request gets its own copy of them.
 void transport_http_post(MuseTransport *ts, const char *url,
                          const uint8_t *body, size_t content_length,
                          const char *content_type,
                          const struct curl_slist *extra_headers,
                          HTTPCallback on_done, void *user_data);
+// Last value of a response header, NULL if absent. Only valid within the
+// HTTPCallback, like the response data.
+const char *transport_http_header(const HTTPResponse *res, const char *name);
+// Calls on_ready from transport_poll while the socket is ready for any of
+// the interest flags. The socket stays the caller's to close, after
+// transport_unwatch_socket.
+SocketContext *transport_watch_socket(MuseTransport *ts, curl_socket_t sockfd,
+                                      int32_t interest,
+                                      SocketCallback on_ready,
+                                      void *user_data);
+void transport_watch_interest(MuseTransport *ts, SocketContext *watch,
+                              int32_t interest);
+void transport_unwatch_socket(MuseTransport *ts, SocketContext *watch);
 void transport_destroy(MuseTransport *ts);
 
 #endif // TRANSPORT_H